@@ -0,0 +1,167 @@
+// bench.c - Headless parser benchmark: `xst --bench <file>`.
+//
+// Replays a recorded byte stream through the terminal core with no X
+// connection and reports parser throughput. Record a stream with e.g.
+//   script -q -c 'ls -laR /usr' /tmp/ls.raw
+// and replay it with
+//   ./xst --bench /tmp/ls.raw
+//
+// `xst --bench-sgr` replays a built-in, escape-heavy stream instead:
+// colored `ls`, `git log --graph` and compiler diagnostics, the output
+// where parser cost (rather than cell writes) dominates.
+
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "term.h"
+#include "bench.h"
+
+// Replay the input until at least this much time has passed, so short
+// recordings still give a stable number.
+#define BENCH_MIN_SECONDS 1.0
+#define BENCH_COLS 80
+#define BENCH_ROWS 24
+#define BENCH_SGR_BYTES (4 << 20)
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench_replay(const char *name, const char *data, long size) {
+    Term term;
+    term_init(&term, BENCH_COLS, BENCH_ROWS, SCROLLBACK_LINES, (size_t)SPILL_MAX_MB << 20);
+
+    int passes = 0;
+    double start = now_seconds(), elapsed;
+    do {
+        term_write(&term, data, size);
+        passes++;
+        elapsed = now_seconds() - start;
+    } while (elapsed < BENCH_MIN_SECONDS);
+
+    const TermStats *s = &term.stats;
+    printf("input:    %s (%ld bytes, %d passes, %dx%d grid, %d lines scrollback)\n",
+           name, size, passes, BENCH_COLS, BENCH_ROWS, SCROLLBACK_LINES);
+    printf("time:     %.3f s\n", elapsed);
+    printf("parse:    %.1f MB/s\n", s->bytes / elapsed / 1e6);
+    printf("cells:    %llu (%.1f M/s)\n", s->cells, s->cells / elapsed / 1e6);
+    printf("scrolls:  %llu (%.1f K/s)\n", s->scrolls, s->scrolls / elapsed / 1e3);
+    TermMemory m;
+    term_memory(&term, &m);
+    printf("memory:   %.1f MB rows, %.1f MB spill buffers; %lld lines spilled, %.1f MB -> %.1f MB\n",
+           m.rows / 1e6, m.spill_ram / 1e6, m.spill_lines, m.spill_raw / 1e6, m.spill_disk / 1e6);
+
+    term_free(&term);
+    return 0;
+}
+
+
+static unsigned bench_rand_state = 1;
+
+static unsigned bench_rand(unsigned n) {
+    bench_rand_state = bench_rand_state * 1103515245u + 12345u;
+    return (bench_rand_state >> 16) % n;
+}
+
+static int append(char *buf, long *len, const char *s) {
+    size_t n = strlen(s);
+    if (*len + (long)n > BENCH_SGR_BYTES) return 0;
+    memcpy(buf + *len, s, n);
+    *len += n;
+    return 1;
+}
+
+// Builds BENCH_SGR_BYTES of output in the style of `ls --color`,
+// `git log --graph --oneline --decorate` and gcc diagnostics.
+static long bench_sgr_stream(char *buf) {
+    static const char *names[] = { "src", "term.c", "xst", "README.md", "build", "Makefile", "io.h", "a.out" };
+    static const char *ls_colors[] = { "01;34", "0", "01;32", "0", "01;34", "0", "0", "01;32" };
+    static const char *words[] = { "fix", "parser", "render", "scrollback", "glyph", "atlas", "resize", "cursor" };
+    char line[512];
+    long len = 0;
+    for (;;) {
+        switch (bench_rand(3)) {
+        case 0: // ls --color
+            line[0] = '\0';
+            for (int i = 0; i < 6; i++) {
+                int k = bench_rand(8);
+                snprintf(line + strlen(line), sizeof(line) - strlen(line),
+                         "\033[0m\033[%sm%s\033[0m  ", ls_colors[k], names[k]);
+            }
+            strcat(line, "\r\n");
+            break;
+        case 1: // git log --graph --oneline --decorate
+            snprintf(line, sizeof(line),
+                     "%s\033[33m%07x\033[m\033[33m (\033[m\033[1;36mHEAD -> \033[m\033[1;32mmaster\033[m"
+                     "\033[33m, \033[m\033[1;31morigin/master\033[m\033[33m)\033[m %s the %s\r\n",
+                     bench_rand(2) ? "* " : "\033[31m|\033[m * ", bench_rand(0xfffffff),
+                     words[bench_rand(8)], words[bench_rand(8)]);
+            break;
+        default: // gcc diagnostics
+            snprintf(line, sizeof(line),
+                     "\033[01m\033[K%s:%u:%u:\033[m\033[K \033[01;35m\033[Kwarning: \033[m\033[Kunused variable "
+                     "'\033[01m\033[K%s\033[m\033[K' [\033[01;35m\033[K-Wunused-variable\033[m\033[K]\r\n"
+                     "  %u |     int \033[01;35m\033[K%s\033[m\033[K;\r\n",
+                     names[bench_rand(8)], bench_rand(900) + 1, bench_rand(80) + 1, words[bench_rand(8)],
+                     bench_rand(900) + 1, words[bench_rand(8)]);
+            break;
+        }
+        if (!append(buf, &len, line)) return len;
+    }
+}
+
+int bench_sgr() {
+    char *data = malloc(BENCH_SGR_BYTES);
+    if (!data) die("malloc failed for bench input");
+    long size = bench_sgr_stream(data);
+    int ret = bench_replay("built-in SGR stream", data, size);
+    free(data);
+    return ret;
+}
+
+int bench_run(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (size <= 0) {
+        fprintf(stderr, "%s: empty input\n", path);
+        fclose(f);
+        return 1;
+    }
+    char *data = malloc(size);
+    if (!data) die("malloc failed for bench input");
+    if (fread(data, 1, size, f) != (size_t)size) {
+        perror(path);
+        fclose(f);
+        free(data);
+        return 1;
+    }
+    fclose(f);
+
+    int ret = bench_replay(path, data, size);
+    free(data);
+    return ret;
+}
+
+#ifdef XST_BENCH_MAIN
+// Standalone `xst-bench` entry point; links against the core only, so it
+// builds and runs on machines without X11 or GL development files.
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <file> | --sgr\n", argv[0]);
+        return 1;
+    }
+    if (strcmp(argv[1], "--sgr") == 0) return bench_sgr();
+    return bench_run(argv[1]);
+}
+#endif
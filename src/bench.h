@@ -0,0 +1,13 @@
+// bench.h - Headless parser benchmark.
+
+#ifndef XST_BENCH_H
+#define XST_BENCH_H
+
+// Replays the file at `path` through a fresh Term and prints throughput.
+// Returns a process exit status.
+int bench_run(const char *path);
+
+// Same, for a built-in stream of SGR-heavy output.
+int bench_sgr(void);
+
+#endif
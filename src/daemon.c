@@ -0,0 +1,336 @@
+// daemon.c - xst --daemon: every window in one process.
+//
+// The daemon loads the font once and serves xstc's requests (see
+// daemon.h) from the window event loop in xst.c: a "new" request opens a
+// window in this process, with the client's directory, environment and
+// options, on the X display the first client named. All windows share
+// the glyph cache, the FreeType face, the IO thread and, per renderer,
+// the GL atlas and image textures. The price is that they go together:
+// a crash takes every window with it.
+
+#define _GNU_SOURCE             // struct ucred
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "xst.h"
+#include "daemon.h"
+
+#define MAX_CLIENTS     32      // Requests being read at once
+#define REQUEST_TIMEOUT 2       // Seconds a client gets to send its request
+
+// Clients whose request is still coming in. Their sockets are
+// nonblocking and watched by the event loop, so a slow client holds up
+// nobody else, the windows included.
+typedef struct {
+    int fd;
+    char *buf;
+    size_t len, cap;
+    long long deadline;         // ms, CLOCK_MONOTONIC
+} Client;
+
+static Client clients[MAX_CLIENTS];
+static int nclients;
+static int listen_fd, deadline_fd;      // deadline_fd: a timerfd for the first client deadline
+static WinOptions options;              // The daemon's own, which a request's add to
+
+static void client_accept(int fd);
+
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// Arms deadline_fd for the first client deadline, or disarms it.
+static void deadline_arm() {
+    long long next = 0;
+    for (int i = 0; i < nclients; i++) {
+        if (!next || clients[i].deadline < next) next = clients[i].deadline;
+    }
+    struct itimerspec its = { .it_value = { next / 1000, next % 1000 * 1000000 } };
+    timerfd_settime(deadline_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+// This process's memory in kB, from /proc/self/smaps_rollup: what is
+// resident, and its proportional share of that (pss).
+static int memory_self(long *rss, long *pss) {
+    char line[256], key[64];
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (!f) return 0;
+    *rss = *pss = 0;
+    while (fgets(line, sizeof(line), f)) {
+        long v;
+        if (sscanf(line, "%63[^:]: %ld kB", key, &v) != 2) continue;
+        if (strcmp(key, "Rss") == 0) *rss = v;
+        else if (strcmp(key, "Pss") == 0) *pss = v;
+    }
+    fclose(f);
+    return 1;
+}
+
+static void write_all(int fd, const char *s, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, s, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return;
+        s += w;
+        n -= w;
+    }
+}
+
+static void reply(int fd, const char *s) {
+    write_all(fd, s, strlen(s));
+}
+
+// A line per window with what it takes on its own, then what they all
+// share: the font, and the process as a whole.
+static void list_windows(int fd) {
+    char line[160];
+    reply(fd, "    window renderer  rows kB spill kB images kB  snaps kB render kB    gpu kB\n");
+    for (int i = 0; i < window_count(); i++) {
+        WinMemory m;
+        window_memory(i, &m);
+        snprintf(line, sizeof(line), "%#10lx %-8s %8zu %8zu %9zu %9zu %9zu %9zu\n", m.xid, m.renderer,
+                 m.term.rows >> 10, m.term.spill_ram >> 10, m.term.images >> 10,
+                 m.snapshots >> 10, m.render_cpu >> 10, m.render_gpu >> 10);
+        reply(fd, line);
+    }
+    snprintf(line, sizeof(line), "%d windows; font %zu kB shared", window_count(),
+             ((size_t)font_atlas_w * font_atlas_h + sizeof(glyphs)) >> 10);
+    reply(fd, line);
+    long rss, pss;
+    if (memory_self(&rss, &pss)) {
+        snprintf(line, sizeof(line), "; process %ld kB resident, %ld kB pss", rss, pss);
+        reply(fd, line);
+    }
+    reply(fd, "\n");
+}
+
+// Finds NAME's value in a NULL-terminated environment.
+static const char *env_get(char **env, const char *name) {
+    size_t n = strlen(name);
+    for (; *env; env++) {
+        if (strncmp(*env, name, n) == 0 && (*env)[n] == '=') return *env + n + 1;
+    }
+    return NULL;
+}
+
+// s[0] is "new", s[1] the directory, then the environment up to an empty
+// string, then the options. The answer goes out once the window is open.
+static void window_new(int fd, char **s, int n) {
+    int i = 2;
+    while (i < n && s[i][0]) i++;
+    if (n < 2 || i == n) {
+        reply(fd, "error: malformed request\n");
+        return;
+    }
+    s[i] = NULL;
+    char **env = s + 2, **args = s + i + 1;
+    int nargs = n - i - 1;
+    WinOptions o = options;
+    char msg[320];
+    for (int argi = 0; argi < nargs; argi++) {
+        if (window_option(&o, nargs, args, &argi)) continue;
+        snprintf(msg, sizeof(msg), "error: unknown option %s\n", args[argi]);
+        reply(fd, msg);
+        return;
+    }
+    char err[256];
+    Win *w = NULL;
+    if (display_open(env_get(env, "DISPLAY"), err, sizeof(err))) w = window_open(&o, NULL, env, s[1], err, sizeof(err));
+    if (!w) {
+        snprintf(msg, sizeof(msg), "error: %s\n", err);
+        reply(fd, msg);
+        return;
+    }
+    snprintf(msg, sizeof(msg), "ok %#lx\n", window_id(w));
+    reply(fd, msg);
+    if (verbose) fprintf(stderr, "xst: daemon: window %#lx opened, %d in all\n", window_id(w), window_count());
+}
+
+// A complete request, len bytes in buf.
+static void serve(int fd, char *buf, size_t len) {
+    // The answer is small enough for the socket buffer; the timeout only
+    // covers a client that has stopped reading a long list.
+    struct timeval tv = { REQUEST_TIMEOUT, 0 };
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (len == 0 || buf[len - 1] != '\0') {
+        reply(fd, "error: malformed request\n");
+        return;
+    }
+
+    int n = 0;
+    for (size_t k = 0; k < len; k++) n += buf[k] == '\0';
+    char **s = malloc((n + 1) * sizeof(*s));
+    if (!s) die("malloc failed for request");
+    for (size_t k = 0, i = 0; k < len; k += strlen(buf + k) + 1) s[i++] = buf + k;
+    s[n] = NULL;
+
+    if (strcmp(s[0], "list") == 0) list_windows(fd);
+    else if (strcmp(s[0], "new") == 0) window_new(fd, s, n);
+    else reply(fd, "error: unknown request\n");
+    free(s);
+}
+
+static void client_drop(int i) {
+    loop_unwatch(clients[i].fd);
+    close(clients[i].fd);
+    free(clients[i].buf);
+    clients[i] = clients[--nclients];
+    if (nclients == MAX_CLIENTS - 1) loop_watch(listen_fd, client_accept);
+    deadline_arm();
+}
+
+// Reads what the client on fd has sent so far, and serves the request
+// once the client has shut down its side.
+static void client_read(int fd) {
+    int i = 0;
+    while (i < nclients && clients[i].fd != fd) i++;
+    if (i == nclients) return;
+    Client *c = &clients[i];
+    for (;;) {
+        if (c->len == c->cap) {
+            if (c->cap == DAEMON_REQUEST_MAX) {
+                reply(c->fd, "error: request too long\n");
+                client_drop(i);
+                return;
+            }
+            c->cap = c->cap ? c->cap * 2 : 4096;
+            if (c->cap > DAEMON_REQUEST_MAX) c->cap = DAEMON_REQUEST_MAX;
+            c->buf = realloc(c->buf, c->cap);
+            if (!c->buf) die("malloc failed for request");
+        }
+        ssize_t r = read(c->fd, c->buf + c->len, c->cap - c->len);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (r == 0) serve(c->fd, c->buf, c->len);
+        if (r <= 0) {
+            client_drop(i);
+            return;
+        }
+        c->len += r;
+    }
+}
+
+// New clients wait in the backlog while every slot is busy.
+static void client_accept(int fd) {
+    int c = accept(fd, NULL, NULL);
+    if (c < 0) return;
+    if (!daemon_peer_ok(c) || fcntl(c, F_SETFL, O_NONBLOCK) != 0) {
+        close(c);
+        return;
+    }
+    clients[nclients++] = (Client){ c, NULL, 0, 0, now_ms() + REQUEST_TIMEOUT * 1000 };
+    loop_watch(c, client_read);
+    if (nclients == MAX_CLIENTS) loop_unwatch(fd);
+    deadline_arm();
+}
+
+// Drops the clients that ran out of time.
+static void client_expire(int fd) {
+    uint64_t expired;
+    if (read(fd, &expired, sizeof(expired)) < 0) return;
+    long long now = now_ms();
+    for (int i = nclients - 1; i >= 0; i--) {
+        if (now >= clients[i].deadline) client_drop(i);
+    }
+    deadline_arm();
+}
+
+// The shells are the daemon's children; SIGTERM and SIGINT end it.
+static void signal_read(int fd) {
+    struct signalfd_siginfo si;
+    while (read(fd, &si, sizeof(si)) == sizeof(si)) {
+        if (si.ssi_signo == SIGCHLD) {
+            while (waitpid(-1, NULL, WNOHANG) > 0) {}
+        } else {
+            loop_quit();
+        }
+    }
+}
+
+int daemon_run(const WinOptions *defaults, const char *font_path, int font_size) {
+    options = *defaults;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (!daemon_socket_path(addr.sun_path, sizeof(addr.sun_path))) {
+        fprintf(stderr, "xst: daemon: %s\n", addr.sun_path);
+        return 1;
+    }
+    int ls = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (ls < 0) die("socket failed");
+    mode_t umask_was = umask(077);     // The socket is 0600
+    if (bind(ls, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        // A socket left behind by a daemon that died is taken over; one
+        // that still answers isn't.
+        int err = errno, probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (err != EADDRINUSE || connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            fprintf(stderr, "xst: daemon: can't listen on %s: %s\n", addr.sun_path,
+                    err == EADDRINUSE ? "a daemon is already running" : strerror(err));
+            return 1;
+        }
+        close(probe);
+        unlink(addr.sun_path);
+        if (bind(ls, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            perror(addr.sun_path);
+            return 1;
+        }
+    }
+    umask(umask_was);
+    if (listen(ls, 16) != 0) die("listen failed");
+    listen_fd = ls;
+
+    // Everything the windows share is loaded before the first one: the
+    // glyph cache, and the face that a cache miss needs.
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    font_init(font_path, font_size);
+    font_open();
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (verbose) {
+        fprintf(stderr, "xst: daemon: font loaded in %.2f ms, listening on %s\n",
+                (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6, addr.sun_path);
+    }
+
+    // Blocked before the IO thread exists, so that it leaves them to the
+    // signalfd too.
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    int sfd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sfd < 0) die("signalfd failed");
+    signal(SIGPIPE, SIG_IGN);    // Clients may leave before the answer
+    deadline_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (deadline_fd < 0) die("timerfd failed");
+
+    loop_watch(sfd, signal_read);
+    loop_watch(ls, client_accept);
+    loop_watch(deadline_fd, client_expire);
+    loop_run(1);
+
+    while (nclients) client_drop(0);
+    loop_unwatch(ls);
+    loop_unwatch(sfd);
+    loop_unwatch(deadline_fd);
+    close(ls);
+    close(sfd);
+    close(deadline_fd);
+    unlink(addr.sun_path);
+    return 0;
+}
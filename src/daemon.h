@@ -0,0 +1,58 @@
+// daemon.h - xst --daemon and its client, xstc.
+//
+// The daemon is one process holding every window (see daemon.c). A
+// request is a series of NUL-terminated strings, ended by the client
+// shutting down its side of the socket:
+//
+//   "new", cwd, environment ("NAME=value")..., "", xst options...
+//   "list"
+//
+// The answer is text: "ok <window id>\n" once the window is open, or
+// "error: ...\n", for "new", and a table of the windows and their memory
+// for "list".
+//
+// The socket sits in a directory only its user can get into, and both
+// ends check that the other runs as the same user (SO_PEERCRED), so
+// another local user can neither ask for a shell nor pose as the daemon
+// and collect a client's environment.
+
+#ifndef XST_DAEMON_H
+#define XST_DAEMON_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define DAEMON_REQUEST_MAX  (256 * 1024)
+
+// $XDG_RUNTIME_DIR/xst.sock, or /tmp/xst-<uid>/xst.sock without one (the
+// directory is made if missing). Returns 0, with the reason in buf, if
+// the directory isn't ours alone.
+static inline int daemon_socket_path(char *buf, size_t n) {
+    char dir[256];
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    if (runtime && *runtime) {
+        snprintf(dir, sizeof(dir), "%s", runtime);
+    } else {
+        snprintf(dir, sizeof(dir), "/tmp/xst-%d", (int)getuid());
+        mkdir(dir, 0700);
+    }
+    struct stat st;
+    if (lstat(dir, &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)) {
+        snprintf(buf, n, "%s is not a directory private to this user", dir);
+        return 0;
+    }
+    snprintf(buf, n, "%s/xst.sock", dir);
+    return 1;
+}
+
+// Whether the other end of a unix socket runs as this user.
+static inline int daemon_peer_ok(int fd) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+}
+
+#endif
@@ -0,0 +1,455 @@
+// font.c - Font loading and the glyph cache.
+//
+// Glyphs are rasterized the first time a codepoint is drawn and packed
+// into a shelf-allocated coverage atlas: a shelf is a full-width strip of
+// one height class, filled left to right. The atlas doubles in height when
+// it runs out of room; once it is at ATLAS_MAX_H the least recently used
+// shelf is emptied and reused.
+//
+// The whole cache (atlas, slots and shelves) is saved under
+// $XDG_CACHE_HOME/xst on exit, keyed by font path, mtime, pixel size and
+// FreeType version. The next start maps that file and uploads the atlas
+// straight from it; the font face itself is only opened once a glyph that
+// isn't in the cache turns up.
+
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+#include "xst.h"
+
+#define GLYPH_HASH      8192    // Power of two
+#define GLYPH_HASH_BITS 13
+#define MAX_SHELVES     1024
+#define SHELF_ROUND     4       // Shelf heights are multiples of this
+#define ATLAS_INIT_H    256
+
+#define CACHE_MAGIC     "xstatls1"      // Change it whenever Glyph, Shelf or CacheHeader do
+#define CACHE_KEY_LEN   (PATH_MAX + 64)
+
+typedef struct {
+    int y, h;               // Atlas rows covered
+    int x;                  // Next free column
+    unsigned last_used;
+} Shelf;
+
+Glyph glyphs[GLYPH_SLOTS];
+unsigned char *font_atlas;
+int font_atlas_w, font_atlas_h;
+float char_w, char_h;
+int glyphs_moved;
+
+static FT_Library ft_lib;
+static FT_Face ft_face;
+static char face_path[PATH_MAX];
+static int face_size;
+
+// On-disk cache: header, then glyphs[GLYPH_SLOTS], shelves[nshelves] and
+// the atlas rows.
+typedef struct {
+    char magic[8];
+    char key[CACHE_KEY_LEN];
+    float char_w, char_h;
+    int slots, atlas_w, atlas_h;
+    int nshelves, shelf_top;
+    long long raster_ns;    // FreeType time spent building this cache
+} CacheHeader;
+
+static char cache_key[CACHE_KEY_LEN];
+static char cache_path[PATH_MAX];
+static void *cache_map;         // font_atlas points into this when non-NULL
+static size_t cache_map_len;
+static int cache_dirty;         // Glyphs were added since load
+static long long raster_ns;
+
+// Hash chains run through Glyph.next; 0 ends a chain, which works because
+// slot 0 is the blank glyph and is never hashed.
+static int buckets[GLYPH_HASH];
+static int ascii_slot[128];
+static int free_slots[GLYPH_SLOTS];
+static int nfree;
+
+static Shelf shelves[MAX_SHELVES];
+static int nshelves;
+static int shelf_top;           // First atlas row not in any shelf
+
+static unsigned frame = 1;
+static AtlasDamage damage;
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Opens the font face on first use; a warm cache never needs it for the
+// glyphs it already holds.
+static void face_open() {
+    if (ft_face) return;
+    if (FT_New_Face(ft_lib, face_path, 0, &ft_face)) die("Could not open font");
+    FT_Set_Pixel_Sizes(ft_face, 0, face_size);
+}
+
+static unsigned hash(uint32_t cp) {
+    return (cp * 2654435761u) >> (32 - GLYPH_HASH_BITS);
+}
+
+static void damage_rows(int y0, int y1) {
+    if (damage.y1 <= damage.y0) { damage.y0 = y0; damage.y1 = y1; return; }
+    if (y0 < damage.y0) damage.y0 = y0;
+    if (y1 > damage.y1) damage.y1 = y1;
+}
+
+static void damage_slot(int s) {
+    if (damage.slot1 <= damage.slot0) { damage.slot0 = s; damage.slot1 = s + 1; return; }
+    if (s < damage.slot0) damage.slot0 = s;
+    if (s + 1 > damage.slot1) damage.slot1 = s + 1;
+}
+
+static void evict_slot(int s) {
+    Glyph *g = &glyphs[s];
+    int *link = &buckets[hash(g->cp)];
+    while (*link != s) link = &glyphs[*link].next;
+    *link = g->next;
+    if (g->cp < 128) ascii_slot[g->cp] = 0;
+    g->cp = 0;
+    free_slots[nfree++] = s;
+    glyphs_moved = 1;
+}
+
+static void evict_shelf(int i) {
+    for (int s = 1; s < GLYPH_SLOTS; s++) {
+        if (glyphs[s].cp && glyphs[s].shelf == i) evict_slot(s);
+    }
+    shelves[i].x = 0;
+}
+
+// Doubles the atlas height, up to ATLAS_MAX_H. Existing glyphs keep their
+// pixel positions.
+static int atlas_grow() {
+    if (font_atlas_h >= ATLAS_MAX_H) return 0;
+    unsigned char *a;
+    if (cache_map) {
+        a = malloc((size_t)font_atlas_w * font_atlas_h * 2);
+        if (!a) return 0;
+        memcpy(a, font_atlas, (size_t)font_atlas_w * font_atlas_h);
+        munmap(cache_map, cache_map_len);
+        cache_map = NULL;
+    } else {
+        a = realloc(font_atlas, (size_t)font_atlas_w * font_atlas_h * 2);
+        if (!a) return 0;
+    }
+    memset(a + (size_t)font_atlas_w * font_atlas_h, 0, (size_t)font_atlas_w * font_atlas_h);
+    font_atlas = a;
+    font_atlas_h *= 2;
+    damage.resized = 1;
+    glyphs_moved = 1;
+    return 1;
+}
+
+// Finds room for a w x h bitmap: the shortest shelf it fits on, else a new
+// shelf (growing the atlas if needed), else the least recently used shelf
+// that is tall enough. Returns the shelf index, or -1 if nothing fits.
+static int shelf_alloc(int w, int h, int *ox, int *oy) {
+    int sh = (h + SHELF_ROUND - 1) / SHELF_ROUND * SHELF_ROUND;
+    int best = -1;
+    for (int i = 0; i < nshelves; i++) {
+        Shelf *s = &shelves[i];
+        if (s->h >= sh && s->x + w <= font_atlas_w && (best < 0 || s->h < shelves[best].h)) best = i;
+    }
+    if (best < 0 && nshelves < MAX_SHELVES) {
+        while (shelf_top + sh > font_atlas_h && atlas_grow());
+        if (shelf_top + sh <= font_atlas_h) {
+            best = nshelves++;
+            shelves[best] = (Shelf){ .y = shelf_top, .h = sh };
+            shelf_top += sh;
+        }
+    }
+    if (best < 0) {
+        for (int i = 0; i < nshelves; i++) {
+            if (shelves[i].h >= sh && (best < 0 || shelves[i].last_used < shelves[best].last_used)) best = i;
+        }
+        if (best < 0) return -1;
+        evict_shelf(best);
+    }
+    Shelf *s = &shelves[best];
+    *ox = s->x;
+    *oy = s->y;
+    s->x += w;
+    return best;
+}
+
+// Rasterizes cp into a free slot. Codepoints the font can't render get a
+// blank glyph, so they aren't retried every frame.
+static int glyph_load(uint32_t cp) {
+    if (nfree == 0) {
+        int lru = 1;
+        for (int s = 2; s < GLYPH_SLOTS; s++) {
+            if (glyphs[s].last_used < glyphs[lru].last_used) lru = s;
+        }
+        evict_slot(lru);
+    }
+    int s = free_slots[--nfree];
+    Glyph *g = &glyphs[s];
+    *g = (Glyph){ .cp = cp, .shelf = -1 };
+
+    long long t0 = now_ns();
+    face_open();
+    cache_dirty = 1;
+    FT_GlyphSlot fg = ft_face->glyph;
+    if (FT_Load_Char(ft_face, cp, FT_LOAD_RENDER) == 0) {
+        int w = fg->bitmap.width, h = fg->bitmap.rows;
+        if (w > font_atlas_w) w = font_atlas_w;
+        if (h > ATLAS_MAX_H) h = ATLAS_MAX_H;
+        int ox, oy, shelf = (w > 0 && h > 0) ? shelf_alloc(w, h, &ox, &oy) : -1;
+        if (shelf >= 0) {
+            for (int r = 0; r < h; r++) {
+                memcpy(&font_atlas[(size_t)(oy + r) * font_atlas_w + ox], &fg->bitmap.buffer[r * fg->bitmap.pitch], w);
+            }
+            damage_rows(oy, oy + h);
+            g->bw = w; g->bh = h;
+            g->bl = fg->bitmap_left; g->bt = fg->bitmap_top;
+            g->ox = ox; g->oy = oy;
+            g->shelf = shelf;
+        }
+    }
+    raster_ns += now_ns() - t0;
+
+    int *head = &buckets[hash(cp)];
+    g->next = *head;
+    *head = s;
+    if (cp < 128) ascii_slot[cp] = s;
+    damage_slot(s);
+    return s;
+}
+
+// Slot for cp, rasterizing it on first use. Marks the glyph as used in the
+// current frame.
+int glyph_lookup(uint32_t cp) {
+    if (cp <= ' ') return 0;
+    int s;
+    if (cp < 128) {
+        s = ascii_slot[cp];
+    } else {
+        s = buckets[hash(cp)];
+        while (s && glyphs[s].cp != cp) s = glyphs[s].next;
+    }
+    if (!s) s = glyph_load(cp);
+    Glyph *g = &glyphs[s];
+    g->last_used = frame;
+    if (g->shelf >= 0) shelves[g->shelf].last_used = frame;
+    return s;
+}
+
+void glyph_frame() {
+    frame++;
+}
+
+// Opens the face now rather than on the first cache miss, so that the
+// daemon's first window doesn't pay for it.
+void font_open() {
+    face_open();
+}
+
+// Hands over the atlas changes since the last call. Returns 0 if there
+// were none.
+int glyph_damage(AtlasDamage *d) {
+    *d = damage;
+    memset(&damage, 0, sizeof(damage));
+    return d->resized || d->y1 > d->y0 || d->slot1 > d->slot0;
+}
+
+// Rebuilds the lookup structures from glyphs[], which came from disk.
+static void cache_index() {
+    memset(buckets, 0, sizeof(buckets));
+    memset(ascii_slot, 0, sizeof(ascii_slot));
+    nfree = 0;
+    for (int s = GLYPH_SLOTS - 1; s > 0; s--) {
+        Glyph *g = &glyphs[s];
+        g->last_used = 0;
+        if (!g->cp) {
+            free_slots[nfree++] = s;
+            continue;
+        }
+        int *head = &buckets[hash(g->cp)];
+        g->next = *head;
+        *head = s;
+        if (g->cp < 128) ascii_slot[g->cp] = s;
+    }
+    glyphs[0] = (Glyph){ .shelf = -1 };
+}
+
+// Whether the shelves and glyphs a cache file holds stay inside its atlas
+// (and glyphs inside their shelves), so that a damaged file can't send
+// packing or the renderers out of bounds.
+static int cache_valid(const CacheHeader *h, const Glyph *gs, const Shelf *ss) {
+    if (h->shelf_top < 0 || h->shelf_top > h->atlas_h) return 0;
+    for (int i = 0; i < h->nshelves; i++) {
+        const Shelf *s = &ss[i];
+        if (s->y < 0 || s->h <= 0 || s->h > h->shelf_top - s->y || s->x < 0 || s->x > h->atlas_w) return 0;
+    }
+    if (gs[0].cp) return 0;
+    for (int i = 1; i < GLYPH_SLOTS; i++) {
+        const Glyph *g = &gs[i];
+        if (!g->cp) continue;
+        if (g->shelf < 0) {
+            if (g->shelf != -1 || g->bw || g->bh) return 0;
+            continue;
+        }
+        if (g->shelf >= h->nshelves) return 0;
+        const Shelf *s = &ss[g->shelf];
+        if (g->bw <= 0 || g->bh <= 0 || g->ox < 0 || g->bw > s->x - g->ox ||
+            g->oy < s->y || g->bh > s->y + s->h - g->oy) return 0;
+    }
+    return 1;
+}
+
+// Maps the cache file for the current key. Returns 0 (leaving everything
+// untouched) if there is none or it doesn't match.
+static int cache_load() {
+    int fd = open(cache_path, O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(CacheHeader)) {
+        map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+
+    const CacheHeader *h = map;
+    size_t glyph_off = sizeof(CacheHeader);
+    size_t shelf_off = glyph_off + sizeof(glyphs);
+    size_t atlas_off = shelf_off + (size_t)h->nshelves * sizeof(Shelf);
+    if (memcmp(h->magic, CACHE_MAGIC, sizeof(h->magic)) != 0 || strcmp(h->key, cache_key) != 0 ||
+        h->slots != GLYPH_SLOTS || h->atlas_w != ATLAS_W || h->atlas_h <= 0 || h->atlas_h > ATLAS_MAX_H ||
+        h->nshelves < 0 || h->nshelves > MAX_SHELVES ||
+        (size_t)st.st_size != atlas_off + (size_t)h->atlas_w * h->atlas_h ||
+        !cache_valid(h, (const Glyph *)((char *)map + glyph_off), (const Shelf *)((char *)map + shelf_off))) {
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    char_w = h->char_w;
+    char_h = h->char_h;
+    memcpy(glyphs, (char *)map + glyph_off, sizeof(glyphs));
+    memcpy(shelves, (char *)map + shelf_off, (size_t)h->nshelves * sizeof(Shelf));
+    nshelves = h->nshelves;
+    shelf_top = h->shelf_top;
+    font_atlas = (unsigned char *)map + atlas_off;
+    font_atlas_w = h->atlas_w;
+    font_atlas_h = h->atlas_h;
+    raster_ns = h->raster_ns;
+    cache_map = map;
+    cache_map_len = st.st_size;
+    cache_index();
+    return 1;
+}
+
+// Writes the cache if glyphs were added since it was loaded. The file is
+// replaced atomically, so a concurrent start never sees a partial one.
+static void cache_save() {
+    if (!cache_dirty || !cache_path[0]) return;
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", cache_path);
+    for (char *p = dir + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        mkdir(dir, 0700);
+        *p = '/';
+    }
+    char tmp[PATH_MAX + 16];
+    snprintf(tmp, sizeof(tmp), "%s.%d", cache_path, (int)getpid());
+    FILE *f = fopen(tmp, "wb");
+    if (!f) return;
+    CacheHeader h = { .char_w = char_w, .char_h = char_h, .slots = GLYPH_SLOTS,
+                      .atlas_w = font_atlas_w, .atlas_h = font_atlas_h,
+                      .nshelves = nshelves, .shelf_top = shelf_top, .raster_ns = raster_ns };
+    memcpy(h.magic, CACHE_MAGIC, sizeof(h.magic));
+    snprintf(h.key, sizeof(h.key), "%s", cache_key);
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+             fwrite(glyphs, sizeof(glyphs), 1, f) == 1 &&
+             fwrite(shelves, sizeof(Shelf), nshelves, f) == (size_t)nshelves &&
+             fwrite(font_atlas, font_atlas_w, font_atlas_h, f) == (size_t)font_atlas_h;
+    if (fclose(f) != 0) ok = 0;
+    if (!ok || rename(tmp, cache_path) != 0) unlink(tmp);
+}
+
+// Cache file for this font: $XDG_CACHE_HOME/xst (or ~/.cache/xst), named
+// by a hash of the key. The key itself is stored in the file and checked.
+static void cache_setup(const char *font_path, int font_size) {
+    struct stat st;
+    char real[PATH_MAX];
+    if (stat(font_path, &st) != 0 || !realpath(font_path, real)) return;
+    FT_Int major, minor, patch;
+    FT_Library_Version(ft_lib, &major, &minor, &patch);
+    snprintf(cache_key, sizeof(cache_key), "%s|%lld|%d|%d.%d.%d",
+             real, (long long)st.st_mtime, font_size, major, minor, patch);
+
+    unsigned long long h = 1469598103934665603ULL;
+    for (const char *p = cache_key; *p; p++) h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    const char *xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+    if (xdg && *xdg) {
+        snprintf(cache_path, sizeof(cache_path), "%s/xst/atlas-%016llx", xdg, h);
+    } else if (home) {
+        snprintf(cache_path, sizeof(cache_path), "%s/.cache/xst/atlas-%016llx", home, h);
+    }
+}
+
+void font_init(const char *font_path, int font_size) {
+    long long t0 = now_ns();
+    if (FT_Init_FreeType(&ft_lib)) die("Could not init freetype library");
+    snprintf(face_path, sizeof(face_path), "%s", font_path);
+    face_size = font_size;
+    cache_setup(font_path, font_size);
+    damage.resized = 1;
+
+    if (cache_path[0] && cache_load()) {
+        if (verbose) {
+            long long load_ns = now_ns() - t0;
+            fprintf(stderr, "xst: glyph cache %s: %d glyphs in %.2f ms, %.2f ms of rasterizing saved\n",
+                    cache_path, GLYPH_SLOTS - 1 - nfree, load_ns / 1e6, (raster_ns - load_ns) / 1e6);
+        }
+        return;
+    }
+
+    face_open();
+    char_h = font_size;
+    if (FT_Load_Char(ft_face, 'M', FT_LOAD_RENDER)) die("Could not load 'M' character");
+    char_w = (ft_face->glyph->advance.x >> 6);
+    if (char_w == 0) char_w = font_size / 2.0f;
+
+    font_atlas_w = ATLAS_W;
+    font_atlas_h = ATLAS_INIT_H;
+    font_atlas = calloc((size_t)font_atlas_w * font_atlas_h, 1);
+    if (!font_atlas) die("malloc failed for font atlas");
+    for (int s = GLYPH_SLOTS - 1; s > 0; s--) free_slots[nfree++] = s;
+    glyphs[0].shelf = -1;
+
+    // ASCII is needed straight away; load it up front.
+    for (uint32_t c = '!'; c < 127; c++) glyph_lookup(c);
+    raster_ns = now_ns() - t0;
+    if (verbose) {
+        fprintf(stderr, "xst: glyph cache miss, rasterized in %.2f ms\n", raster_ns / 1e6);
+    }
+}
+
+void font_free() {
+    cache_save();
+    if (cache_map) munmap(cache_map, cache_map_len);
+    else free(font_atlas);
+    font_atlas = NULL;
+    cache_map = NULL;
+    if (ft_face) FT_Done_Face(ft_face);
+    FT_Done_FreeType(ft_lib);
+}
@@ -0,0 +1,835 @@
+// graphics.c - Inline images: the kitty graphics protocol's image store
+// and placements. See graphics.h.
+
+#define _XOPEN_SOURCE 600
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <png.h>
+#include <zlib.h>
+
+#include "graphics.h"
+
+#define KEYS_MAX        256             // Bytes of control data kept per command
+#define PAYLOAD_MAX     GFX_STORE_MAX   // Decoded bytes taken in one transmission
+#define PLACEMENTS_MAX  4096            // Oldest placements go beyond this
+#define DATA_KEEP       (1 << 20)       // Payload buffer kept for the next command
+
+typedef struct {
+    uint32_t id, number;
+    GfxPixels *px;
+    unsigned long long used;    // LRU clock: transmitted or placed
+} GfxImage;
+
+typedef struct {
+    uint32_t image, id;
+    int alt;                    // On the alternate screen
+    long long line;             // Line number of its top row; see anchor()
+    int col, cols, rows;
+    int off_x, off_y;
+    int src_x, src_y, src_w, src_h;
+    int dst_w, dst_h;
+    int z;
+} GfxPlacement;
+
+// A command's keys. Absent keys are 0, except for the defaults set in
+// parse_keys.
+typedef struct {
+    char a, t, o, d;
+    int f, q, m, C, z;
+    uint32_t i, I, p;
+    int s, v, S, O, x, y, w, h, X, Y, c, r;
+} GfxCmd;
+
+enum { APC_FIRST, APC_KEYS, APC_PAYLOAD, APC_IGNORE };
+
+struct Graphics {
+    GfxImage *images;           // Oldest first
+    int nimages, images_cap;
+    size_t stored;              // Bytes of pixels in `images`
+    GfxPlacement *places;       // Oldest first, which is also draw order within a z
+    int nplaces, places_cap;
+    unsigned version;
+    unsigned long long clock;
+    uint32_t next_id;           // For images sent without one, counting down
+
+    // The APC sequence coming in, and the command it belongs to, which
+    // may have started several sequences back (m=1).
+    int apc;
+    char keys[KEYS_MAX];
+    int nkeys;
+    int loading;                // cmd is waiting for more chunks
+    GfxCmd cmd;
+    unsigned char *data;        // Decoded payload
+    size_t len, cap;
+    int overflow;
+    uint32_t b64;               // Base64 bits not yet making a byte, b64_n sextets
+    int b64_n;
+};
+
+static signed char b64_value[256];
+
+// Pixel serials come from one counter for every Term, so that renderers
+// drawing several terminals can key one texture cache by them.
+static unsigned pixel_serial;
+
+// Pixel data, or whatever it was decoded from: len bytes at p, which
+// points into the malloc'd mem.
+typedef struct {
+    const unsigned char *p;
+    size_t len;
+    void *mem;
+} Blob;
+
+static void blob_free(Blob *b) {
+    free(b->mem);
+    memset(b, 0, sizeof(*b));
+}
+
+static void pixels_unref(GfxPixels *px) {
+    if (--px->refs > 0) return;
+    free(px->mem);
+    free(px);
+}
+
+static size_t pixels_bytes(const GfxPixels *px) {
+    return (size_t)px->w * px->h * px->bpp;
+}
+
+static struct Graphics *graphics(Term *t) {
+    if (t->gfx) return t->gfx;
+    t->gfx = calloc(1, sizeof(*t->gfx));
+    if (!t->gfx) die("malloc failed for graphics");
+    t->gfx->next_id = UINT32_MAX;
+    if (!b64_value['B']) {
+        const char *digits = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        memset(b64_value, -1, sizeof(b64_value));
+        for (int i = 0; i < 64; i++) b64_value[(unsigned char)digits[i]] = i;
+    }
+    return t->gfx;
+}
+
+// Where line numbers for a placement on the showing screen start: the
+// main screen's are Term.line_seq's; the alternate screen has no history
+// and counts scrolls instead.
+static long long anchor(const Term *t, int alt) {
+    return alt ? (long long)t->stats.scrolls : t->line_seq;
+}
+
+// --- Store ---
+
+static int image_index(const struct Graphics *g, uint32_t id) {
+    for (int i = 0; i < g->nimages; i++) {
+        if (g->images[i].id == id) return i;
+    }
+    return -1;
+}
+
+// Newest image transmitted with number I
+static int number_index(const struct Graphics *g, uint32_t number) {
+    for (int i = g->nimages - 1; i >= 0; i--) {
+        if (g->images[i].number == number) return i;
+    }
+    return -1;
+}
+
+static void remove_placement(struct Graphics *g, int i) {
+    memmove(&g->places[i], &g->places[i + 1], (g->nplaces - i - 1) * sizeof(*g->places));
+    g->nplaces--;
+    g->version++;
+}
+
+static void remove_image(struct Graphics *g, int i) {
+    uint32_t id = g->images[i].id;
+    for (int k = 0; k < g->nplaces;) {
+        if (g->places[k].image == id) remove_placement(g, k);
+        else k++;
+    }
+    g->stored -= pixels_bytes(g->images[i].px);
+    pixels_unref(g->images[i].px);
+    memmove(&g->images[i], &g->images[i + 1], (g->nimages - i - 1) * sizeof(*g->images));
+    g->nimages--;
+}
+
+// Takes over the caller's reference to px.
+static GfxImage *store(struct Graphics *g, uint32_t id, uint32_t number, GfxPixels *px) {
+    int i = image_index(g, id);
+    if (i >= 0) remove_image(g, i);
+    // The least recently used images make room, placements and all.
+    size_t bytes = pixels_bytes(px);
+    while (g->nimages && g->stored + bytes > GFX_STORE_MAX) {
+        int lru = 0;
+        for (i = 1; i < g->nimages; i++) {
+            if (g->images[i].used < g->images[lru].used) lru = i;
+        }
+        remove_image(g, lru);
+    }
+    if (g->nimages == g->images_cap) {
+        g->images_cap = g->images_cap ? g->images_cap * 2 : 16;
+        g->images = realloc(g->images, g->images_cap * sizeof(*g->images));
+        if (!g->images) die("malloc failed for images");
+    }
+    GfxImage *img = &g->images[g->nimages++];
+    img->id = id;
+    img->number = number;
+    img->px = px;
+    img->used = ++g->clock;
+    g->stored += bytes;
+    return img;
+}
+
+// --- Commands ---
+
+// key=value pairs separated by commas. Returns whether any key besides m
+// and q was given, which a continuation chunk doesn't have.
+static int parse_keys(const char *s, int n, GfxCmd *c) {
+    memset(c, 0, sizeof(*c));
+    c->a = 't';
+    c->t = 'd';
+    c->d = 'a';
+    c->f = 32;
+    int other = 0;
+    for (int i = 0; i < n;) {
+        int e = i;
+        while (e < n && s[e] != ',') e++;
+        if (e - i >= 3 && s[i + 1] == '=') {
+            char key = s[i], val[24];
+            int len = e - i - 2 < (int)sizeof(val) - 1 ? e - i - 2 : (int)sizeof(val) - 1;
+            memcpy(val, s + i + 2, len);
+            val[len] = '\0';
+            long long v = strtoll(val, NULL, 10);
+            if (v > UINT32_MAX) v = UINT32_MAX;
+            if (v < -1000000000) v = -1000000000;
+            int iv = v > 1000000000 ? 1000000000 : (int)v;
+            other |= key != 'm' && key != 'q';
+            switch (key) {
+                case 'a': c->a = val[0]; break;
+                case 't': c->t = val[0]; break;
+                case 'o': c->o = val[0]; break;
+                case 'd': c->d = val[0]; break;
+                case 'f': c->f = iv; break;
+                case 'q': c->q = iv; break;
+                case 'm': c->m = iv; break;
+                case 'C': c->C = iv; break;
+                case 'z': c->z = iv; break;
+                case 'i': c->i = v < 0 ? 0 : (uint32_t)v; break;
+                case 'I': c->I = v < 0 ? 0 : (uint32_t)v; break;
+                case 'p': c->p = v < 0 ? 0 : (uint32_t)v; break;
+                case 's': c->s = iv; break;
+                case 'v': c->v = iv; break;
+                case 'S': c->S = iv; break;
+                case 'O': c->O = iv; break;
+                case 'x': c->x = iv; break;
+                case 'y': c->y = iv; break;
+                case 'w': c->w = iv; break;
+                case 'h': c->h = iv; break;
+                case 'X': c->X = iv; break;
+                case 'Y': c->Y = iv; break;
+                case 'c': c->c = iv; break;
+                case 'r': c->r = iv; break;
+            }
+        }
+        i = e + 1;
+    }
+    return other;
+}
+
+// ESC _ G i=<id>[,I=<number>][,p=<placement>] ; <msg> ESC \ to the
+// program, if it gave an id to answer to and q doesn't silence it.
+static void reply(Term *t, const GfxCmd *c, const char *err) {
+    if (!t->respond || (!c->i && !c->I) || c->q >= (err ? 2 : 1)) return;
+    char buf[160];
+    int n = snprintf(buf, sizeof(buf), "\033_G");
+    if (c->i) n += snprintf(buf + n, sizeof(buf) - n, "i=%u,", (unsigned)c->i);
+    if (c->I) n += snprintf(buf + n, sizeof(buf) - n, "I=%u,", (unsigned)c->I);
+    if (c->p) n += snprintf(buf + n, sizeof(buf) - n, "p=%u,", (unsigned)c->p);
+    n--;    // The last comma
+    n += snprintf(buf + n, sizeof(buf) - n, ";%s\033\\", err ? err : "OK");
+    t->respond(t, buf, n);
+}
+
+// Files a program may have read this way. Temporary files (t=t) are
+// deleted once read, so those have to be in a temporary directory and
+// say they are meant for this.
+static int path_allowed(const char *path, int temp) {
+    if (temp) {
+        const char *dir = getenv("TMPDIR");
+        if (!strstr(path, "tty-graphics-protocol")) return 0;
+        return strncmp(path, "/tmp/", 5) == 0 || strncmp(path, "/dev/shm/", 9) == 0 ||
+               (dir && *dir && strncmp(path, dir, strlen(dir)) == 0);
+    }
+    static const char *const denied[] = { "/proc/", "/sys/", "/dev/" };
+    for (size_t i = 0; i < sizeof(denied) / sizeof(denied[0]); i++) {
+        if (strncmp(path, denied[i], strlen(denied[i])) == 0) return 0;
+    }
+    return 1;
+}
+
+// t=f, t=t, t=s: the payload is a name, and S bytes (0: the rest) from
+// offset O of that file or shared memory object are read in. Not mapped:
+// the program may truncate or rewrite it while the image is still shown
+// (a plot redrawn in place), and a mapping would then fault.
+static const char *read_medium(struct Graphics *g, const GfxCmd *c, Blob *b) {
+    char name[PATH_MAX], path[PATH_MAX];
+    if (g->len == 0 || g->len >= sizeof(name)) return "EINVAL:Bad file name";
+    memcpy(name, g->data, g->len);
+    name[g->len] = '\0';
+    int fd;
+    if (c->t == 's') {
+        fd = shm_open(name, O_RDONLY, 0);
+    } else {
+        if (!realpath(name, path) || !path_allowed(path, c->t == 't')) return "EPERM:Not allowed to read this file";
+        fd = open(path, O_RDONLY);
+    }
+    if (fd < 0) return "EBADF:Could not open the file";
+    struct stat st;
+    const char *err = NULL;
+    size_t off = c->O > 0 ? c->O : 0, len = c->S > 0 ? c->S : 0, got = 0;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || off >= (size_t)st.st_size) {
+        err = "ENODATA:Could not read the file";
+    } else {
+        if (!len || len > (size_t)st.st_size - off) len = (size_t)st.st_size - off;
+        if (len > PAYLOAD_MAX) err = "EFBIG:Too much data";
+    }
+    unsigned char *data = NULL;
+    if (!err) {
+        data = malloc(len);
+        if (!data) die("malloc failed for image");
+        while (got < len) {
+            ssize_t r = pread(fd, data + got, len - got, off + got);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) break;
+            got += r;
+        }
+        if (!got) err = "ENODATA:Could not read the file";
+    }
+    close(fd);
+    if (c->t == 't') unlink(path);
+    else if (c->t == 's') shm_unlink(name);
+    if (err) {
+        free(data);
+        return err;
+    }
+    b->p = b->mem = data;
+    b->len = got;
+    return NULL;
+}
+
+// o=z. Raw pixels inflate to a size known up front; PNG data is inflated
+// into a buffer grown as needed.
+static const char *inflate_blob(Blob *b, const GfxCmd *c) {
+    int png = c->f == 100;
+    size_t cap = png ? b->len * 4 + 4096 : (size_t)c->s * c->v * (c->f == 24 ? 3 : 4);
+    if (!cap || cap > PAYLOAD_MAX || b->len > UINT_MAX) return "EINVAL:Bad compressed data size";
+    unsigned char *out = malloc(cap);
+    if (!out) die("malloc failed for image");
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (inflateInit(&z) != Z_OK) die("inflateInit failed");
+    z.next_in = (Bytef *)b->p;
+    z.avail_in = b->len;
+    int r;
+    for (;;) {
+        z.next_out = out + z.total_out;
+        z.avail_out = cap - z.total_out;
+        r = inflate(&z, Z_NO_FLUSH);
+        if (r != Z_OK) break;
+        if (z.avail_out) continue;
+        if (!png || cap == PAYLOAD_MAX) break;
+        cap = cap * 2 < PAYLOAD_MAX ? cap * 2 : PAYLOAD_MAX;
+        out = realloc(out, cap);
+        if (!out) die("malloc failed for image");
+    }
+    size_t len = z.total_out;
+    inflateEnd(&z);
+    if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR) {
+        free(out);
+        return "EINVAL:Bad compressed data";
+    }
+    blob_free(b);
+    b->p = b->mem = out;
+    b->len = len;
+    return NULL;
+}
+
+// The transmitted data, taken over, as pixels.
+static const char *decode(Blob *b, const GfxCmd *c, GfxPixels **out) {
+    int w, h, bpp;
+    if (c->f == 100) {
+        png_image img;
+        memset(&img, 0, sizeof(img));
+        img.version = PNG_IMAGE_VERSION;
+        if (!png_image_begin_read_from_memory(&img, b->p, b->len)) {
+            blob_free(b);
+            return "EBADPNG:Not a PNG image";
+        }
+        if (img.width > GFX_DIM_MAX || img.height > GFX_DIM_MAX) {
+            png_image_free(&img);
+            blob_free(b);
+            return "EFBIG:Image too large";
+        }
+        img.format = PNG_FORMAT_RGBA;
+        unsigned char *pixels = malloc(PNG_IMAGE_SIZE(img));
+        if (!pixels) die("malloc failed for image");
+        int ok = png_image_finish_read(&img, NULL, pixels, 0, NULL);
+        blob_free(b);
+        if (!ok) {
+            free(pixels);
+            return "EBADPNG:Bad PNG data";
+        }
+        b->p = b->mem = pixels;
+        w = img.width;
+        h = img.height;
+        bpp = 4;
+    } else {
+        if (c->f != 24 && c->f != 32) {
+            blob_free(b);
+            return "EINVAL:Unknown format";
+        }
+        w = c->s;
+        h = c->v;
+        bpp = c->f / 8;
+        const char *err = NULL;
+        if (w <= 0 || h <= 0) err = "EINVAL:No image size";
+        else if (w > GFX_DIM_MAX || h > GFX_DIM_MAX) err = "EFBIG:Image too large";
+        else if (b->len < (size_t)w * h * bpp) err = "ENODATA:Insufficient image data";
+        if (err) {
+            blob_free(b);
+            return err;
+        }
+    }
+    GfxPixels *px = calloc(1, sizeof(*px));
+    if (!px) die("malloc failed for image");
+    px->refs = 1;
+    px->serial = ++pixel_serial;
+    px->w = w;
+    px->h = h;
+    px->bpp = bpp;
+    px->data = b->p;
+    px->mem = b->mem;
+    *out = px;
+    return NULL;
+}
+
+static const char *load(struct Graphics *g, const GfxCmd *c, GfxPixels **out) {
+    Blob b;
+    memset(&b, 0, sizeof(b));
+    if (g->overflow) return "EFBIG:Too much data";
+    if (c->t == 'd') {
+        // The payload buffer becomes the image's, without a copy.
+        b.p = b.mem = g->data;
+        b.len = g->len;
+        g->data = NULL;
+        g->len = g->cap = 0;
+    } else if (c->t == 'f' || c->t == 't' || c->t == 's') {
+        const char *err = read_medium(g, c, &b);
+        if (err) return err;
+    } else {
+        return "EINVAL:Unknown transmission medium";
+    }
+    if (c->o == 'z') {
+        const char *err = inflate_blob(&b, c);
+        if (err) {
+            blob_free(&b);
+            return err;
+        }
+    }
+    return decode(&b, c, out);
+}
+
+static const char *put(Term *t, struct Graphics *g, const GfxCmd *c, GfxImage *img, int *cols_out, int *rows_out) {
+    const GfxPixels *px = img->px;
+    int sx = c->x < 0 ? 0 : c->x < px->w ? c->x : px->w;
+    int sy = c->y < 0 ? 0 : c->y < px->h ? c->y : px->h;
+    int sw = c->w > 0 && c->w < px->w - sx ? c->w : px->w - sx;
+    int sh = c->h > 0 && c->h < px->h - sy ? c->h : px->h - sy;
+    if (sw <= 0 || sh <= 0) return "EINVAL:Empty source rectangle";
+    int cw = t->cell_w > 0 ? t->cell_w : 10, ch = t->cell_h > 0 ? t->cell_h : 20;
+    int ox = c->X < 0 ? 0 : c->X < cw ? c->X : cw - 1;
+    int oy = c->Y < 0 ? 0 : c->Y < ch ? c->Y : ch - 1;
+    int cols = c->c > 0 ? c->c : 0, rows = c->r > 0 ? c->r : 0, dw, dh;
+    if (cols > GFX_DIM_MAX) cols = GFX_DIM_MAX;
+    if (rows > GFX_DIM_MAX) rows = GFX_DIM_MAX;
+    if (!cols && !rows) {
+        dw = sw;
+        dh = sh;
+        cols = (ox + dw + cw - 1) / cw;
+        rows = (oy + dh + ch - 1) / ch;
+    } else {
+        // Stretched over the cells given; a count left out keeps the
+        // aspect ratio.
+        if (!rows) rows = ((long long)sh * cols * cw / sw + oy + ch - 1) / ch;
+        if (!cols) cols = ((long long)sw * rows * ch / sh + ox + cw - 1) / cw;
+        if (rows < 1) rows = 1;
+        if (cols < 1) cols = 1;
+        dw = cols * cw - ox;
+        dh = rows * ch - oy;
+    }
+
+    GfxPlacement *p = NULL;
+    for (int i = 0; c->p && i < g->nplaces && !p; i++) {
+        if (g->places[i].image == img->id && g->places[i].id == c->p) p = &g->places[i];
+    }
+    if (!p) {
+        if (g->nplaces == PLACEMENTS_MAX) remove_placement(g, 0);
+        if (g->nplaces == g->places_cap) {
+            g->places_cap = g->places_cap ? g->places_cap * 2 : 16;
+            g->places = realloc(g->places, g->places_cap * sizeof(*g->places));
+            if (!g->places) die("malloc failed for placements");
+        }
+        p = &g->places[g->nplaces++];
+    }
+    p->image = img->id;
+    p->id = c->p;
+    p->alt = t->alt_screen;
+    p->line = anchor(t, t->alt_screen) + t->cursor_y;
+    p->col = t->cursor_x < t->cols ? t->cursor_x : t->cols - 1;
+    p->cols = cols;
+    p->rows = rows;
+    p->off_x = ox;
+    p->off_y = oy;
+    p->src_x = sx;
+    p->src_y = sy;
+    p->src_w = sw;
+    p->src_h = sh;
+    p->dst_w = dw;
+    p->dst_h = dh;
+    p->z = c->z;
+    img->used = ++g->clock;
+    g->version++;
+    *cols_out = cols;
+    *rows_out = rows;
+    return NULL;
+}
+
+// Frees image id if no placement shows it any more.
+static void drop_unplaced(struct Graphics *g, uint32_t id) {
+    for (int i = 0; i < g->nplaces; i++) {
+        if (g->places[i].image == id) return;
+    }
+    int i = image_index(g, id);
+    if (i >= 0) remove_image(g, i);
+}
+
+// a=d. Lowercase d values delete placements; uppercase ones also free
+// the images left without any.
+static void delete_placements(Term *t, struct Graphics *g, const GfxCmd *c) {
+    char d = tolower((unsigned char)c->d);
+    int free_data = isupper((unsigned char)c->d);
+    uint32_t target = 0;
+    if (d == 'i' || d == 'n') {
+        int i = d == 'i' ? image_index(g, c->i) : number_index(g, c->I);
+        if (i < 0) return;
+        target = g->images[i].id;
+    }
+    int cx = t->cursor_x < t->cols ? t->cursor_x : t->cols - 1, cy = t->cursor_y;
+    for (int i = 0; i < g->nplaces;) {
+        GfxPlacement *p = &g->places[i];
+        long long row = p->line - anchor(t, p->alt);
+        int shown = p->alt == t->alt_screen && row + p->rows > 0 && row < t->rows;
+        int in_col = 0, in_row = 0, hit = 0;
+        switch (d) {
+            case 'c': in_col = cx >= p->col && cx < p->col + p->cols; in_row = cy >= row && cy < row + p->rows; break;
+            case 'p': in_col = c->x - 1 >= p->col && c->x - 1 < p->col + p->cols;
+                      in_row = c->y - 1 >= row && c->y - 1 < row + p->rows; break;
+            case 'x': in_col = c->x - 1 >= p->col && c->x - 1 < p->col + p->cols; in_row = 1; break;
+            case 'y': in_row = c->y - 1 >= row && c->y - 1 < row + p->rows; in_col = 1; break;
+        }
+        switch (d) {
+            case 'a': hit = shown; break;
+            case 'i': case 'n': hit = p->image == target && (!c->p || p->id == c->p); break;
+            case 'c': case 'p': case 'x': case 'y': hit = shown && in_col && in_row; break;
+            case 'z': hit = shown && p->z == c->z; break;
+        }
+        if (!hit) {
+            i++;
+            continue;
+        }
+        uint32_t image = p->image;
+        remove_placement(g, i);
+        if (free_data) drop_unplaced(g, image);
+    }
+    if (free_data && target) drop_unplaced(g, target);
+}
+
+// Runs a complete command. Returns 1 if the cursor should move past an
+// image it placed.
+static int execute(Term *t, struct Graphics *g, int *cols, int *rows) {
+    GfxCmd *c = &g->cmd;
+    const char *err = NULL;
+    int i;
+    switch (c->a) {
+        case 't': case 'T': case 'q': {
+            GfxPixels *px = NULL;
+            err = load(g, c, &px);
+            if (err || c->a == 'q') {
+                if (px) pixels_unref(px);
+                break;
+            }
+            uint32_t id = c->i;
+            while (!id || image_index(g, id) >= 0) id = g->next_id--;
+            // An image sent with only a number is answered with the id it got.
+            if (!c->i && c->I) c->i = id;
+            GfxImage *img = store(g, id, c->I, px);
+            if (c->a == 'T') err = put(t, g, c, img, cols, rows);
+            break;
+        }
+        case 'p':
+            i = c->i ? image_index(g, c->i) : c->I ? number_index(g, c->I) : -1;
+            err = i >= 0 ? put(t, g, c, &g->images[i], cols, rows) : "ENOENT:No such image";
+            break;
+        case 'd':
+            delete_placements(t, g, c);
+            return 0;
+        default:
+            err = "EINVAL:Unknown action";
+            break;
+    }
+    reply(t, c, err);
+    return !err && (c->a == 'T' || c->a == 'p') && !c->C;
+}
+
+// --- Parser side ---
+
+// The control data is complete: a new command, or the next chunk of the
+// one loading.
+static void keys_done(struct Graphics *g) {
+    GfxCmd c;
+    int other = parse_keys(g->keys, g->nkeys, &c);
+    g->apc = APC_PAYLOAD;
+    if (g->loading && !other) {
+        g->cmd.m = c.m;
+        g->cmd.q = c.q;
+        return;
+    }
+    g->cmd = c;
+    g->loading = 1;
+    g->len = 0;
+    g->overflow = 0;
+    g->b64 = 0;
+    g->b64_n = 0;
+}
+
+// Bits left over at the end of the data, or before padding, make one or
+// two last bytes.
+static void b64_flush(struct Graphics *g) {
+    if (g->b64_n == 2) g->data[g->len++] = g->b64 >> 4;
+    if (g->b64_n == 3) {
+        g->data[g->len++] = g->b64 >> 10;
+        g->data[g->len++] = g->b64 >> 2;
+    }
+    g->b64 = 0;
+    g->b64_n = 0;
+}
+
+// Decodes base64 as it arrives; anything outside the alphabet, such as
+// line breaks, is skipped.
+static void payload(struct Graphics *g, const char *s, size_t n) {
+    char a = g->cmd.a;
+    if (g->overflow || (a != 't' && a != 'T' && a != 'q')) return;
+    size_t need = g->len + n / 4 * 3 + 6;
+    if (need > g->cap) {
+        if (need > PAYLOAD_MAX) {
+            g->overflow = 1;
+            return;
+        }
+        size_t cap = g->cap > 4096 ? g->cap : 4096;
+        while (cap < need) cap *= 2;
+        g->data = realloc(g->data, cap);
+        if (!g->data) die("malloc failed for image data");
+        g->cap = cap;
+    }
+    unsigned char *o = g->data + g->len;
+    uint32_t bits = g->b64;
+    int k = g->b64_n;
+    for (size_t i = 0; i < n; i++) {
+        int v = b64_value[(unsigned char)s[i]];
+        if (v < 0) {
+            if (s[i] == '=' && k >= 2) {
+                g->len = o - g->data;
+                g->b64 = bits;
+                g->b64_n = k;
+                b64_flush(g);
+                o = g->data + g->len;
+                bits = k = 0;
+            }
+            continue;
+        }
+        bits = bits << 6 | v;
+        if (++k == 4) {
+            o[0] = bits >> 16;
+            o[1] = bits >> 8;
+            o[2] = bits;
+            o += 3;
+            bits = k = 0;
+        }
+    }
+    g->len = o - g->data;
+    g->b64 = bits;
+    g->b64_n = k;
+}
+
+void gfx_apc_start(Term *t) {
+    struct Graphics *g = graphics(t);
+    g->apc = APC_FIRST;
+    g->nkeys = 0;
+}
+
+void gfx_apc_put(Term *t, const char *s, size_t n) {
+    struct Graphics *g = t->gfx;
+    while (n > 0) {
+        switch (g->apc) {
+            case APC_FIRST:
+                g->apc = *s == 'G' ? APC_KEYS : APC_IGNORE;
+                s++;
+                n--;
+                break;
+            case APC_KEYS: {
+                const char *semi = memchr(s, ';', n);
+                size_t k = semi ? (size_t)(semi - s) : n, room = KEYS_MAX - g->nkeys;
+                memcpy(g->keys + g->nkeys, s, k < room ? k : room);
+                g->nkeys += k < room ? k : room;
+                s += k;
+                n -= k;
+                if (semi) {
+                    keys_done(g);
+                    s++;
+                    n--;
+                }
+                break;
+            }
+            case APC_PAYLOAD:
+                payload(g, s, n);
+                return;
+            default:
+                return;
+        }
+    }
+}
+
+int gfx_apc_end(Term *t, int *cols, int *rows) {
+    struct Graphics *g = t->gfx;
+    if (g->apc == APC_FIRST || g->apc == APC_IGNORE) return 0;
+    if (g->apc == APC_KEYS) keys_done(g);
+    g->apc = APC_IGNORE;
+    if (g->cmd.m) return 0;     // More chunks to come
+    g->loading = 0;
+    b64_flush(g);
+    int moved = execute(t, g, cols, rows);
+    g->len = 0;
+    if (g->cap > DATA_KEEP) {
+        free(g->data);
+        g->data = NULL;
+        g->cap = 0;
+    }
+    return moved;
+}
+
+void gfx_apc_cancel(Term *t) {
+    struct Graphics *g = t->gfx;
+    g->apc = APC_IGNORE;
+    g->loading = 0;
+    g->len = 0;
+}
+
+void gfx_clear(Term *t, int all) {
+    struct Graphics *g = t->gfx;
+    for (int i = 0; i < g->nplaces;) {
+        GfxPlacement *p = &g->places[i];
+        long long row = p->line - anchor(t, p->alt);
+        if (p->alt == t->alt_screen && (all || (row + p->rows > 0 && row < t->rows))) remove_placement(g, i);
+        else i++;
+    }
+}
+
+// The alternate screen starts out blank each time, and its line numbers
+// mean nothing once the main screen has scrolled.
+void gfx_screen(Term *t) {
+    struct Graphics *g = t->gfx;
+    for (int i = 0; i < g->nplaces;) {
+        if (g->places[i].alt) remove_placement(g, i);
+        else i++;
+    }
+}
+
+unsigned gfx_version(const Term *t) {
+    return t->gfx ? t->gfx->version : 0;
+}
+
+size_t gfx_memory(const Term *t) {
+    return t->gfx ? t->gfx->stored : 0;
+}
+
+void gfx_free(Term *t) {
+    struct Graphics *g = t->gfx;
+    if (!g) return;
+    for (int i = 0; i < g->nimages; i++) pixels_unref(g->images[i].px);
+    free(g->images);
+    free(g->places);
+    free(g->data);
+    free(g);
+    t->gfx = NULL;
+}
+
+int gfx_view(Term *t, long long view_offset, GfxView **v, int *cap) {
+    struct Graphics *g = t->gfx;
+    if (!g) return 0;
+    // Placements whose lines have left the scrollback go with them. While
+    // a reflow is pending the spill isn't counted, so nothing is.
+    long long oldest = t->line_seq - term_hist_lines(t);
+    int n = 0;
+    for (int i = 0; i < g->nplaces;) {
+        GfxPlacement *p = &g->places[i];
+        if (!p->alt && !t->reflow.len && p->line + p->rows <= oldest) {
+            remove_placement(g, i);
+            continue;
+        }
+        i++;
+        long long y = p->line - anchor(t, p->alt) + view_offset;
+        if (p->alt != t->alt_screen || y + p->rows <= 0 || y >= t->rows) continue;
+        int k = image_index(g, p->image);
+        if (k < 0) continue;
+        if (n == *cap) {
+            *cap = *cap ? *cap * 2 : 8;
+            *v = realloc(*v, *cap * sizeof(**v));
+            if (!*v) die("malloc failed for image views");
+        }
+        // Lowest z first; equal z in the order they were placed.
+        int at = n++;
+        while (at > 0 && (*v)[at - 1].z > p->z) {
+            (*v)[at] = (*v)[at - 1];
+            at--;
+        }
+        GfxView *e = &(*v)[at];
+        e->px = g->images[k].px;
+        e->px->refs++;
+        e->serial = e->px->serial;
+        e->x = p->col;
+        e->y = y;
+        e->cols = p->cols;
+        e->rows = p->rows;
+        e->off_x = p->off_x;
+        e->off_y = p->off_y;
+        e->src_x = p->src_x;
+        e->src_y = p->src_y;
+        e->src_w = p->src_w;
+        e->src_h = p->src_h;
+        e->dst_w = p->dst_w;
+        e->dst_h = p->dst_h;
+        e->z = p->z;
+    }
+    return n;
+}
+
+void gfx_release(GfxView *v, int n) {
+    for (int i = 0; i < n; i++) pixels_unref(v[i].px);
+}
@@ -0,0 +1,75 @@
+// graphics.h - Inline images: the kitty graphics protocol.
+//
+// A command is an APC sequence, ESC _ G <key=value,...> ; <payload> ESC \.
+// Images are transmitted into a store, then placed on the grid; the
+// payload is base64 and is decoded as it arrives, over as many chunks as
+// the program splits it into (m=1 on all but the last). With t=f, t=t and
+// t=s the payload only names a file or a POSIX shared memory object that
+// holds the data, which is read in when the command arrives. Data may be
+// RGB (f=24), RGBA (f=32) or PNG (f=100), optionally zlib-compressed
+// (o=z).
+//
+// Placements are anchored to line numbers (see Term.line_seq), so they
+// scroll with the text and up into the scrollback, and go when their
+// lines leave it.
+//
+// Pixels are reference counted, and only the IO thread touches the
+// counts: the store holds one reference, and every snapshot that shows
+// the image another, so the snapshot the render thread is drawing from
+// keeps its pixels alive whatever the program does to the store
+// meanwhile.
+
+#ifndef XST_GRAPHICS_H
+#define XST_GRAPHICS_H
+
+#include <stddef.h>
+
+#include "term.h"
+
+#define GFX_STORE_MAX   (320 << 20)     // Bytes of pixels the store keeps
+#define GFX_DIM_MAX     10000           // Widest or tallest image accepted
+
+typedef struct {
+    int refs;
+    unsigned serial;            // Never reused; what renderers key textures by
+    int w, h, bpp;              // bpp: 3 (RGB) or 4 (RGBA)
+    const unsigned char *data;  // h rows of w * bpp bytes
+    void *mem;                  // The malloc'd block data points into
+} GfxPixels;
+
+// A placement as a snapshot carries it. x, y are the cell its top left
+// corner is in, counted in screen rows of the view; y is negative when
+// the image starts above it. The part src_x, src_y, src_w, src_h of the
+// image is drawn dst_w x dst_h pixels large, off_x, off_y pixels into
+// that cell, and covers cols x rows cells.
+typedef struct {
+    GfxPixels *px;
+    unsigned serial;
+    int x, y, cols, rows;
+    int off_x, off_y;
+    int src_x, src_y, src_w, src_h;
+    int dst_w, dst_h;
+    int z;
+} GfxView;
+
+// The parser's side: an APC sequence starting, its bytes, and its end by
+// ST or by CAN/SUB. gfx_apc_end returns 1 when the command placed an
+// image at the cursor that it should move past, cols x rows cells large.
+void gfx_apc_start(Term *t);
+void gfx_apc_put(Term *t, const char *s, size_t n);
+int gfx_apc_end(Term *t, int *cols, int *rows);
+void gfx_apc_cancel(Term *t);
+
+void gfx_clear(Term *t, int all);           // ED 2 (the screen) or ED 3 (all of it)
+void gfx_screen(Term *t);                   // The other screen is showing now
+unsigned gfx_version(const Term *t);        // Changes whenever placements do
+size_t gfx_memory(const Term *t);           // Bytes of pixels stored
+void gfx_free(Term *t);
+
+// The placements visible with the view view_offset lines back, lowest z
+// first, into *v (grown as needed). Each holds a reference to its
+// pixels, which gfx_release drops.
+int gfx_view(Term *t, long long view_offset, GfxView **v, int *cap);
+void gfx_release(GfxView *v, int n);
+
+#endif
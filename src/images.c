@@ -0,0 +1,102 @@
+// images.c - GL textures for inline images, shared by the GL renderers.
+//
+// A texture is made the first time its image is drawn and filled a band
+// of rows at a time, at most IMAGE_UPLOAD_MAX bytes a frame across all
+// images, so a large image arriving doesn't hold up the text drawn with
+// it; it shows once all of it is in. Textures are kept by pixel serial
+// until they take more than IMAGE_TEX_MAX, then the least recently drawn
+// go first. Each GL renderer keeps one cache for the share group its
+// windows' contexts are in.
+
+#define _XOPEN_SOURCE 600
+#include <stdlib.h>
+
+#include <GL/gl.h>
+
+#include "xst.h"
+
+typedef struct ImageTex {
+    unsigned serial;
+    GLuint tex;
+    int rows_done;
+    size_t bytes;
+    unsigned drawn;             // Frame it was last drawn in
+} ImageTex;
+
+int image_uploads_pending;
+
+// Frames count draws of any window in the share group.
+void image_frame(ImageCache *c) {
+    c->frame++;
+    c->upload_left = IMAGE_UPLOAD_MAX;
+    image_uploads_pending = 0;
+}
+
+static void evict(ImageCache *c, size_t need) {
+    while (c->ntexs && c->tex_bytes + need > IMAGE_TEX_MAX) {
+        int lru = 0;
+        for (int i = 1; i < c->ntexs; i++) {
+            if (c->texs[i].drawn < c->texs[lru].drawn) lru = i;
+        }
+        if (c->texs[lru].drawn == c->frame) return;     // Everything is on screen
+        glDeleteTextures(1, &c->texs[lru].tex);
+        c->tex_bytes -= c->texs[lru].bytes;
+        c->texs[lru] = c->texs[--c->ntexs];
+    }
+}
+
+unsigned image_texture(ImageCache *c, const GfxView *v) {
+    const GfxPixels *px = v->px;
+    ImageTex *e = NULL;
+    for (int i = 0; i < c->ntexs && !e; i++) {
+        if (c->texs[i].serial == v->serial) e = &c->texs[i];
+    }
+    GLenum format = px->bpp == 3 ? GL_RGB : GL_RGBA;
+    if (!e) {
+        if (!c->max_size) glGetIntegerv(GL_MAX_TEXTURE_SIZE, &c->max_size);
+        if (px->w > c->max_size || px->h > c->max_size) return 0;
+        size_t bytes = (size_t)px->w * px->h * 4;
+        evict(c, bytes);
+        if (c->ntexs == c->texs_cap) {
+            c->texs_cap = c->texs_cap ? c->texs_cap * 2 : 16;
+            c->texs = realloc(c->texs, c->texs_cap * sizeof(*c->texs));
+            if (!c->texs) die("malloc failed for image textures");
+        }
+        e = &c->texs[c->ntexs++];
+        e->serial = v->serial;
+        e->rows_done = 0;
+        e->bytes = bytes;
+        c->tex_bytes += bytes;
+        glGenTextures(1, &e->tex);
+        glBindTexture(GL_TEXTURE_2D, e->tex);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexImage2D(GL_TEXTURE_2D, 0, px->bpp == 3 ? GL_RGB8 : GL_RGBA8, px->w, px->h, 0, format,
+                     GL_UNSIGNED_BYTE, NULL);
+    }
+    e->drawn = c->frame;
+    glBindTexture(GL_TEXTURE_2D, e->tex);
+    if (e->rows_done == px->h) return e->tex;
+
+    size_t row = (size_t)px->w * px->bpp;
+    int n = c->upload_left / row;
+    if (n > px->h - e->rows_done) n = px->h - e->rows_done;
+    if (n > 0) {
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, e->rows_done, px->w, n, format, GL_UNSIGNED_BYTE,
+                        px->data + e->rows_done * row);
+        e->rows_done += n;
+        c->upload_left -= n * row;
+    }
+    if (e->rows_done == px->h) return e->tex;
+    image_uploads_pending = 1;
+    return 0;
+}
+
+void image_textures_free(ImageCache *c) {
+    for (int i = 0; i < c->ntexs; i++) glDeleteTextures(1, &c->texs[i].tex);
+    free(c->texs);
+    *c = (ImageCache){ 0 };
+}
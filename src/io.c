@@ -0,0 +1,952 @@
+// io.c - Pty/parser thread and the lock-free handoff to the render thread.
+
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pty.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+
+#include "io.h"
+
+extern char **environ;
+
+// Pty draining. Each pass parses for at most DRAIN_BUDGET_NS before the
+// thread looks at its event queue and publishes, so keys and resizes are
+// never stuck behind a flood. After FLOOD_PASSES budget-limited passes in
+// a row it goes into fast-forward: a pass parses for a whole frame
+// interval, so a snapshot goes out about once per frame and the render
+// thread drops to half rate, showing only the latest state.
+#define DRAIN_BUDGET_NS  8000000LL
+#define FLOOD_PASSES     4
+#define READ_BUF_MIN     4096
+#define READ_BUF_MAX     (1 << 20)
+
+// Bytes for the pty go through OUT_RING; pastes that don't fit wait
+// behind it and are copied in as it drains.
+#define OUT_RING         (64 * 1024)
+
+// Synchronized output (mode 2026): while a program has an update open,
+// nothing is published, so a screen it redraws in several writes goes
+// out as one frame. A program that never closes the update gets mode
+// 2026 turned off after SYNC_TIMEOUT_NS.
+#define SYNC_TIMEOUT_NS  150000000LL
+
+#define QUEUE_LEN        256     // Power of two
+#define SNAP_FRESH       4       // Set in `middle` when it holds a new snapshot
+
+// One IO thread serves every terminal. It sleeps in io_epoll on their
+// ptys and wake fds, whose events carry the Io, and on wake_thread; the
+// render thread sleeps on the one wake_render for all of them.
+static pthread_t io_thread;
+static int io_started, quit;
+static int io_epoll = -1;
+static int wake_thread = -1, wake_render = -1;  // eventfds
+static int thread_wake_pending, render_wake_pending;
+static IoStats stats;                   // Written by the IO thread only
+
+// The IO thread reads every pty into the same buffer and parses it there
+// and then.
+static char *read_buf;
+static int read_buf_size = READ_BUF_MIN;
+
+// Pty input, in order. Keys and pastes are queued and written as fast as
+// the pty takes them, so a slow reader on the other side never blocks
+// this thread (which has to keep reading its output) and nothing is
+// dropped. Bytes go into the ring while it has room and nothing is
+// waiting behind it; everything else waits in `blobs`, oldest first.
+typedef struct OutBlob {
+    struct OutBlob *next;
+    char *data;
+    size_t len, off;
+} OutBlob;
+
+// The keypress being followed for latency, if any (key_ns != 0), and the
+// out_queued count its last byte is at. A key that gets no output within
+// PROBE_TIMEOUT_NS is given up on.
+#define PROBE_TIMEOUT_NS 1000000000LL
+
+// One terminal: its pty, the handoff to the render thread and what the
+// IO thread keeps for it.
+struct Io {
+    Term *term;
+    int pty;                            // Master side
+    int wake_io;                        // eventfd, render -> IO
+    int io_wake_pending;
+    int quit, done;
+
+    // Triple buffer. The IO thread fills slots[back] and swaps it into
+    // `middle`; the render thread swaps `middle` with slots[front] when it
+    // is marked fresh. Each side owns its slot outright, so only `middle`
+    // is ever touched by both.
+    Snapshot slots[3];
+    int back, front, middle;
+
+    // Render -> IO events. q_tail is written only by the render thread and
+    // q_head only by the IO thread.
+    IoEvent queue[QUEUE_LEN];
+    unsigned q_head, q_tail;
+
+    // What the terminal's memory came to at the last publication, for
+    // io_memory; stored atomically field by field.
+    TermMemory mem;
+    size_t mem_snapshots;
+
+    // Everything below is IO-thread state.
+    unsigned round;                     // Last loop round it ran in
+    int more, reflowing;                // Work left that doesn't wait for an event
+    int flood, fast_forward;
+
+    char out_ring[OUT_RING];
+    size_t out_head, out_len;
+    OutBlob *blobs, **blobs_tail;
+    int out_watching;                   // EPOLLOUT is on for the pty
+    unsigned long long out_queued, out_written;     // Bytes so far
+
+    LatencyProbe probe, done_probe;
+    unsigned long long probe_pos;
+
+    long long sync_since;               // When publishing was first held back, 0 if it isn't
+
+    // Rows the Term reported as moved keep their versions, carried along
+    // to where they are now; see Snapshot.move_seq.
+    int move_top, move_bot;
+    long long move_seq;
+
+    // Lines of history shown above the live screen, kept anchored to the
+    // same history lines while new output scrolls the screen. It reaches
+    // into the spilled scrollback once it is past the ring's history.
+    long long view_offset;
+    unsigned long long view_scrolls;
+
+    // What the last published snapshot showed.
+    long long shown_view_offset;
+    int shown_cursor_x, shown_cursor_y, shown_fast_forward;
+    unsigned shown_title_version, shown_style_version, shown_gfx_version;
+
+    // Version of what each screen row shows, from a single clock so a
+    // version never repeats. A snapshot slot copies a row only when its own
+    // version for it is behind.
+    unsigned long long *row_version, version_clock;
+    int version_rows, version_cols;
+
+    char title[512];
+    unsigned title_version;
+
+    // Incremental search. The query is scanned for a slice at a time
+    // between reads. (sel_line, sel_x) is the selected match once
+    // sel_found is set; before that it is where to start looking, and
+    // `want` is the direction of a step still waiting for the scan to get
+    // far enough to answer it.
+    Search search;
+    char query[SEARCH_MAX + 1];
+    int query_len, searching, search_more;
+    long long sel_line;
+    int sel_x, sel_found, want;
+    unsigned sel_gen, search_clock;
+    unsigned shown_search_clock, shown_search_version;
+    long long shown_search_index, shown_search_count;
+    int shown_search_more;
+    unsigned search_version;
+};
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void wake(int fd, int *pending) {
+    if (__atomic_exchange_n(pending, 1, __ATOMIC_ACQ_REL)) return;
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN) die("eventfd write failed");
+}
+
+// Resets a wake eventfd. The pending flag is cleared only after the
+// counter is read, so a wakeup that races with this is never lost;
+// callers look at the shared state after this returns.
+static void wake_ack(int fd, int *pending) {
+    uint64_t n;
+    if (read(fd, &n, sizeof(n)) < 0 && errno != EAGAIN) die("eventfd read failed");
+    __atomic_store_n(pending, 0, __ATOMIC_RELEASE);
+}
+
+// Spawns cmd, or the shell if it is NULL, on a pty of t's size and w x h
+// pixels, with environment env (NULL: ours) in directory cwd (NULL: ours,
+// and where it can't be entered, $HOME or /). Returns the master side, or
+// -1 if the fork failed.
+static int pty_spawn(const Term *t, int w, int h, char *const *cmd, char *const *env, const char *cwd) {
+    // The environment is put together here: the child of a threaded
+    // process should do no more than it must before exec.
+    char *const *src = env ? env : environ;
+    size_t n = 0;
+    while (src[n]) n++;
+    char **envp = malloc((n + 2) * sizeof(*envp));
+    if (!envp) die("malloc failed for environment");
+    size_t k = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (strncmp(src[i], "TERM=", 5) != 0) envp[k++] = src[i];
+    }
+    envp[k++] = "TERM=xterm-256color";
+    envp[k] = NULL;
+
+    struct winsize ws = { .ws_row = t->rows, .ws_col = t->cols, .ws_xpixel = w, .ws_ypixel = h };
+    int fd;
+    pid_t pid = forkpty(&fd, NULL, NULL, &ws);
+    if (pid == 0) {
+        // The front end blocks signals to read them from a signalfd, and a
+        // daemon ignores SIGPIPE; the shell shouldn't inherit either.
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        signal(SIGPIPE, SIG_DFL);
+        environ = envp;
+        if (cwd && chdir(cwd) != 0) {
+            const char *home = getenv("HOME");
+            if ((!home || chdir(home) != 0) && chdir("/") != 0) _exit(127);
+        }
+        if (cmd) {
+            execvp(cmd[0], cmd);
+            _exit(127);
+        }
+        char *shell = getenv("SHELL");
+        if (!shell) shell = "/bin/sh";
+        execl(shell, shell, (char *)NULL);
+        _exit(127);
+    }
+    free(envp);
+    if (pid < 0) return -1;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+static void out_blob(Io *io, char *data, size_t len) {
+    OutBlob *b = malloc(sizeof(*b));
+    if (!b) die("malloc failed for pty input");
+    *b = (OutBlob){ NULL, data, len, 0 };
+    *io->blobs_tail = b;
+    io->blobs_tail = &b->next;
+}
+
+static void ring_put(Io *io, const char *s, size_t n) {
+    size_t at = (io->out_head + io->out_len) % OUT_RING;
+    size_t k = n < OUT_RING - at ? n : OUT_RING - at;
+    memcpy(io->out_ring + at, s, k);
+    memcpy(io->out_ring, s + k, n - k);
+    io->out_len += n;
+}
+
+// Queues a copy of n bytes.
+static void out_push(Io *io, const char *s, size_t n) {
+    io->out_queued += n;
+    if (!io->blobs && io->out_len + n <= OUT_RING) {
+        ring_put(io, s, n);
+        return;
+    }
+    char *data = malloc(n);
+    if (!data) die("malloc failed for pty input");
+    memcpy(data, s, n);
+    out_blob(io, data, n);
+}
+
+static void out_discard(Io *io) {
+    while (io->blobs) {
+        OutBlob *b = io->blobs;
+        io->blobs = b->next;
+        free(b->data);
+        free(b);
+    }
+    io->blobs_tail = &io->blobs;
+    io->out_len = 0;
+}
+
+// Writes what the pty will take without blocking, refilling the ring
+// from the waiting blobs, and watches for the pty to become writable
+// while anything is left.
+static void out_flush(Io *io) {
+    for (;;) {
+        while (io->blobs && io->out_len < OUT_RING) {
+            OutBlob *b = io->blobs;
+            size_t n = b->len - b->off;
+            if (n > OUT_RING - io->out_len) n = OUT_RING - io->out_len;
+            ring_put(io, b->data + b->off, n);
+            b->off += n;
+            if (b->off < b->len) break;
+            io->blobs = b->next;
+            if (!io->blobs) io->blobs_tail = &io->blobs;
+            free(b->data);
+            free(b);
+        }
+        if (!io->out_len) break;
+        size_t n = io->out_len < OUT_RING - io->out_head ? io->out_len : OUT_RING - io->out_head;
+        ssize_t w = write(io->pty, io->out_ring + io->out_head, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && errno == EAGAIN) break;
+        if (w <= 0) {
+            // The pty is gone; the read side will notice.
+            out_discard(io);
+            break;
+        }
+        io->out_head = (io->out_head + w) % OUT_RING;
+        io->out_len -= w;
+        io->out_written += w;
+        if (io->probe.key_ns && !io->probe.write_ns && io->out_written >= io->probe_pos) io->probe.write_ns = now_ns();
+    }
+    int watch = io->out_len > 0;
+    if (watch != io->out_watching) {
+        struct epoll_event ev = { .events = EPOLLIN | (watch ? EPOLLOUT : 0), .data.ptr = io };
+        if (epoll_ctl(io_epoll, EPOLL_CTL_MOD, io->pty, &ev) < 0) die("epoll_ctl failed");
+        io->out_watching = watch;
+    }
+}
+
+// Queues a paste, taking over `data`. Newlines go in as carriage returns,
+// as typed Enter would. With bracketed paste on, the text is wrapped in
+// the markers, and any end marker inside it is dropped so the text can't
+// end the paste early.
+static void out_paste(Io *io, char *data, size_t len) {
+    static const char end[] = "\033[201~";
+    int bracketed = io->term->bracketed_paste;
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (bracketed && data[i] == '\033' && len - i >= sizeof(end) - 1 && memcmp(data + i, end, sizeof(end) - 1) == 0) {
+            i += sizeof(end) - 2;
+            continue;
+        }
+        data[n++] = data[i] == '\n' ? '\r' : data[i];
+    }
+    if (bracketed) out_push(io, "\033[200~", 6);
+    io->out_queued += n;
+    if (n) out_blob(io, data, n);
+    else free(data);
+    if (bracketed) out_push(io, end, sizeof(end) - 1);
+}
+
+static void io_set_title(Term *t, const char *s) {
+    Io *io = t->user;
+    snprintf(io->title, sizeof(io->title), "%s", s);
+    io->title_version++;
+}
+
+static void io_report_mode(Term *t, int mode, int state) {
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\033[?%d;%d$y", mode, state);
+    out_push(t->user, buf, len);
+}
+
+static void io_respond(Term *t, const char *s, size_t len) {
+    out_push(t->user, s, len);
+}
+
+// Reads and parses pty output until the pty would block or `budget` ns
+// have passed. The read buffer doubles while reads keep filling it and
+// shrinks again once output slows down. Returns 0 when drained, 1 when
+// the budget ran out with data possibly left, -1 when the pty closed.
+static int pty_drain(Io *io, long long budget) {
+    long long start = now_ns();
+    for (;;) {
+        ssize_t n = read(io->pty, read_buf, read_buf_size);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+        if (n <= 0) return -1;
+        if (io->probe.write_ns && !io->probe.read_ns) io->probe.read_ns = now_ns();
+        term_write(io->term, read_buf, n);
+        if (n == read_buf_size && read_buf_size < READ_BUF_MAX) {
+            char *b = realloc(read_buf, read_buf_size * 2);
+            if (b) { read_buf = b; read_buf_size *= 2; }
+        } else if (n < read_buf_size / 4 && read_buf_size > READ_BUF_MIN) {
+            read_buf_size /= 2;
+        }
+        if (now_ns() - start >= budget) return 1;
+    }
+}
+
+// Looks for the next match in direction `want` from the selection, and
+// selects it once the scan has covered everything between. The view
+// moves only when the match is off screen, and then centres it.
+static void search_resolve(Io *io) {
+    Term *t = io->term;
+    if (!io->searching) return;
+    if (io->sel_gen != t->hist_gen) {
+        // Line numbers were redone; start over from the bottom.
+        io->sel_line = t->line_seq + t->rows;
+        io->sel_x = 0;
+        io->sel_found = 0;
+        io->sel_gen = t->hist_gen;
+        io->want = 1;
+        io->search_clock++;
+    }
+    long long oldest = t->line_seq - term_hist_lines(t);
+    if (io->sel_found && io->sel_line < oldest) {
+        io->sel_found = 0;
+        io->search_clock++;
+    }
+    if (!io->want || !io->search.len) return;
+    const SearchMatch *m = NULL;
+    if (io->want > 0) {
+        long long i = search_rank(&io->search, io->sel_line, io->sel_x);
+        if (!search_covers(&io->search, t, i > 0 ? search_get(&io->search, i - 1)->line : oldest)) return;
+        if (i > 0) m = search_get(&io->search, i - 1);
+    } else {
+        long long i = search_rank(&io->search, io->sel_line, io->sel_x + 1);
+        if (!search_covers(&io->search, t, io->sel_line)) return;
+        if (i < search_count(&io->search)) m = search_get(&io->search, i);
+    }
+    io->want = 0;
+    if (!m) return;
+    io->sel_line = m->line;
+    io->sel_x = m->x;
+    io->sel_found = 1;
+    io->search_clock++;
+    long long y = m->line - t->line_seq;
+    if (y + io->view_offset < 0 || y + io->view_offset >= t->rows) {
+        io->view_offset = t->rows / 2 - y;
+        while (io->view_offset > t->hist_len && term_reflow(t, REFLOW_STEP)) {}
+        if (io->view_offset > term_hist_lines(t)) io->view_offset = term_hist_lines(t);
+        if (io->view_offset < 0) io->view_offset = 0;
+        io->view_scrolls = t->stats.scrolls;    // Already counted in line_seq
+    }
+}
+
+// Query edits keep the selection if it still matches, and otherwise move
+// to the nearest match above it, or above the bottom of the view.
+static void search_edit(Io *io, const IoEvent *ev) {
+    Term *t = io->term;
+    for (int n = ev->a; n > 0 && io->query_len > 0; n--) {
+        while (io->query_len > 1 && ((unsigned char)io->query[io->query_len - 1] & 0xc0) == 0x80) io->query_len--;
+        io->query_len--;
+    }
+    for (int i = 0; i < ev->len && io->query_len < SEARCH_MAX; i++) io->query[io->query_len++] = ev->text[i];
+    io->query[io->query_len] = 0;
+    io->searching = 1;
+    search_set(&io->search, io->query, io->query_len);
+    if (io->sel_found) {
+        io->sel_x++;
+    } else {
+        io->sel_line = t->line_seq + t->rows - io->view_offset;
+        io->sel_x = 0;
+    }
+    io->sel_found = 0;
+    io->sel_gen = t->hist_gen;
+    io->want = 1;
+    io->search_clock++;
+}
+
+static void handle_event(Io *io, const IoEvent *ev) {
+    Term *t = io->term;
+    switch (ev->type) {
+        case IO_KEY:
+            io->view_offset = 0;
+            if (ev->stamp && (!io->probe.key_ns || ev->stamp - io->probe.key_ns > PROBE_TIMEOUT_NS)) {
+                io->probe = (LatencyProbe){ io->probe.id + 1, ev->stamp, 0, 0 };
+                io->probe_pos = io->out_queued + ev->len;
+            }
+            out_push(io, ev->text, ev->len);
+            break;
+        case IO_PASTE:
+            io->view_offset = 0;
+            out_paste(io, ev->data, ev->len);
+            break;
+        case IO_SCROLL:
+            io->view_offset += ev->a;
+            while (io->view_offset > t->hist_len && term_reflow(t, REFLOW_STEP)) {}
+            if (io->view_offset > term_hist_lines(t)) io->view_offset = term_hist_lines(t);
+            if (io->view_offset < 0) io->view_offset = 0;
+            break;
+        case IO_RESIZE: {
+            // Reflow moves history lines around; go back to live.
+            io->view_offset = 0;
+            term_resize(t, ev->a, ev->b);
+            t->cell_w = ev->w / t->cols;
+            t->cell_h = ev->h / t->rows;
+            struct winsize ws = { .ws_row = t->rows, .ws_col = t->cols, .ws_xpixel = ev->w, .ws_ypixel = ev->h };
+            ioctl(io->pty, TIOCSWINSZ, &ws);
+            break;
+        }
+        case IO_SEARCH:
+            search_edit(io, ev);
+            break;
+        case IO_SEARCH_STEP:
+            io->want = ev->a > 0 ? 1 : -1;
+            break;
+        case IO_SEARCH_END:
+            io->searching = io->sel_found = io->want = 0;
+            io->query_len = 0;
+            io->query[0] = 0;
+            search_set(&io->search, io->query, 0);
+            io->search_clock++;
+            break;
+    }
+}
+
+// Marks the matches in row y of a snapshot, which shows line
+// t->line_seq + y - view_offset.
+static void mark_matches(Io *io, Cell *row, int y) {
+    Term *t = io->term;
+    size_t len;
+    const unsigned char *text = term_line_text(t, y - io->view_offset, &len);
+    long long line = t->line_seq + y - io->view_offset;
+    int n = search_text(&io->search, text, len);
+    for (int i = 0; i < n; i++) {
+        int x = io->search.hits[i];
+        unsigned short mark = ATTR_MATCH;
+        if (io->sel_found && line == io->sel_line && x == io->sel_x) mark |= ATTR_MATCH_CUR;
+        for (int e = x + io->search.width; x < e && x < t->cols; x++) row[x].attr |= mark;
+    }
+}
+
+// Notes where the terminal's memory goes, for io_memory.
+static void note_memory(Io *io) {
+    TermMemory m;
+    term_memory(io->term, &m);
+    size_t snap = 0;
+    for (int i = 0; i < 3; i++) {
+        const Snapshot *s = &io->slots[i];
+        snap += (size_t)s->rows * s->cols * sizeof(Cell) + s->rows * sizeof(*s->row_version) +
+                s->styles_cap * sizeof(Style) + s->images_cap * sizeof(GfxView);
+    }
+    __atomic_store_n(&io->mem.rows, m.rows, __ATOMIC_RELAXED);
+    __atomic_store_n(&io->mem.spill_ram, m.spill_ram, __ATOMIC_RELAXED);
+    __atomic_store_n(&io->mem.spill_lines, m.spill_lines, __ATOMIC_RELAXED);
+    __atomic_store_n(&io->mem.spill_disk, m.spill_disk, __ATOMIC_RELAXED);
+    __atomic_store_n(&io->mem.spill_raw, m.spill_raw, __ATOMIC_RELAXED);
+    __atomic_store_n(&io->mem.images, m.images, __ATOMIC_RELAXED);
+    __atomic_store_n(&io->mem_snapshots, snap, __ATOMIC_RELAXED);
+}
+
+// Copies whatever changed since this slot was last filled into the back
+// buffer and swaps it into `middle`. Does nothing if the screen, cursor
+// and title are all unchanged.
+static void publish(Io *io) {
+    Term *t = io->term;
+    if (t->sync_update) {
+        long long now = now_ns();
+        if (!io->sync_since) io->sync_since = now;
+        if (now - io->sync_since < SYNC_TIMEOUT_NS) {
+            __atomic_store_n(&stats.sync_held, stats.sync_held + 1, __ATOMIC_RELAXED);
+            return;
+        }
+        t->sync_update = 0;
+        __atomic_store_n(&stats.sync_timeouts, stats.sync_timeouts + 1, __ATOMIC_RELAXED);
+    } else if (io->sync_since) {
+        __atomic_store_n(&stats.sync_updates, stats.sync_updates + 1, __ATOMIC_RELAXED);
+    }
+    io->sync_since = 0;
+    if (io->view_offset > 0) io->view_offset += t->stats.scrolls - io->view_scrolls;
+    io->view_scrolls = t->stats.scrolls;
+    if (io->view_offset > term_hist_lines(t)) io->view_offset = term_hist_lines(t);
+
+    int all = io->view_offset != io->shown_view_offset;
+    // A new query or selection changes the marks on every row.
+    if (io->search_clock != io->shown_search_clock) {
+        io->shown_search_clock = io->search_clock;
+        io->search_version++;
+        all = 1;
+    }
+    if (io->version_rows != t->rows || io->version_cols != t->cols) {
+        free(io->row_version);
+        io->row_version = calloc(t->rows, sizeof(*io->row_version));
+        if (!io->row_version) die("malloc failed for row versions");
+        io->version_rows = t->rows; io->version_cols = t->cols;
+        all = 1;
+    }
+    io->shown_view_offset = io->view_offset;
+
+    // Rows that only moved keep their versions, shifted to where they
+    // went. The moves are the live screen's: in the scrollback view every
+    // row changes anyway.
+    if (t->move_n && io->view_offset) all = 1;
+    if (t->move_n && !all) {
+        int top = t->move_top, bot = t->move_bot, n = t->move_n;
+        if (top != io->move_top || bot != io->move_bot) {
+            io->move_top = top;
+            io->move_bot = bot;
+            io->move_seq = 0;
+        }
+        io->move_seq += n;
+        unsigned long long *rv = io->row_version;
+        if (n > 0) memmove(rv + top, rv + top + n, (bot - top + 1 - n) * sizeof(*rv));
+        else memmove(rv + top - n, rv + top, (bot - top + 1 + n) * sizeof(*rv));
+    }
+    t->move_n = 0;
+
+    // The search status in the title
+    long long index = io->sel_found ? search_rank(&io->search, io->sel_line, io->sel_x) + 1 : 0;
+    long long count = search_count(&io->search);
+    if (index != io->shown_search_index || count != io->shown_search_count || io->search_more != io->shown_search_more) {
+        io->shown_search_index = index;
+        io->shown_search_count = count;
+        io->shown_search_more = io->search_more;
+        io->search_version++;
+    }
+
+    int cy = io->view_offset < t->rows ? t->cursor_y + io->view_offset : -1;
+    if (cy >= t->rows) cy = -1;
+    int changed = all || io->shown_cursor_x != t->cursor_x || io->shown_cursor_y != cy ||
+                  io->shown_title_version != io->title_version || io->shown_fast_forward != io->fast_forward ||
+                  io->shown_style_version != t->styles.version || io->shown_search_version != io->search_version ||
+                  io->shown_gfx_version != gfx_version(t);
+    for (int y = 0; y < t->rows; y++) {
+        if (!all && !t->dirty[y]) continue;
+        io->row_version[y] = ++io->version_clock;
+        t->dirty[y] = 0;
+        changed = 1;
+    }
+    if (!changed) {
+        // The key's output changed nothing on screen: nothing to time.
+        if (io->probe.read_ns) io->probe.key_ns = io->probe.write_ns = io->probe.read_ns = 0;
+        return;
+    }
+    io->shown_cursor_x = t->cursor_x;
+    io->shown_cursor_y = cy;
+    io->shown_title_version = io->title_version;
+    io->shown_fast_forward = io->fast_forward;
+    io->shown_style_version = t->styles.version;
+    io->shown_search_version = io->search_version;
+    io->shown_gfx_version = gfx_version(t);
+
+    // The back slot may be two publications old; its own row versions say
+    // which rows it is missing.
+    Snapshot *s = &io->slots[io->back];
+    if (s->rows != t->rows || s->cols != t->cols) {
+        free(s->cells);
+        free(s->row_version);
+        s->cells = malloc((size_t)t->rows * t->cols * sizeof(Cell));
+        s->row_version = calloc(t->rows, sizeof(*s->row_version));
+        if (!s->cells || !s->row_version) die("malloc failed for snapshot");
+        s->rows = t->rows; s->cols = t->cols;
+    }
+    for (int y = 0; y < t->rows; y++) {
+        if (s->row_version[y] == io->row_version[y]) continue;
+        memcpy(s->cells + (size_t)y * t->cols, term_view_line(t, y - io->view_offset), t->cols * sizeof(Cell));
+        if (io->search.len) mark_matches(io, s->cells + (size_t)y * t->cols, y);
+        s->row_version[y] = io->row_version[y];
+    }
+    s->cursor_x = t->cursor_x;
+    s->cursor_y = cy;
+    s->fast_forward = io->fast_forward;
+    // Ids are only reassigned to styles no row refers to, so copying the
+    // table whenever it changed keeps it in step with the rows above.
+    if (s->style_version != t->styles.version || !s->styles) {
+        if (s->styles_cap < t->styles.cap) {
+            free(s->styles);
+            s->styles = malloc(t->styles.cap * sizeof(Style));
+            if (!s->styles) die("malloc failed for snapshot styles");
+            s->styles_cap = t->styles.cap;
+        }
+        memcpy(s->styles, t->styles.styles, t->styles.len * sizeof(Style));
+        s->nstyles = t->styles.len;
+        s->style_version = t->styles.version;
+    }
+    if (s->title_version != io->title_version) {
+        memcpy(s->title, io->title, sizeof(io->title));
+        s->title_version = io->title_version;
+    }
+    if (s->search_version != io->search_version) {
+        s->searching = io->searching;
+        memcpy(s->search_query, io->query, sizeof(io->query));
+        s->search_index = index;
+        s->search_count = count;
+        s->search_more = io->search_more;
+        s->search_version = io->search_version;
+    }
+
+    // Once a probed key's output has come in, every snapshot carries it
+    // until the next one, so it isn't lost when the render thread skips
+    // a snapshot.
+    if (io->probe.read_ns) {
+        io->done_probe = io->probe;
+        io->probe.key_ns = io->probe.write_ns = io->probe.read_ns = 0;
+    }
+    gfx_release(s->images, s->nimages);
+    s->nimages = gfx_view(t, io->view_offset, &s->images, &s->images_cap);
+    s->move_top = io->move_top;
+    s->move_bot = io->move_bot;
+    s->move_seq = io->move_seq;
+    s->probe = io->done_probe;
+    s->parsed = t->stats.bytes;
+    note_memory(io);
+
+    io->back = __atomic_exchange_n(&io->middle, io->back | SNAP_FRESH, __ATOMIC_ACQ_REL) & 3;
+    __atomic_store_n(&stats.snapshots, stats.snapshots + 1, __ATOMIC_RELAXED);
+    wake(wake_render, &render_wake_pending);
+}
+
+// The IO thread lets go of io: its fds leave the epoll set and the render
+// thread is told. io must not be touched after this.
+static void io_finish(Io *io) {
+    epoll_ctl(io_epoll, EPOLL_CTL_DEL, io->pty, NULL);
+    epoll_ctl(io_epoll, EPOLL_CTL_DEL, io->wake_io, NULL);
+    __atomic_store_n(&io->done, 1, __ATOMIC_RELEASE);
+    wake(wake_render, &render_wake_pending);
+}
+
+// One round for one terminal: events, pty input and output, reflow,
+// search, publish. Returns 1 if it has work left that it should be called
+// again for without waiting for an event, 0 otherwise, including when it
+// let go of io.
+static int io_pass(Io *io) {
+    if (__atomic_load_n(&io->quit, __ATOMIC_ACQUIRE)) {
+        io_finish(io);
+        return 0;
+    }
+    wake_ack(io->wake_io, &io->io_wake_pending);
+    unsigned head = io->q_head;
+    for (unsigned tail = __atomic_load_n(&io->q_tail, __ATOMIC_ACQUIRE); head != tail; head++) {
+        handle_event(io, &io->queue[head & (QUEUE_LEN - 1)]);
+        __atomic_store_n(&io->q_head, head + 1, __ATOMIC_RELEASE);
+    }
+
+    out_flush(io);
+
+    // A pty with nothing to read just says so.
+    io->more = pty_drain(io, io->fast_forward ? FRAME_INTERVAL_NS : DRAIN_BUDGET_NS);
+    if (io->more < 0) {
+        io_finish(io);
+        return 0;
+    }
+    io->flood = io->more ? io->flood + 1 : 0;
+    io->fast_forward = io->flood >= FLOOD_PASSES;
+    // Scrollback left behind by a resize is reflowed a slice at a time
+    // while the pty is quiet.
+    io->reflowing = !io->more && term_reflow(io->term, REFLOW_STEP);
+    // So is the scrollback being searched, new lines first.
+    io->search_more = search_step(&io->search, io->term, SEARCH_STEP);
+    search_resolve(io);
+    publish(io);
+    return io->more || io->reflowing || io->search_more || io->sync_since;
+}
+
+static void *io_main(void *arg) {
+    (void)arg;
+    // Terminals that had work left over run every round without an event
+    // for them; `run` is the round's, with the ones that had events.
+    Io **busy = NULL, **run = NULL;
+    int nbusy = 0, cap = 0;
+    unsigned round = 0;
+    while (!__atomic_load_n(&quit, __ATOMIC_ACQUIRE)) {
+        // With work left only poll; otherwise sleep until a pty or the
+        // render thread has something, or a held-back synchronized update
+        // times out.
+        int timeout = -1;
+        long long now = now_ns();
+        for (int i = 0; i < nbusy && timeout != 0; i++) {
+            const Io *io = busy[i];
+            int t = 0;
+            if (!(io->more || io->reflowing || io->search_more)) {
+                long long left = io->sync_since + SYNC_TIMEOUT_NS - now;
+                t = left > 0 ? left / 1000000 + 1 : 0;
+            }
+            if (timeout < 0 || t < timeout) timeout = t;
+        }
+        struct epoll_event evs[64];
+        int n = epoll_wait(io_epoll, evs, 64, timeout);
+        if (n < 0) {
+            if (errno != EINTR) die("epoll_wait failed");
+            n = 0;
+        }
+        if (timeout < 0) __atomic_store_n(&stats.wakeups, stats.wakeups + 1, __ATOMIC_RELAXED);
+
+        if (nbusy + n > cap) {
+            cap = (nbusy + n) * 2;
+            busy = realloc(busy, cap * sizeof(*busy));
+            run = realloc(run, cap * sizeof(*run));
+            if (!busy || !run) die("malloc failed for terminals");
+        }
+        round++;
+        int nrun = 0;
+        for (int i = 0; i < nbusy; i++) {
+            busy[i]->round = round;
+            run[nrun++] = busy[i];
+        }
+        for (int i = 0; i < n; i++) {
+            Io *io = evs[i].data.ptr;
+            if (!io) {
+                wake_ack(wake_thread, &thread_wake_pending);
+            } else if (io->round != round) {
+                io->round = round;
+                run[nrun++] = io;
+            }
+        }
+        nbusy = 0;
+        for (int i = 0; i < nrun; i++) {
+            if (io_pass(run[i])) busy[nbusy++] = run[i];
+        }
+    }
+    free(busy);
+    free(run);
+    return NULL;
+}
+
+static int new_eventfd() {
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) die("eventfd failed");
+    return fd;
+}
+
+// Adds fd to an epoll set, reporting readability; the fd itself is the
+// event's data.
+void epoll_watch(int ep, int fd) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0) die("epoll_ctl failed");
+}
+
+// Spawns cmd (see pty_spawn) on a pty for `t` and hands `t` to the IO
+// thread, starting it with the first terminal. The caller must not touch
+// `t` again until io_close() returns. Returns NULL if the fork failed.
+Io *io_open(Term *t, int w, int h, char *const *cmd, char *const *env, const char *cwd) {
+    int pty = pty_spawn(t, w, h, cmd, env, cwd);
+    if (pty < 0) return NULL;
+    Io *io = calloc(1, sizeof(*io));
+    if (!io) die("malloc failed for terminal");
+    io->term = t;
+    io->pty = pty;
+    io->back = 0; io->front = 1; io->middle = 2;
+    io->blobs_tail = &io->blobs;
+    io->move_top = io->move_bot = -1;
+    io->shown_cursor_x = io->shown_cursor_y = -1;
+    io->shown_search_index = io->shown_search_count = -1;
+    io->shown_search_more = -1;
+    t->user = io;
+    t->set_title = io_set_title;
+    t->report_mode = io_report_mode;
+    t->respond = io_respond;
+    io->wake_io = new_eventfd();
+
+    if (!io_started) {
+        read_buf = malloc(read_buf_size);
+        if (!read_buf) die("malloc failed for read buffer");
+        wake_thread = new_eventfd();
+        io_wake_fd();
+        io_epoll = epoll_create1(EPOLL_CLOEXEC);
+        if (io_epoll < 0) die("epoll_create1 failed");
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        if (epoll_ctl(io_epoll, EPOLL_CTL_ADD, wake_thread, &ev) < 0) die("epoll_ctl failed");
+        if (pthread_create(&io_thread, NULL, io_main, NULL) != 0) die("pthread_create failed");
+        io_started = 1;
+    }
+    // From here on the IO thread may pick it up.
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = io };
+    if (epoll_ctl(io_epoll, EPOLL_CTL_ADD, io->pty, &ev) < 0 ||
+        epoll_ctl(io_epoll, EPOLL_CTL_ADD, io->wake_io, &ev) < 0) die("epoll_ctl failed");
+    return io;
+}
+
+// Called from the render thread only. Waits for the IO thread to let go
+// of io, then frees it and closes the pty, which hangs up on the shell.
+void io_close(Io *io) {
+    __atomic_store_n(&io->quit, 1, __ATOMIC_RELEASE);
+    wake(io->wake_io, &io->io_wake_pending);
+    while (!io_done(io)) {
+        struct pollfd p = { wake_render, POLLIN, 0 };
+        if (poll(&p, 1, -1) < 0 && errno != EINTR) die("poll failed");
+        io_wake_ack();
+    }
+    for (unsigned head = io->q_head; head != io->q_tail; head++) {
+        IoEvent *ev = &io->queue[head & (QUEUE_LEN - 1)];
+        if (ev->type == IO_PASTE) free(ev->data);
+    }
+    for (int i = 0; i < 3; i++) {
+        free(io->slots[i].cells);
+        free(io->slots[i].row_version);
+        free(io->slots[i].styles);
+        gfx_release(io->slots[i].images, io->slots[i].nimages);
+        free(io->slots[i].images);
+    }
+    free(io->row_version);
+    search_free(&io->search);
+    out_discard(io);
+    close(io->wake_io);
+    close(io->pty);
+    io->term->set_title = NULL;
+    io->term->report_mode = NULL;
+    io->term->respond = NULL;
+    io->term->user = NULL;
+    free(io);
+}
+
+// Stops the IO thread; every Io must have been closed.
+void io_shutdown() {
+    if (io_started) {
+        __atomic_store_n(&quit, 1, __ATOMIC_RELEASE);
+        wake(wake_thread, &thread_wake_pending);
+        pthread_join(io_thread, NULL);
+        free(read_buf);
+        read_buf = NULL;
+        close(wake_thread);
+        close(io_epoll);
+        io_started = quit = 0;
+    }
+    if (wake_render >= 0) close(wake_render);
+    wake_render = -1;
+}
+
+// Made on first use, so the render thread can watch it before the first
+// terminal opens.
+int io_wake_fd() {
+    if (wake_render < 0) wake_render = new_eventfd();
+    return wake_render;
+}
+
+// Called from the render thread only, before it looks at the terminals'
+// snapshots and io_done, so that no wake is lost between.
+void io_wake_ack() {
+    wake_ack(wake_render, &render_wake_pending);
+}
+
+int io_done(Io *io) {
+    return __atomic_load_n(&io->done, __ATOMIC_ACQUIRE);
+}
+
+// Called from the render thread only. Waits (yielding) in the unlikely
+// case the queue is full rather than dropping input.
+void io_send(Io *io, const IoEvent *ev) {
+    unsigned tail = io->q_tail;
+    while (tail - __atomic_load_n(&io->q_head, __ATOMIC_ACQUIRE) == QUEUE_LEN) sched_yield();
+    io->queue[tail & (QUEUE_LEN - 1)] = *ev;
+    __atomic_store_n(&io->q_tail, tail + 1, __ATOMIC_RELEASE);
+    wake(io->wake_io, &io->io_wake_pending);
+}
+
+// Called from the render thread only. Returns the newest published
+// snapshot; *fresh is set if it differs from the one returned last time.
+// The result stays valid until the next call.
+const Snapshot *io_snapshot(Io *io, int *fresh) {
+    *fresh = 0;
+    if (__atomic_load_n(&io->middle, __ATOMIC_ACQUIRE) & SNAP_FRESH) {
+        io->front = __atomic_exchange_n(&io->middle, io->front, __ATOMIC_ACQ_REL) & 3;
+        *fresh = 1;
+    }
+    return &io->slots[io->front];
+}
+
+// Safe to call from any thread: the terminal's memory as of its last
+// publication, and what its three snapshot slots hold.
+void io_memory(Io *io, TermMemory *m, size_t *snapshots) {
+    m->rows = __atomic_load_n(&io->mem.rows, __ATOMIC_RELAXED);
+    m->spill_ram = __atomic_load_n(&io->mem.spill_ram, __ATOMIC_RELAXED);
+    m->spill_lines = __atomic_load_n(&io->mem.spill_lines, __ATOMIC_RELAXED);
+    m->spill_disk = __atomic_load_n(&io->mem.spill_disk, __ATOMIC_RELAXED);
+    m->spill_raw = __atomic_load_n(&io->mem.spill_raw, __ATOMIC_RELAXED);
+    m->images = __atomic_load_n(&io->mem.images, __ATOMIC_RELAXED);
+    *snapshots = __atomic_load_n(&io->mem_snapshots, __ATOMIC_RELAXED);
+}
+
+// Safe to call from any thread; the counts may be a moment behind.
+void io_stats(IoStats *st) {
+    st->wakeups = __atomic_load_n(&stats.wakeups, __ATOMIC_RELAXED);
+    st->snapshots = __atomic_load_n(&stats.snapshots, __ATOMIC_RELAXED);
+    st->sync_updates = __atomic_load_n(&stats.sync_updates, __ATOMIC_RELAXED);
+    st->sync_held = __atomic_load_n(&stats.sync_held, __ATOMIC_RELAXED);
+    st->sync_timeouts = __atomic_load_n(&stats.sync_timeouts, __ATOMIC_RELAXED);
+}
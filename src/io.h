@@ -0,0 +1,110 @@
+// io.h - Pty/parser thread and its lock-free handoff to the render thread.
+//
+// The IO thread owns the live Terms: for each one it reads the pty,
+// parses, and publishes a copy of what should be on screen into a triple
+// buffer. The render thread only ever sees those snapshots, and talks back
+// through a single-producer single-consumer event queue per terminal.
+// Neither side takes a lock. One IO thread serves every terminal in the
+// process, sleeping in one epoll set on all of their ptys.
+
+#ifndef XST_IO_H
+#define XST_IO_H
+
+#include "term.h"
+#include "search.h"
+#include "graphics.h"
+
+// Frames are drawn at most once per FRAME_INTERVAL_NS; see io.c for how the
+// IO thread paces parsing against it.
+#define FRAME_INTERVAL_NS 16666667LL
+
+// One keypress followed from the X event to the screen, to measure input
+// latency. The IO thread fills in when its bytes were written to the pty
+// and when the next pty read after that came in; the render thread adds
+// when the snapshot carrying it was drawn and shown. Timestamps are
+// CLOCK_MONOTONIC ns.
+typedef struct {
+    unsigned id;                    // 0: none; a new key gets a new id
+    long long key_ns, write_ns, read_ns;
+} LatencyProbe;
+
+// What the render thread needs to draw one frame. Rows are already
+// resolved against the scrollback view, so row y is exactly what goes on
+// screen row y.
+typedef struct {
+    int cols, rows;
+    int cursor_x, cursor_y;         // cursor_y < 0: scrolled out of view
+    int fast_forward;               // Output is flooding; draw at half rate
+    Cell *cells;                    // rows * cols
+    unsigned long long *row_version; // Bumped whenever row y changes
+    Style *styles;                  // What the cells' style ids refer to
+    int nstyles, styles_cap;
+    unsigned style_version;         // Changes whenever the table does
+    char title[512];
+    unsigned title_version;
+    // Search status. Matches are marked in the cells with ATTR_MATCH and
+    // ATTR_MATCH_CUR.
+    int searching;
+    char search_query[SEARCH_MAX + 1];
+    long long search_index;         // Of the selected match, from 1; 0: none
+    long long search_count;
+    int search_more;                // Still scanning the scrollback
+    unsigned search_version;        // Changes whenever the fields above do
+    // Rows move_top..move_bot have moved up move_seq rows in all
+    // (down if negative) since that region was first reported. A row
+    // whose version shows up k rows lower in an older snapshot, where
+    // k is the difference in move_seq, is that row moved up by k.
+    int move_top, move_bot;
+    long long move_seq;
+    // Image placements in view, lowest z first. The slot holds a
+    // reference to each one's pixels until it is refilled.
+    GfxView *images;
+    int nimages, images_cap;
+    LatencyProbe probe;             // Newest key whose echo this shows
+    unsigned long long parsed;      // Term.stats.bytes
+} Snapshot;
+
+enum {
+    IO_KEY,         // Bytes for the pty; also snaps the view back to live
+    IO_SCROLL,      // Move the scrollback view by `a` lines (+ is back)
+    IO_RESIZE,      // a x b cells, w x h pixels
+    IO_SEARCH,      // Start searching, or edit the query: drop `a` characters, append text
+    IO_SEARCH_STEP, // Select the next older (a > 0) or newer (a < 0) match
+    IO_SEARCH_END,
+    IO_PASTE,       // `len` bytes at `data`, which the IO thread frees
+};
+
+typedef struct {
+    int type;
+    int a, b, w, h;
+    int len;
+    char text[32];
+    char *data;
+    long long stamp;                // IO_KEY: when the X event came in
+} IoEvent;
+
+// Counters for checking that an idle terminal really sleeps, and that
+// synchronized updates come out as one frame each; for all terminals.
+typedef struct {
+    unsigned long long wakeups;     // Times the IO thread woke from an idle wait
+    unsigned long long snapshots;   // Snapshots published
+    unsigned long long sync_updates;    // Synchronized updates that ended and were published
+    unsigned long long sync_held;       // Publications held back inside one
+    unsigned long long sync_timeouts;   // Updates cut short by SYNC_TIMEOUT_NS
+} IoStats;
+
+typedef struct Io Io;
+
+Io *io_open(Term *t, int w, int h, char *const *cmd, char *const *env, const char *cwd);
+void io_close(Io *io);
+void io_shutdown(void);                 // Stops the IO thread once every Io is closed
+int io_wake_fd(void);                   // Readable when a snapshot or exit is pending
+void io_wake_ack(void);                 // Before looking at the terminals after a wake
+int io_done(Io *io);                    // Nonzero once the pty has closed
+void io_send(Io *io, const IoEvent *ev);
+const Snapshot *io_snapshot(Io *io, int *fresh);
+void io_memory(Io *io, TermMemory *m, size_t *snapshots);
+void io_stats(IoStats *st);
+void epoll_watch(int ep, int fd);
+
+#endif
@@ -0,0 +1,132 @@
+// mkparser.c - Generates parser_table.h, the escape sequence parser's
+// transition table used by term.c.
+//
+// Run by the Makefile at build time. The rules below follow Paul Williams'
+// DEC-compatible parser (https://vt100.net/emu/dec_ansi_parser), with two
+// changes: ':' is a parameter separator (for SGR sub-parameters such as
+// 38:2::r:g:b) and bytes >= 0x80 are UTF-8, so there are no 8-bit C1
+// controls. The table is indexed by [state][byte]; see term.h for the
+// entry layout.
+
+#include <stdio.h>
+
+#include "term.h"
+
+static unsigned short table[VT_NSTATES][256];
+static VtAction entry_action[VT_NSTATES], exit_action[VT_NSTATES];
+
+// Byte range a..b in `state` runs `action` and stays put.
+static void on(int state, int a, int b, VtAction action) {
+    for (int c = a; c <= b; c++) table[state][c] = state | (action << VT_ACTION_SHIFT);
+}
+
+// Byte range a..b in `state` runs `action` and moves to `next`.
+static void go(int state, int a, int b, VtAction action, int next) {
+    for (int c = a; c <= b; c++) table[state][c] = next | VT_TRANSITION | (action << VT_ACTION_SHIFT);
+}
+
+// C0 controls other than CAN, SUB and ESC, which are handled everywhere.
+static void c0(int state, VtAction action) {
+    on(state, 0x00, 0x17, action);
+    on(state, 0x19, 0x19, action);
+    on(state, 0x1c, 0x1f, action);
+}
+
+int main(void) {
+    for (int s = 0; s < VT_NSTATES; s++) on(s, 0x00, 0xff, VA_NONE);
+
+    c0(VT_GROUND, VA_EXECUTE);
+    on(VT_GROUND, 0x20, 0x7f, VA_PRINT);   // DEL too, as term_write's fast path does
+    on(VT_GROUND, 0x80, 0xff, VA_UTF8);
+
+    entry_action[VT_ESCAPE] = VA_CLEAR;
+    c0(VT_ESCAPE, VA_EXECUTE);
+    go(VT_ESCAPE, 0x20, 0x2f, VA_COLLECT, VT_ESCAPE_INTERMEDIATE);
+    go(VT_ESCAPE, 0x30, 0x7e, VA_ESC_DISPATCH, VT_GROUND);
+    go(VT_ESCAPE, 'P', 'P', VA_NONE, VT_DCS_ENTRY);
+    go(VT_ESCAPE, 'X', 'X', VA_NONE, VT_SOS_PM_APC_STRING);
+    go(VT_ESCAPE, '[', '[', VA_NONE, VT_CSI_ENTRY);
+    go(VT_ESCAPE, ']', ']', VA_NONE, VT_OSC_STRING);
+    go(VT_ESCAPE, '^', '^', VA_NONE, VT_SOS_PM_APC_STRING);
+    go(VT_ESCAPE, '_', '_', VA_NONE, VT_APC_STRING);
+
+    c0(VT_ESCAPE_INTERMEDIATE, VA_EXECUTE);
+    on(VT_ESCAPE_INTERMEDIATE, 0x20, 0x2f, VA_COLLECT);
+    go(VT_ESCAPE_INTERMEDIATE, 0x30, 0x7e, VA_ESC_DISPATCH, VT_GROUND);
+
+    entry_action[VT_CSI_ENTRY] = VA_CLEAR;
+    c0(VT_CSI_ENTRY, VA_EXECUTE);
+    go(VT_CSI_ENTRY, 0x20, 0x2f, VA_COLLECT, VT_CSI_INTERMEDIATE);
+    go(VT_CSI_ENTRY, 0x30, 0x3b, VA_PARAM, VT_CSI_PARAM);
+    go(VT_CSI_ENTRY, 0x3c, 0x3f, VA_COLLECT, VT_CSI_PARAM);
+    go(VT_CSI_ENTRY, 0x40, 0x7e, VA_CSI_DISPATCH, VT_GROUND);
+
+    c0(VT_CSI_PARAM, VA_EXECUTE);
+    on(VT_CSI_PARAM, 0x30, 0x3b, VA_PARAM);
+    go(VT_CSI_PARAM, 0x3c, 0x3f, VA_NONE, VT_CSI_IGNORE);
+    go(VT_CSI_PARAM, 0x20, 0x2f, VA_COLLECT, VT_CSI_INTERMEDIATE);
+    go(VT_CSI_PARAM, 0x40, 0x7e, VA_CSI_DISPATCH, VT_GROUND);
+
+    c0(VT_CSI_INTERMEDIATE, VA_EXECUTE);
+    on(VT_CSI_INTERMEDIATE, 0x20, 0x2f, VA_COLLECT);
+    go(VT_CSI_INTERMEDIATE, 0x30, 0x3f, VA_NONE, VT_CSI_IGNORE);
+    go(VT_CSI_INTERMEDIATE, 0x40, 0x7e, VA_CSI_DISPATCH, VT_GROUND);
+
+    c0(VT_CSI_IGNORE, VA_EXECUTE);
+    go(VT_CSI_IGNORE, 0x40, 0x7e, VA_NONE, VT_GROUND);
+
+    entry_action[VT_DCS_ENTRY] = VA_CLEAR;
+    go(VT_DCS_ENTRY, 0x20, 0x2f, VA_COLLECT, VT_DCS_INTERMEDIATE);
+    go(VT_DCS_ENTRY, 0x30, 0x3b, VA_PARAM, VT_DCS_PARAM);
+    go(VT_DCS_ENTRY, 0x3c, 0x3f, VA_COLLECT, VT_DCS_PARAM);
+    go(VT_DCS_ENTRY, 0x40, 0x7e, VA_NONE, VT_DCS_PASSTHROUGH);
+
+    on(VT_DCS_PARAM, 0x30, 0x3b, VA_PARAM);
+    go(VT_DCS_PARAM, 0x3c, 0x3f, VA_NONE, VT_DCS_IGNORE);
+    go(VT_DCS_PARAM, 0x20, 0x2f, VA_COLLECT, VT_DCS_INTERMEDIATE);
+    go(VT_DCS_PARAM, 0x40, 0x7e, VA_NONE, VT_DCS_PASSTHROUGH);
+
+    on(VT_DCS_INTERMEDIATE, 0x20, 0x2f, VA_COLLECT);
+    go(VT_DCS_INTERMEDIATE, 0x30, 0x3f, VA_NONE, VT_DCS_IGNORE);
+    go(VT_DCS_INTERMEDIATE, 0x40, 0x7e, VA_NONE, VT_DCS_PASSTHROUGH);
+
+    entry_action[VT_DCS_PASSTHROUGH] = VA_HOOK;
+    exit_action[VT_DCS_PASSTHROUGH] = VA_UNHOOK;
+    c0(VT_DCS_PASSTHROUGH, VA_PUT);
+    on(VT_DCS_PASSTHROUGH, 0x20, 0x7e, VA_PUT);
+    on(VT_DCS_PASSTHROUGH, 0x80, 0xff, VA_PUT);
+
+    // BEL ends an OSC string as well as ST (ESC \); the exit action
+    // dispatches on either.
+    entry_action[VT_OSC_STRING] = VA_OSC_START;
+    exit_action[VT_OSC_STRING] = VA_OSC_END;
+    go(VT_OSC_STRING, 0x07, 0x07, VA_NONE, VT_GROUND);
+    on(VT_OSC_STRING, 0x20, 0xff, VA_OSC_PUT);
+
+    // APC ends only with ST; a CAN or SUB in the middle runs the exit
+    // action too, which drops what came so far.
+    entry_action[VT_APC_STRING] = VA_APC_START;
+    exit_action[VT_APC_STRING] = VA_APC_END;
+    on(VT_APC_STRING, 0x20, 0xff, VA_APC_PUT);
+
+    // Anywhere: CAN and SUB cancel, ESC starts over.
+    for (int s = 0; s < VT_NSTATES; s++) {
+        go(s, 0x18, 0x18, VA_EXECUTE, VT_GROUND);
+        go(s, 0x1a, 0x1a, VA_EXECUTE, VT_GROUND);
+        go(s, 0x1b, 0x1b, VA_NONE, VT_ESCAPE);
+    }
+
+    printf("// parser_table.h - Generated by mkparser.c at build time; do not edit.\n\n");
+    printf("static const unsigned char vt_entry_action[%d] = {", VT_NSTATES);
+    for (int s = 0; s < VT_NSTATES; s++) printf("%d,", entry_action[s]);
+    printf("};\n\nstatic const unsigned char vt_exit_action[%d] = {", VT_NSTATES);
+    for (int s = 0; s < VT_NSTATES; s++) printf("%d,", exit_action[s]);
+    printf("};\n\nstatic const unsigned short vt_table[%d][256] = {\n", VT_NSTATES);
+    for (int s = 0; s < VT_NSTATES; s++) {
+        printf("    {");
+        for (int c = 0; c < 256; c++) printf("%s%d,", (c % 16) ? "" : "\n        ", table[s][c]);
+        printf("\n    },\n");
+    }
+    printf("};\n");
+    return 0;
+}
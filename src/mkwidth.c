@@ -0,0 +1,54 @@
+// mkwidth.c - Generates width.h, the codepoint width table used by term.c.
+//
+// Run by the Makefile at build time. Widths come from the C library's
+// wcwidth() under a UTF-8 locale and are packed two bits per codepoint
+// into a two-stage table: stage 1 maps each 256-codepoint block to one of
+// the distinct blocks in stage 2.
+
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <string.h>
+#include <locale.h>
+#include <wchar.h>
+
+#define NBLOCKS (0x110000 / 256)
+
+static unsigned char blocks[NBLOCKS][64];
+static int stage1[NBLOCKS];
+
+int main(void) {
+    if (!setlocale(LC_CTYPE, "C.UTF-8") && !setlocale(LC_CTYPE, "en_US.UTF-8")) {
+        fprintf(stderr, "mkwidth: no UTF-8 locale available\n");
+        return 1;
+    }
+    int nblocks = 0;
+    for (int b = 0; b < NBLOCKS; b++) {
+        unsigned char blk[64] = {0};
+        for (int i = 0; i < 256; i++) {
+            int w = wcwidth((wchar_t)(b * 256 + i));
+            if (w < 0) w = 1;   // Unassigned and non-printable: one cell
+            if (w > 2) w = 2;
+            blk[i >> 2] |= w << ((i & 3) * 2);
+        }
+        int j = 0;
+        while (j < nblocks && memcmp(blocks[j], blk, sizeof(blk)) != 0) j++;
+        if (j == nblocks) memcpy(blocks[nblocks++], blk, sizeof(blk));
+        stage1[b] = j;
+    }
+    if (nblocks > 256) {
+        fprintf(stderr, "mkwidth: %d distinct blocks don't fit an 8-bit index\n", nblocks);
+        return 1;
+    }
+
+    printf("// width.h - Generated by mkwidth.c at build time; do not edit.\n\n");
+    printf("static const unsigned char width_stage1[%d] = {", NBLOCKS);
+    for (int b = 0; b < NBLOCKS; b++) printf("%s%d,", (b % 24) ? "" : "\n    ", stage1[b]);
+    printf("\n};\n\nstatic const unsigned char width_stage2[%d][64] = {\n", nblocks);
+    for (int j = 0; j < nblocks; j++) {
+        printf("    {");
+        for (int i = 0; i < 64; i++) printf("%d,", blocks[j][i]);
+        printf("},\n");
+    }
+    printf("};\n");
+    return 0;
+}
@@ -0,0 +1,616 @@
+// render_gl33.c - OpenGL 3.3 core renderer.
+//
+// The grid lives on the GPU as an integer texture with one texel per cell
+// (glyph cache slot, style id, wide flags). Damaged rows are re-uploaded
+// with glTexSubImage2D and drawn with a full-screen triangle: the fragment
+// shader finds its cell, looks up its style's colors, already resolved on
+// the CPU once per style, samples the glyph from the atlas and adds
+// underline, strikethrough and the cursor.
+//
+// Frames are drawn into one of two framebuffer objects and blitted to the
+// window, so a frame only shades the rows that changed, scissored, on top
+// of the last one. A scroll is a blit from one FBO to the other shifted by
+// whole rows, after which only the rows it uncovered are drawn.
+//
+// Inline images are textured quads drawn over the grid, with the same
+// scissors, by a second program; their textures come from images.c.
+//
+// The programs, the glyph atlas and table and the image textures are
+// shared by every window's context; uniforms are program state, so the
+// per-window ones are set again at each draw. The cell, style and frame
+// textures, the framebuffers and the VAO are the window's own.
+
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <GL/gl.h>
+#include <GL/glext.h>
+#include <GL/glx.h>
+
+#include "xst.h"
+
+// Entry points beyond GL 1.1 are loaded at runtime through
+// glXGetProcAddress; the macros below let the code call them by their
+// usual names.
+#define GL33_FUNCS(X) \
+    X(PFNGLACTIVETEXTUREPROC, glActiveTexture) \
+    X(PFNGLCREATESHADERPROC, glCreateShader) \
+    X(PFNGLSHADERSOURCEPROC, glShaderSource) \
+    X(PFNGLCOMPILESHADERPROC, glCompileShader) \
+    X(PFNGLGETSHADERIVPROC, glGetShaderiv) \
+    X(PFNGLGETSHADERINFOLOGPROC, glGetShaderInfoLog) \
+    X(PFNGLDELETESHADERPROC, glDeleteShader) \
+    X(PFNGLCREATEPROGRAMPROC, glCreateProgram) \
+    X(PFNGLATTACHSHADERPROC, glAttachShader) \
+    X(PFNGLLINKPROGRAMPROC, glLinkProgram) \
+    X(PFNGLGETPROGRAMIVPROC, glGetProgramiv) \
+    X(PFNGLGETPROGRAMINFOLOGPROC, glGetProgramInfoLog) \
+    X(PFNGLDELETEPROGRAMPROC, glDeleteProgram) \
+    X(PFNGLUSEPROGRAMPROC, glUseProgram) \
+    X(PFNGLGETUNIFORMLOCATIONPROC, glGetUniformLocation) \
+    X(PFNGLUNIFORM1IPROC, glUniform1i) \
+    X(PFNGLUNIFORM1FPROC, glUniform1f) \
+    X(PFNGLUNIFORM2FPROC, glUniform2f) \
+    X(PFNGLUNIFORM2IPROC, glUniform2i) \
+    X(PFNGLUNIFORM3FVPROC, glUniform3fv) \
+    X(PFNGLUNIFORM4FPROC, glUniform4f) \
+    X(PFNGLGENVERTEXARRAYSPROC, glGenVertexArrays) \
+    X(PFNGLBINDVERTEXARRAYPROC, glBindVertexArray) \
+    X(PFNGLDELETEVERTEXARRAYSPROC, glDeleteVertexArrays) \
+    X(PFNGLGENFRAMEBUFFERSPROC, glGenFramebuffers) \
+    X(PFNGLBINDFRAMEBUFFERPROC, glBindFramebuffer) \
+    X(PFNGLFRAMEBUFFERTEXTURE2DPROC, glFramebufferTexture2D) \
+    X(PFNGLCHECKFRAMEBUFFERSTATUSPROC, glCheckFramebufferStatus) \
+    X(PFNGLBLITFRAMEBUFFERPROC, glBlitFramebuffer) \
+    X(PFNGLDELETEFRAMEBUFFERSPROC, glDeleteFramebuffers)
+
+#define GL33_DECLARE(type, name) static type p_##name;
+GL33_FUNCS(GL33_DECLARE)
+#undef GL33_DECLARE
+
+#define glActiveTexture p_glActiveTexture
+#define glCreateShader p_glCreateShader
+#define glShaderSource p_glShaderSource
+#define glCompileShader p_glCompileShader
+#define glGetShaderiv p_glGetShaderiv
+#define glGetShaderInfoLog p_glGetShaderInfoLog
+#define glDeleteShader p_glDeleteShader
+#define glCreateProgram p_glCreateProgram
+#define glAttachShader p_glAttachShader
+#define glLinkProgram p_glLinkProgram
+#define glGetProgramiv p_glGetProgramiv
+#define glGetProgramInfoLog p_glGetProgramInfoLog
+#define glDeleteProgram p_glDeleteProgram
+#define glUseProgram p_glUseProgram
+#define glGetUniformLocation p_glGetUniformLocation
+#define glUniform1i p_glUniform1i
+#define glUniform1f p_glUniform1f
+#define glUniform2f p_glUniform2f
+#define glUniform2i p_glUniform2i
+#define glUniform3fv p_glUniform3fv
+#define glUniform4f p_glUniform4f
+#define glGenVertexArrays p_glGenVertexArrays
+#define glBindVertexArray p_glBindVertexArray
+#define glDeleteVertexArrays p_glDeleteVertexArrays
+#define glGenFramebuffers p_glGenFramebuffers
+#define glBindFramebuffer p_glBindFramebuffer
+#define glFramebufferTexture2D p_glFramebufferTexture2D
+#define glCheckFramebufferStatus p_glCheckFramebufferStatus
+#define glBlitFramebuffer p_glBlitFramebuffer
+#define glDeleteFramebuffers p_glDeleteFramebuffers
+
+// Texture units
+enum { UNIT_CELLS, UNIT_GLYPHS, UNIT_ATLAS, UNIT_STYLES, UNIT_FRAME, UNIT_IMAGE };
+
+static const char *vertex_src =
+    "#version 330 core\n"
+    "void main() {\n"
+    "    // One triangle that covers the whole viewport.\n"
+    "    vec2 p = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);\n"
+    "    gl_Position = vec4(p * 2.0 - 1.0, 0.0, 1.0);\n"
+    "}\n";
+
+static const char *fragment_src =
+    "#version 330 core\n"
+    "uniform usampler2D cells;   // x: glyph slot, y: style, z: cell attr\n"
+    "uniform isampler2D glyphs;  // 64 slots per row pair; even row: atlas x, y, w, h;\n"
+    "                            // odd row: left, top\n"
+    "uniform sampler2D atlas;    // glyph coverage in .r\n"
+    "uniform usampler2D styles;  // 256 per row; x: fg 0xRRGGBB, y: bg, z: attr\n"
+    "uniform vec2 cell_size;\n"
+    "uniform ivec2 grid_size;\n"
+    "uniform ivec2 cursor;\n"
+    "uniform float view_h;\n"
+    "uniform vec3 search_colors[3]; // text, match and selected match background\n"
+    "uniform vec3 overlay_colors[2]; // stats overlay text and background\n"
+    "out vec4 frag;\n"
+    "const uint UNDERLINE = 8u, INVISIBLE = 64u, STRUCK = 128u;\n"
+    "const uint WIDE = 256u, WDUMMY = 512u, MATCH = 2048u, MATCH_CUR = 4096u;\n"
+    "const uint OVERLAY = 8192u;\n"
+    "vec3 rgb(uint c) { return vec3(uvec3(c >> 16, c >> 8, c) & 255u) / 255.0; }\n"
+    "void main() {\n"
+    "    vec2 px = vec2(gl_FragCoord.x, view_h - gl_FragCoord.y);\n"
+    "    ivec2 cp = ivec2(floor(px / cell_size));\n"
+    "    if (cp.x >= grid_size.x || cp.y >= grid_size.y) {\n"
+    "        frag = vec4(rgb(texelFetch(styles, ivec2(0), 0).y), 1.0);\n"
+    "        return;\n"
+    "    }\n"
+    "    uvec4 c = texelFetch(cells, cp, 0);\n"
+    "    vec2 local = px - vec2(cp) * cell_size;\n"
+    "    // The right half of a wide character draws the rest of its glyph.\n"
+    "    if ((c.z & WDUMMY) != 0u && cp.x > 0) {\n"
+    "        uvec4 lead = texelFetch(cells, cp - ivec2(1, 0), 0);\n"
+    "        if ((lead.z & WIDE) != 0u) { c = lead; local.x += cell_size.x; }\n"
+    "    }\n"
+    "    uvec4 st = texelFetch(styles, ivec2(int(c.y) & 255, int(c.y) >> 8), 0);\n"
+    "    uint attr = st.z;\n"
+    "    vec3 fg = rgb(st.x);\n"
+    "    vec3 bg = rgb(st.y);\n"
+    "    if ((c.z & MATCH) != 0u) {\n"
+    "        fg = search_colors[0];\n"
+    "        bg = search_colors[(c.z & MATCH_CUR) != 0u ? 2 : 1];\n"
+    "    }\n"
+    "    if ((c.z & OVERLAY) != 0u) {\n"
+    "        fg = overlay_colors[0];\n"
+    "        bg = overlay_colors[1];\n"
+    "        attr = 0u;\n"
+    "    }\n"
+    "    float a = 0.0;\n"
+    "    if (c.x != 0u && (attr & INVISIBLE) == 0u) {\n"
+    "        ivec2 gt = ivec2(int(c.x) & 63, (int(c.x) >> 6) * 2);\n"
+    "        ivec4 box = texelFetch(glyphs, gt, 0);\n"
+    "        ivec4 bearing = texelFetch(glyphs, gt + ivec2(0, 1), 0);\n"
+    "        vec2 g = local - vec2(bearing.xy);\n"
+    "        if (all(greaterThanEqual(g, vec2(0.0))) && all(lessThan(g, vec2(box.zw))))\n"
+    "            a = texelFetch(atlas, box.xy + ivec2(g), 0).r;\n"
+    "    }\n"
+    "    float ly = floor(local.y);\n"
+    "    if ((attr & UNDERLINE) != 0u && ly == cell_size.y - 2.0) a = 1.0;\n"
+    "    if ((attr & STRUCK) != 0u && ly == floor(cell_size.y / 2.0)) a = 1.0;\n"
+    "    vec3 col = mix(bg, fg, a);\n"
+    "    if (cp == cursor) col = 1.0 - col;\n"
+    "    frag = vec4(col, 1.0);\n"
+    "}\n";
+
+static const char *image_vertex_src =
+    "#version 330 core\n"
+    "uniform vec4 rect;          // x, y, w, h in pixels from the top left\n"
+    "uniform vec4 src;           // Texture coordinates of the top left and bottom right\n"
+    "uniform vec2 view;\n"
+    "out vec2 uv;\n"
+    "void main() {\n"
+    "    // A triangle strip over the four corners\n"
+    "    vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);\n"
+    "    uv = mix(src.xy, src.zw, corner);\n"
+    "    vec2 p = (rect.xy + corner * rect.zw) / view;\n"
+    "    gl_Position = vec4(p.x * 2.0 - 1.0, 1.0 - p.y * 2.0, 0.0, 1.0);\n"
+    "}\n";
+
+static const char *image_fragment_src =
+    "#version 330 core\n"
+    "uniform sampler2D image;\n"
+    "in vec2 uv;\n"
+    "out vec4 frag;\n"
+    "void main() {\n"
+    "    frag = texture(image, uv);\n"
+    "}\n";
+
+static GLuint program, image_program;
+static GLint u_rect, u_src, u_view;
+static GLuint glyph_tex, atlas_tex;
+static GLint u_cell_size, u_grid_size, u_cursor, u_view_h;
+static int users;                       // Windows sharing the above
+static ImageCache image_cache;
+
+// The glyph table holds GLYPH_TABLE_W slots per pair of texel rows.
+#define GLYPH_TABLE_W 64
+static GLshort glyph_staging[GLYPH_SLOTS / GLYPH_TABLE_W][2][GLYPH_TABLE_W][4];
+
+// Resolved styles, STYLE_TEX_W per texel row.
+#define STYLE_TEX_W 256
+
+typedef struct {
+    GLuint vao, cell_tex, style_tex;
+    unsigned short *grid_staging;       // The cell texture's contents
+    int grid_rows, grid_cols;
+    // The two frames; `frame` holds what is on screen once frame_ok is
+    // set. Rows redrawn on the next draw are flagged in row_damage.
+    GLuint fbos[2], frame_tex[2];
+    int frame, frame_ok, view_w, view_h;
+    unsigned char *row_damage;
+    int drawn_cursor_y;
+    // The staging copy mirrors the style texture so that only rows whose
+    // styles changed are uploaded.
+    GLuint (*style_staging)[4];
+    int style_rows;
+    const GfxView *images;
+    int nimages;
+} Gl33;
+
+static int load_functions() {
+    int ok = 1;
+#define GL33_LOAD(type, name) \
+    p_##name = (type)glXGetProcAddress((const GLubyte *)#name); \
+    if (!p_##name) ok = 0;
+    GL33_FUNCS(GL33_LOAD)
+#undef GL33_LOAD
+    return ok;
+}
+
+static GLuint compile(GLenum type, const char *src) {
+    GLuint s = glCreateShader(type);
+    glShaderSource(s, 1, &src, NULL);
+    glCompileShader(s);
+    GLint ok;
+    glGetShaderiv(s, GL_COMPILE_STATUS, &ok);
+    if (!ok) {
+        char log[1024];
+        glGetShaderInfoLog(s, sizeof(log), NULL, log);
+        fprintf(stderr, "xst: shader compile failed: %s\n", log);
+        glDeleteShader(s);
+        return 0;
+    }
+    return s;
+}
+
+static GLuint new_texture(GLenum unit, GLint filter) {
+    GLuint tex;
+    glGenTextures(1, &tex);
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    return tex;
+}
+
+static GLuint link(const char *vertex, const char *fragment) {
+    GLuint vs = compile(GL_VERTEX_SHADER, vertex);
+    GLuint fs = compile(GL_FRAGMENT_SHADER, fragment);
+    if (!vs || !fs) return 0;
+    GLuint p = glCreateProgram();
+    glAttachShader(p, vs);
+    glAttachShader(p, fs);
+    glLinkProgram(p);
+    glDeleteShader(vs);
+    glDeleteShader(fs);
+    GLint ok;
+    glGetProgramiv(p, GL_LINK_STATUS, &ok);
+    if (!ok) {
+        char log[1024];
+        glGetProgramInfoLog(p, sizeof(log), NULL, log);
+        fprintf(stderr, "xst: shader link failed: %s\n", log);
+        glDeleteProgram(p);
+        return 0;
+    }
+    return p;
+}
+
+// The programs and the glyph textures, made with the first window.
+static int shared_init() {
+    if (!load_functions()) return 0;
+
+    program = link(vertex_src, fragment_src);
+    image_program = link(image_vertex_src, image_fragment_src);
+    if (!program || !image_program) {
+        if (program) glDeleteProgram(program);
+        if (image_program) glDeleteProgram(image_program);
+        program = image_program = 0;
+        return 0;
+    }
+
+    glUseProgram(image_program);
+    glUniform1i(glGetUniformLocation(image_program, "image"), UNIT_IMAGE);
+    u_rect = glGetUniformLocation(image_program, "rect");
+    u_src = glGetUniformLocation(image_program, "src");
+    u_view = glGetUniformLocation(image_program, "view");
+
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "cells"), UNIT_CELLS);
+    glUniform1i(glGetUniformLocation(program, "glyphs"), UNIT_GLYPHS);
+    glUniform1i(glGetUniformLocation(program, "atlas"), UNIT_ATLAS);
+    glUniform1i(glGetUniformLocation(program, "styles"), UNIT_STYLES);
+    u_cell_size = glGetUniformLocation(program, "cell_size");
+    u_grid_size = glGetUniformLocation(program, "grid_size");
+    u_cursor = glGetUniformLocation(program, "cursor");
+    u_view_h = glGetUniformLocation(program, "view_h");
+    glUniform3fv(glGetUniformLocation(program, "search_colors"), 3, &search_colors[0].r);
+    glUniform3fv(glGetUniformLocation(program, "overlay_colors"), 2, &overlay_colors[0].r);
+
+    glyph_tex = new_texture(UNIT_GLYPHS, GL_NEAREST);
+    atlas_tex = new_texture(UNIT_ATLAS, GL_NEAREST);
+    glActiveTexture(GL_TEXTURE0 + UNIT_GLYPHS);
+    glBindTexture(GL_TEXTURE_2D, glyph_tex);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16I, GLYPH_TABLE_W, GLYPH_SLOTS / GLYPH_TABLE_W * 2, 0,
+                 GL_RGBA_INTEGER, GL_SHORT, NULL);
+    return 1;
+}
+
+static void *gl33_init(Window w) {
+    (void)w;
+    if (!users && !shared_init()) return NULL;
+    users++;
+    Gl33 *g = calloc(1, sizeof(*g));
+    if (!g) die("malloc failed for renderer");
+    g->drawn_cursor_y = -1;
+
+    // Texture bindings are the context's own, the textures aren't.
+    glUseProgram(program);
+    glActiveTexture(GL_TEXTURE0 + UNIT_GLYPHS);
+    glBindTexture(GL_TEXTURE_2D, glyph_tex);
+    glActiveTexture(GL_TEXTURE0 + UNIT_ATLAS);
+    glBindTexture(GL_TEXTURE_2D, atlas_tex);
+
+    // Core profile needs a bound VAO even though the triangle has no
+    // attributes.
+    glGenVertexArrays(1, &g->vao);
+    glBindVertexArray(g->vao);
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    g->cell_tex = new_texture(UNIT_CELLS, GL_NEAREST);
+    g->style_tex = new_texture(UNIT_STYLES, GL_NEAREST);
+
+    glDisable(GL_BLEND);
+    return g;
+}
+
+static void gl33_sync_atlas(const AtlasDamage *d) {
+    glActiveTexture(GL_TEXTURE0 + UNIT_ATLAS);
+    glBindTexture(GL_TEXTURE_2D, atlas_tex);
+    if (d->resized) {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, font_atlas_w, font_atlas_h, 0, GL_RED, GL_UNSIGNED_BYTE, font_atlas);
+    } else if (d->y1 > d->y0) {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, d->y0, font_atlas_w, d->y1 - d->y0, GL_RED, GL_UNSIGNED_BYTE,
+                        font_atlas + (size_t)d->y0 * font_atlas_w);
+    }
+
+    // Glyph boxes and bearings for the slots that changed, a whole row
+    // pair (GLYPH_TABLE_W slots) at a time.
+    if (d->slot1 <= d->slot0) return;
+    int r0 = d->slot0 / GLYPH_TABLE_W, r1 = (d->slot1 - 1) / GLYPH_TABLE_W + 1;
+    GLshort (*rows)[2][GLYPH_TABLE_W][4] = glyph_staging;
+    for (int r = r0; r < r1; r++) {
+        for (int i = 0; i < GLYPH_TABLE_W; i++) {
+            const Glyph *g = &glyphs[r * GLYPH_TABLE_W + i];
+            GLshort *box = rows[r - r0][0][i], *bearing = rows[r - r0][1][i];
+            box[0] = g->ox; box[1] = g->oy; box[2] = g->bw; box[3] = g->bh;
+            bearing[0] = g->bl; bearing[1] = char_h - g->bt; bearing[2] = bearing[3] = 0;
+        }
+    }
+    glActiveTexture(GL_TEXTURE0 + UNIT_GLYPHS);
+    glBindTexture(GL_TEXTURE_2D, glyph_tex);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, r0 * 2, GLYPH_TABLE_W, (r1 - r0) * 2, GL_RGBA_INTEGER, GL_SHORT, glyph_staging);
+}
+
+static GLuint pack_color(const Color *c) {
+    return (GLuint)(c->r * 255.0f + 0.5f) << 16 | (GLuint)(c->g * 255.0f + 0.5f) << 8 | (GLuint)(c->b * 255.0f + 0.5f);
+}
+
+static void gl33_sync_styles(void *r, const Style *s, int n) {
+    Gl33 *g = r;
+    int rows = (n + STYLE_TEX_W - 1) / STYLE_TEX_W, grown = 0;
+    glActiveTexture(GL_TEXTURE0 + UNIT_STYLES);
+    glBindTexture(GL_TEXTURE_2D, g->style_tex);
+    if (rows > g->style_rows) {
+        free(g->style_staging);
+        g->style_staging = calloc((size_t)rows * STYLE_TEX_W, sizeof(*g->style_staging));
+        if (!g->style_staging) die("malloc failed for style staging");
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32UI, STYLE_TEX_W, rows, 0, GL_RGBA_INTEGER, GL_UNSIGNED_INT, NULL);
+        g->style_rows = rows;
+        grown = 1;
+    }
+    for (int y = 0; y < rows; y++) {
+        int changed = grown;
+        for (int i = y * STYLE_TEX_W; i < (y + 1) * STYLE_TEX_W && i < n; i++) {
+            Color fg, bg;
+            style_colors(&s[i], &fg, &bg);
+            GLuint texel[4] = { pack_color(&fg), pack_color(&bg), s[i].attr, 0 };
+            if (memcmp(g->style_staging[i], texel, sizeof(texel)) == 0) continue;
+            memcpy(g->style_staging[i], texel, sizeof(texel));
+            changed = 1;
+        }
+        if (changed)
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y, STYLE_TEX_W, 1, GL_RGBA_INTEGER, GL_UNSIGNED_INT,
+                            g->style_staging[y * STYLE_TEX_W]);
+    }
+}
+
+static void gl33_viewport(void *r, int w, int h) {
+    Gl33 *g = r;
+    glViewport(0, 0, w, h);
+    g->view_w = w; g->view_h = h;
+    if (!g->fbos[0]) {
+        glGenFramebuffers(2, g->fbos);
+        for (int i = 0; i < 2; i++) g->frame_tex[i] = new_texture(UNIT_FRAME, GL_NEAREST);
+    }
+    for (int i = 0; i < 2; i++) {
+        glActiveTexture(GL_TEXTURE0 + UNIT_FRAME);
+        glBindTexture(GL_TEXTURE_2D, g->frame_tex[i]);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        glBindFramebuffer(GL_FRAMEBUFFER, g->fbos[i]);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, g->frame_tex[i], 0);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) die("Could not set up framebuffer");
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    g->frame_ok = 0;
+}
+
+static void gl33_grid_resize(void *r, int rows, int cols) {
+    Gl33 *g = r;
+    free(g->grid_staging);
+    free(g->row_damage);
+    g->grid_staging = malloc((size_t)rows * cols * 4 * sizeof(*g->grid_staging));
+    g->row_damage = malloc(rows);
+    if (!g->grid_staging || !g->row_damage) die("malloc failed for cell staging");
+    memset(g->row_damage, 1, rows);
+    g->grid_rows = rows; g->grid_cols = cols;
+    g->frame_ok = 0;
+
+    glActiveTexture(GL_TEXTURE0 + UNIT_CELLS);
+    glBindTexture(GL_TEXTURE_2D, g->cell_tex);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16UI, cols, rows, 0, GL_RGBA_INTEGER, GL_UNSIGNED_SHORT, NULL);
+}
+
+static void gl33_update_row(void *r, int y, const Cell *line) {
+    Gl33 *g = r;
+    unsigned short *row = g->grid_staging + (size_t)y * g->grid_cols * 4, *p = row;
+    for (int x = 0; x < g->grid_cols; x++, p += 4) {
+        p[0] = (g->style_staging[line[x].style][2] & ATTR_INVISIBLE) ? 0 : glyph_lookup(line[x].c);
+        p[1] = line[x].style;
+        p[2] = line[x].attr;
+        p[3] = 0;
+    }
+    glActiveTexture(GL_TEXTURE0 + UNIT_CELLS);
+    glBindTexture(GL_TEXTURE_2D, g->cell_tex);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y, g->grid_cols, 1, GL_RGBA_INTEGER, GL_UNSIGNED_SHORT, row);
+    g->row_damage[y] = 1;
+}
+
+// Framebuffer y, counted bottom up, of the top edge of grid row y
+static int row_fb_y(const Gl33 *g, int y) {
+    return g->view_h - y * (int)char_h;
+}
+
+static void gl33_scroll(void *r, int top, int bot, int n) {
+    Gl33 *g = r;
+    int h = bot - top + 1, keep = h - (n > 0 ? n : -n);
+    int dst = n > 0 ? top : top - n, src = n > 0 ? top + n : top;
+    size_t row = (size_t)g->grid_cols * 4;
+    memmove(g->grid_staging + dst * row, g->grid_staging + src * row, keep * row * sizeof(*g->grid_staging));
+    memmove(g->row_damage + dst, g->row_damage + src, keep);
+    // The cursor moves with its row, so that draw clears it there.
+    if (g->drawn_cursor_y >= top && g->drawn_cursor_y <= bot) {
+        g->drawn_cursor_y -= n;
+        if (g->drawn_cursor_y < top || g->drawn_cursor_y > bot) g->drawn_cursor_y = -1;
+    }
+    glActiveTexture(GL_TEXTURE0 + UNIT_CELLS);
+    glBindTexture(GL_TEXTURE_2D, g->cell_tex);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, dst, g->grid_cols, keep, GL_RGBA_INTEGER, GL_UNSIGNED_SHORT,
+                    g->grid_staging + dst * row);
+    if (!g->frame_ok) return;
+    // Blits within one framebuffer mustn't overlap, so the frame moves to
+    // the other one: all of it, then the region shifted over itself.
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, g->fbos[g->frame]);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, g->fbos[!g->frame]);
+    glBlitFramebuffer(0, 0, g->view_w, g->view_h, 0, 0, g->view_w, g->view_h, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBlitFramebuffer(0, row_fb_y(g, src + keep), g->view_w, row_fb_y(g, src),
+                      0, row_fb_y(g, dst + keep), g->view_w, row_fb_y(g, dst), GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    g->frame = !g->frame;
+}
+
+static void gl33_images(void *r, const GfxView *v, int n) {
+    Gl33 *g = r;
+    g->images = v;
+    g->nimages = n;
+}
+
+// The images over rows y0..y1-1, with the image program in use.
+static void draw_images(const Gl33 *g, int y0, int y1) {
+    for (int i = 0; i < g->nimages; i++) {
+        const GfxView *v = &g->images[i];
+        if (v->y + v->rows <= y0 || v->y >= y1 || !image_texture(&image_cache, v)) continue;
+        float w = v->px->w, h = v->px->h;
+        glUniform4f(u_rect, v->x * char_w + v->off_x, v->y * char_h + v->off_y, v->dst_w, v->dst_h);
+        glUniform4f(u_src, v->src_x / w, v->src_y / h, (v->src_x + v->src_w) / w, (v->src_y + v->src_h) / h);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    }
+}
+
+static void gl33_draw(void *r, int cursor_x, int cursor_y) {
+    Gl33 *g = r;
+    glUseProgram(program);
+    glUniform2f(u_cell_size, char_w, char_h);
+    glUniform2i(u_grid_size, g->grid_cols, g->grid_rows);
+    glUniform1f(u_view_h, g->view_h);
+    glUniform2i(u_cursor, cursor_x, cursor_y);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, g->fbos[g->frame]);
+    image_frame(&image_cache);
+    if (!g->frame_ok) {
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        memset(g->row_damage, 1, g->grid_rows);
+    } else {
+        // The cursor's old and new rows, and runs of damaged rows
+        if (g->drawn_cursor_y >= 0 && g->drawn_cursor_y < g->grid_rows) g->row_damage[g->drawn_cursor_y] = 1;
+        if (cursor_y >= 0 && cursor_y < g->grid_rows) g->row_damage[cursor_y] = 1;
+    }
+    // The grid, then the images over the same runs. A full frame only
+    // needs its runs for the images.
+    glEnable(GL_SCISSOR_TEST);
+    for (int pass = g->frame_ok ? 0 : 1; pass < (g->nimages ? 2 : 1); pass++) {
+        if (pass) {
+            glUseProgram(image_program);
+            glUniform2f(u_view, g->view_w, g->view_h);
+            glActiveTexture(GL_TEXTURE0 + UNIT_IMAGE);
+            glEnable(GL_BLEND);
+            glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        }
+        for (int y = 0; y < g->grid_rows;) {
+            if (!g->row_damage[y]) { y++; continue; }
+            int y1 = y;
+            while (y1 < g->grid_rows && g->row_damage[y1]) y1++;
+            glScissor(0, row_fb_y(g, y1), g->view_w, row_fb_y(g, y) - row_fb_y(g, y1));
+            if (pass) draw_images(g, y, y1);
+            else glDrawArrays(GL_TRIANGLES, 0, 3);
+            y = y1;
+        }
+        if (pass) {
+            glDisable(GL_BLEND);
+            glUseProgram(program);
+        }
+    }
+    glDisable(GL_SCISSOR_TEST);
+    memset(g->row_damage, 0, g->grid_rows);
+    g->drawn_cursor_y = cursor_y;
+    g->frame_ok = 1;
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, g->fbos[g->frame]);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBlitFramebuffer(0, 0, g->view_w, g->view_h, 0, 0, g->view_w, g->view_h, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+}
+
+// The last window takes the shared objects with it.
+static void gl33_cleanup(void *r) {
+    Gl33 *g = r;
+    GLuint tex[] = { g->cell_tex, g->style_tex, g->frame_tex[0], g->frame_tex[1] };
+    glDeleteTextures(4, tex);
+    if (g->fbos[0]) glDeleteFramebuffers(2, g->fbos);
+    glDeleteVertexArrays(1, &g->vao);
+    free(g->grid_staging);
+    free(g->row_damage);
+    free(g->style_staging);
+    free(g);
+    if (--users) return;
+    GLuint shared[] = { glyph_tex, atlas_tex };
+    glDeleteTextures(2, shared);
+    glDeleteProgram(program);
+    glDeleteProgram(image_program);
+    program = image_program = 0;
+    image_textures_free(&image_cache);
+}
+
+// The frames count twice each, in the FBOs and in the window's own
+// front and back buffers.
+static void gl33_memory(void *r, size_t *cpu, size_t *gpu) {
+    const Gl33 *g = r;
+    size_t cells = (size_t)g->grid_rows * g->grid_cols * 4 * sizeof(*g->grid_staging);
+    size_t styles = (size_t)g->style_rows * STYLE_TEX_W * sizeof(*g->style_staging);
+    *cpu = sizeof(*g) + cells + g->grid_rows + styles;
+    *gpu = cells + styles + (size_t)g->view_w * g->view_h * 4 * 4;
+}
+
+const Renderer render_gl33 = {
+    .name = "gl33",
+    .init = gl33_init,
+    .sync_atlas = gl33_sync_atlas,
+    .sync_styles = gl33_sync_styles,
+    .viewport = gl33_viewport,
+    .grid_resize = gl33_grid_resize,
+    .update_row = gl33_update_row,
+    .scroll = gl33_scroll,
+    .images = gl33_images,
+    .draw = gl33_draw,
+    .cleanup = gl33_cleanup,
+    .memory = gl33_memory,
+};
@@ -0,0 +1,311 @@
+// render_legacy.c - Fixed-function OpenGL renderer.
+//
+// Fallback for drivers without GL 3.3: per-row vertex arrays drawn with
+// the GL 1.1 pipeline. Inline images are textured quads on top, with
+// textures from images.c. The glyph atlas texture and the image textures
+// are shared by every window's context; the geometry is the window's.
+
+#define _XOPEN_SOURCE 600
+#include <stdlib.h>
+
+#include <GL/gl.h>
+
+#include "xst.h"
+
+typedef struct {
+    float x, y, u, v;
+    float r, g, b;
+} Vertex;
+
+// Cached geometry for one screen row, rebuilt only when the row is damaged.
+// Each array has room for four vertices per column.
+typedef struct {
+    Vertex *bg, *glyph, *deco;
+    int nbg, nglyph, ndeco;
+} RowGeom;
+
+// Style table resolved to vertex colors, refreshed by sync_styles.
+typedef struct {
+    Color fg, bg;
+    unsigned short attr;
+    unsigned char has_bg;   // Background differs from the clear color
+} LegacyStyle;
+
+typedef struct {
+    LegacyStyle *styles;
+    int styles_cap;
+    RowGeom *row_geom;
+    int geom_rows, geom_cols;
+    int view_w, view_h;
+    const GfxView *images;
+    int nimages;
+} Legacy;
+
+static GLuint font_texture;
+static int users;                       // Windows sharing font_texture and image_cache
+static ImageCache image_cache;
+
+static void *legacy_init(Window w) {
+    (void)w;
+    if (!users++) {
+        glGenTextures(1, &font_texture);
+        glBindTexture(GL_TEXTURE_2D, font_texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    }
+    glEnable(GL_TEXTURE_2D);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    Legacy *l = calloc(1, sizeof(*l));
+    if (!l) die("malloc failed for renderer");
+    return l;
+}
+
+static void legacy_sync_atlas(const AtlasDamage *d) {
+    glBindTexture(GL_TEXTURE_2D, font_texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    if (d->resized) {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, font_atlas_w, font_atlas_h, 0, GL_ALPHA, GL_UNSIGNED_BYTE, font_atlas);
+    } else if (d->y1 > d->y0) {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, d->y0, font_atlas_w, d->y1 - d->y0, GL_ALPHA, GL_UNSIGNED_BYTE,
+                        font_atlas + (size_t)d->y0 * font_atlas_w);
+    }
+}
+
+static void legacy_sync_styles(void *r, const Style *s, int n) {
+    Legacy *l = r;
+    if (n > l->styles_cap) {
+        LegacyStyle *p = realloc(l->styles, n * sizeof(*p));
+        if (!p) die("malloc failed for styles");
+        l->styles = p;
+        l->styles_cap = n;
+    }
+    for (int i = 0; i < n; i++) {
+        l->styles[i].has_bg = style_colors(&s[i], &l->styles[i].fg, &l->styles[i].bg);
+        l->styles[i].attr = s[i].attr;
+    }
+}
+
+static void legacy_viewport(void *r, int w, int h) {
+    Legacy *l = r;
+    l->view_w = w; l->view_h = h;
+    glViewport(0, 0, w, h);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glOrtho(0.0, w, h, 0.0, -1.0, 1.0);
+    glMatrixMode(GL_MODELVIEW);
+}
+
+static void row_geom_free(Legacy *l) {
+    for (int y = 0; y < l->geom_rows; y++) {
+        free(l->row_geom[y].bg);
+        free(l->row_geom[y].glyph);
+        free(l->row_geom[y].deco);
+    }
+    free(l->row_geom);
+    l->row_geom = NULL;
+    l->geom_rows = 0;
+}
+
+static void legacy_grid_resize(void *r, int rows, int cols) {
+    Legacy *l = r;
+    row_geom_free(l);
+    l->row_geom = calloc(rows, sizeof(RowGeom));
+    if (!l->row_geom) die("malloc failed for row geometry");
+    for (int y = 0; y < rows; y++) {
+        l->row_geom[y].bg = malloc(cols * 4 * sizeof(Vertex));
+        l->row_geom[y].glyph = malloc(cols * 4 * sizeof(Vertex));
+        l->row_geom[y].deco = malloc(cols * 4 * sizeof(Vertex));
+        if (!l->row_geom[y].bg || !l->row_geom[y].glyph || !l->row_geom[y].deco)
+            die("malloc failed for row geometry");
+    }
+    l->geom_rows = rows; l->geom_cols = cols;
+}
+
+static void set_color(Vertex *v, const Color *c) {
+    v->r = c->r; v->g = c->g; v->b = c->b;
+}
+
+static void push_quad(Vertex *out, int *n, Vertex tmpl,
+                      float x0, float y0, float x1, float y1,
+                      float u0, float v0, float u1, float v1) {
+    Vertex *q = &out[*n];
+    q[0] = tmpl; q[0].x = x0; q[0].y = y0; q[0].u = u0; q[0].v = v0;
+    q[1] = tmpl; q[1].x = x1; q[1].y = y0; q[1].u = u1; q[1].v = v0;
+    q[2] = tmpl; q[2].x = x1; q[2].y = y1; q[2].u = u1; q[2].v = v1;
+    q[3] = tmpl; q[3].x = x0; q[3].y = y1; q[3].u = u0; q[3].v = v1;
+    *n += 4;
+}
+
+// Regenerates the background, glyph and decoration quads for screen row y.
+static void legacy_update_row(void *r, int y, const Cell *line) {
+    Legacy *l = r;
+    RowGeom *rg = &l->row_geom[y];
+    float y0 = y * char_h, y1 = (y + 1) * char_h;
+    rg->nbg = rg->nglyph = rg->ndeco = 0;
+    for (int x = 0; x < l->geom_cols; x++) {
+        const Cell *cell = &line[x];
+        const LegacyStyle *st = &l->styles[cell->style];
+        float x0 = x * char_w, x1 = (x + 1) * char_w;
+        Vertex v = {0};
+        const Color *fg = &st->fg, *bg = st->has_bg ? &st->bg : NULL;
+        if (cell->attr & ATTR_MATCH) {
+            fg = &search_colors[0];
+            bg = &search_colors[(cell->attr & ATTR_MATCH_CUR) ? 2 : 1];
+        }
+        if (cell->attr & ATTR_OVERLAY) {
+            fg = &overlay_colors[0];
+            bg = &overlay_colors[1];
+        }
+
+        // Cell background
+        if (bg) {
+            set_color(&v, bg);
+            push_quad(rg->bg, &rg->nbg, v, x0, y0, x1, y1, 0, 0, 0, 0);
+        }
+
+        // Glyph
+        const Glyph *g = &glyphs[(st->attr & ATTR_INVISIBLE) ? 0 : glyph_lookup(cell->c)];
+        if (g->bw > 0) {
+            float xpos = x0 + g->bl;
+            float ypos = y0 + (char_h - g->bt);
+            float u0 = (float)g->ox / font_atlas_w, v0 = (float)g->oy / font_atlas_h;
+            set_color(&v, fg);
+            push_quad(rg->glyph, &rg->nglyph, v, xpos, ypos, xpos + g->bw, ypos + g->bh,
+                      u0, v0, u0 + (float)g->bw / font_atlas_w, v0 + (float)g->bh / font_atlas_h);
+        }
+
+        // Underline and strikethrough
+        if (st->attr & (ATTR_UNDERLINE | ATTR_STRUCK)) {
+            set_color(&v, fg);
+            Vertex *d = rg->deco;
+            if (st->attr & ATTR_UNDERLINE) {
+                float ypos = y1 - 2; // -2 for better positioning
+                d[rg->ndeco] = v; d[rg->ndeco].x = x0; d[rg->ndeco++].y = ypos;
+                d[rg->ndeco] = v; d[rg->ndeco].x = x1; d[rg->ndeco++].y = ypos;
+            }
+            if (st->attr & ATTR_STRUCK) {
+                float ypos = y0 + char_h / 2.0f;
+                d[rg->ndeco] = v; d[rg->ndeco].x = x0; d[rg->ndeco++].y = ypos;
+                d[rg->ndeco] = v; d[rg->ndeco].x = x1; d[rg->ndeco++].y = ypos;
+            }
+        }
+    }
+}
+
+static void draw_vertices(GLenum mode, const Vertex *v, int n) {
+    if (n == 0) return;
+    glVertexPointer(2, GL_FLOAT, sizeof(Vertex), &v->x);
+    glTexCoordPointer(2, GL_FLOAT, sizeof(Vertex), &v->u);
+    glColorPointer(3, GL_FLOAT, sizeof(Vertex), &v->r);
+    glDrawArrays(mode, 0, n);
+}
+
+static void legacy_images(void *r, const GfxView *v, int n) {
+    Legacy *l = r;
+    l->images = v;
+    l->nimages = n;
+}
+
+static void draw_images(const Legacy *l) {
+    glEnable(GL_TEXTURE_2D);
+    glColor3f(1.0f, 1.0f, 1.0f);
+    for (int i = 0; i < l->nimages; i++) {
+        const GfxView *v = &l->images[i];
+        if (!image_texture(&image_cache, v)) continue;
+        float w = v->px->w, h = v->px->h;
+        float x0 = v->x * char_w + v->off_x, y0 = v->y * char_h + v->off_y;
+        float u0 = v->src_x / w, v0 = v->src_y / h, u1 = (v->src_x + v->src_w) / w, v1 = (v->src_y + v->src_h) / h;
+        glBegin(GL_QUADS);
+        glTexCoord2f(u0, v0); glVertex2f(x0, y0);
+        glTexCoord2f(u1, v0); glVertex2f(x0 + v->dst_w, y0);
+        glTexCoord2f(u1, v1); glVertex2f(x0 + v->dst_w, y0 + v->dst_h);
+        glTexCoord2f(u0, v1); glVertex2f(x0, y0 + v->dst_h);
+        glEnd();
+    }
+    glDisable(GL_TEXTURE_2D);
+}
+
+static void legacy_draw(void *r, int cursor_x, int cursor_y) {
+    const Legacy *l = r;
+    const RowGeom *row_geom = l->row_geom;
+    int geom_rows = l->geom_rows;
+    image_frame(&image_cache);
+    const Color *default_bg = &color_palette[DEFAULT_BG];
+    glClearColor(default_bg->r, default_bg->g, default_bg->b, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+
+    // --- Draw Cell Backgrounds ---
+    glDisable(GL_TEXTURE_2D);
+    for (int y = 0; y < geom_rows; y++) {
+        draw_vertices(GL_QUADS, row_geom[y].bg, row_geom[y].nbg);
+    }
+
+    // --- Draw Glyphs ---
+    glEnable(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, font_texture);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    for (int y = 0; y < geom_rows; y++) {
+        draw_vertices(GL_QUADS, row_geom[y].glyph, row_geom[y].nglyph);
+    }
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+
+    // --- Draw Underlines and Strikethroughs ---
+    glDisable(GL_TEXTURE_2D);
+    for (int y = 0; y < geom_rows; y++) {
+        draw_vertices(GL_LINES, row_geom[y].deco, row_geom[y].ndeco);
+    }
+
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+
+    // --- Draw Cursor ---
+    if (cursor_y >= 0) {
+        glBlendFunc(GL_ONE_MINUS_DST_COLOR, GL_ZERO); // Invert color
+        glColor3f(1.0f, 1.0f, 1.0f); // White will invert everything
+        glRectf(cursor_x * char_w, cursor_y * char_h, (cursor_x + 1) * char_w, (cursor_y + 1) * char_h);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA); // Restore blend func
+    }
+
+    // --- Draw Images ---
+    if (l->nimages) draw_images(l);
+}
+
+// The last window takes the shared textures with it.
+static void legacy_cleanup(void *r) {
+    Legacy *l = r;
+    row_geom_free(l);
+    free(l->styles);
+    free(l);
+    if (--users) return;
+    glDeleteTextures(1, &font_texture);
+    image_textures_free(&image_cache);
+}
+
+// The geometry is all on the CPU; only the window's front and back
+// buffers are on the GPU.
+static void legacy_memory(void *r, size_t *cpu, size_t *gpu) {
+    const Legacy *l = r;
+    *cpu = sizeof(*l) + l->styles_cap * sizeof(*l->styles) +
+           (size_t)l->geom_rows * (sizeof(RowGeom) + 3 * l->geom_cols * 4 * sizeof(Vertex));
+    *gpu = (size_t)l->view_w * l->view_h * 4 * 2;
+}
+
+const Renderer render_legacy = {
+    .name = "legacy",
+    .init = legacy_init,
+    .sync_atlas = legacy_sync_atlas,
+    .sync_styles = legacy_sync_styles,
+    .viewport = legacy_viewport,
+    .grid_resize = legacy_grid_resize,
+    .update_row = legacy_update_row,
+    .images = legacy_images,
+    .draw = legacy_draw,
+    .cleanup = legacy_cleanup,
+    .memory = legacy_memory,
+};
@@ -0,0 +1,473 @@
+// render_shm.c - Software renderer drawing into an X image.
+//
+// For machines where GL would only be a software rasterizer (VMs, remote
+// X): cells are composited on the CPU into a 32-bit image the size of the
+// window, straight from the glyph cache's coverage atlas, and the rows
+// that changed are copied to the window with XShmPutImage, or XPutImage
+// when the server can't share memory with us (remote displays). Glyphs
+// are alpha-blended 8 (AVX2) or 4 (SSE2) pixels at a time. A scroll moves
+// the image rows and the window contents (XCopyArea) and only the rows it
+// uncovered are composited and sent. Inline images are scaled (nearest
+// neighbour) and blended into the rows they cover, after the text.
+
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#if !defined(XST_NO_SIMD) && (defined(__SSE2__) || defined(__AVX2__))
+#include <immintrin.h>
+#endif
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+
+#include "xst.h"
+
+// Style table resolved to pixels, refreshed by sync_styles.
+typedef struct {
+    uint32_t fg, bg;
+    unsigned short attr;
+} ShmStyle;
+
+// What a cell was composited from; the glyph slot is resolved when the
+// row comes in, like the GL renderers do.
+typedef struct {
+    unsigned short slot, style, attr;
+} ShmCell;
+
+typedef struct {
+    Window win;
+    ShmStyle *styles;
+    int styles_cap;
+    ShmCell *grid;
+    int grid_rows, grid_cols;
+    unsigned char *row_render;          // Row needs compositing
+    unsigned char *row_put;             // Row differs between the image and the window
+    Visual *visual;
+    int depth;
+    GC gc;
+    XImage *image;
+    XShmSegmentInfo shm;
+    int use_shm, shm_attached;
+    int frame_ok, drawn_cursor_y;
+    int cell_h;
+    const GfxView *images;
+    int nimages;
+} Shm;
+
+static uint32_t pack_color(const Color *c) {
+    return (uint32_t)(c->r * 255.0f + 0.5f) << 16 | (uint32_t)(c->g * 255.0f + 0.5f) << 8 |
+           (uint32_t)(c->b * 255.0f + 0.5f);
+}
+
+static int shm_error;
+
+static int shm_error_handler(Display *d, XErrorEvent *ev) {
+    (void)d; (void)ev;
+    shm_error = 1;
+    return 0;
+}
+
+static void *shm_init(Window w) {
+    XWindowAttributes wa;
+    if (!XGetWindowAttributes(dpy, w, &wa)) return NULL;
+    // Pixels are written as 0xRRGGBB words.
+    if (wa.visual->class != TrueColor || wa.visual->red_mask != 0xff0000 || wa.visual->green_mask != 0xff00 ||
+        wa.visual->blue_mask != 0xff) {
+        fprintf(stderr, "xst: shm renderer needs a 24-bit TrueColor visual\n");
+        return NULL;
+    }
+    Shm *m = calloc(1, sizeof(*m));
+    if (!m) die("malloc failed for renderer");
+    m->win = w;
+    m->visual = wa.visual;
+    m->depth = wa.depth;
+    m->drawn_cursor_y = -1;
+    m->use_shm = XShmQueryExtension(dpy);
+    XGCValues gv = { .graphics_exposures = True };
+    m->gc = XCreateGC(dpy, w, GCGraphicsExposures, &gv);
+    return m;
+}
+
+static void image_free(Shm *m) {
+    if (!m->image) return;
+    if (m->shm_attached) {
+        XShmDetach(dpy, &m->shm);
+        XSync(dpy, False);
+        shmdt(m->shm.shmaddr);
+        m->shm_attached = 0;
+    } else {
+        free(m->image->data);
+    }
+    m->image->data = NULL;
+    XDestroyImage(m->image);
+    m->image = NULL;
+}
+
+// Sets up a shared memory image; 0 if the server can't attach it, which
+// is the case for remote displays even when they have the extension.
+static int image_shm(Shm *m, int w, int h) {
+    XImage *image = XShmCreateImage(dpy, m->visual, m->depth, ZPixmap, NULL, &m->shm, w, h);
+    if (!image) return 0;
+    m->shm.shmid = shmget(IPC_PRIVATE, (size_t)image->bytes_per_line * h, IPC_CREAT | 0600);
+    if (m->shm.shmid < 0) {
+        XDestroyImage(image);
+        return 0;
+    }
+    m->shm.shmaddr = image->data = shmat(m->shm.shmid, NULL, 0);
+    m->shm.readOnly = False;
+    shm_error = 0;
+    int (*old_handler)(Display *, XErrorEvent *) = XSetErrorHandler(shm_error_handler);
+    XShmAttach(dpy, &m->shm);
+    XSync(dpy, False);
+    XSetErrorHandler(old_handler);
+    // The segment goes away with the last detach.
+    shmctl(m->shm.shmid, IPC_RMID, NULL);
+    if (m->shm.shmaddr == (char *)-1 || shm_error) {
+        if (m->shm.shmaddr != (char *)-1) shmdt(m->shm.shmaddr);
+        image->data = NULL;
+        XDestroyImage(image);
+        return 0;
+    }
+    m->image = image;
+    m->shm_attached = 1;
+    return 1;
+}
+
+static void shm_viewport(void *r, int w, int h) {
+    Shm *m = r;
+    image_free(m);
+    if (m->use_shm && !image_shm(m, w, h)) {
+        fprintf(stderr, "xst: MIT-SHM unavailable, sending images over the connection\n");
+        m->use_shm = 0;
+    }
+    if (!m->image) {
+        m->image = XCreateImage(dpy, m->visual, m->depth, ZPixmap, 0, NULL, w, h, 32, 0);
+        if (!m->image) die("Could not create image");
+        m->image->data = malloc((size_t)m->image->bytes_per_line * h);
+        if (!m->image->data) die("malloc failed for image");
+    }
+    if (m->image->bits_per_pixel != 32) die("shm renderer needs 32-bit pixels");
+    uint32_t bg = pack_color(&color_palette[DEFAULT_BG]);
+    for (int y = 0; y < h; y++) {
+        uint32_t *p = (uint32_t *)(m->image->data + (size_t)y * m->image->bytes_per_line);
+        for (int x = 0; x < w; x++) p[x] = bg;
+    }
+    m->cell_h = (int)char_h;
+    m->frame_ok = 0;
+    if (m->row_render) memset(m->row_render, 1, m->grid_rows);
+}
+
+static void shm_sync_atlas(const AtlasDamage *d) {
+    (void)d;    // Glyphs are read straight from font_atlas
+}
+
+static void shm_sync_styles(void *r, const Style *s, int n) {
+    Shm *m = r;
+    if (n > m->styles_cap) {
+        free(m->styles);
+        m->styles = malloc(n * sizeof(*m->styles));
+        if (!m->styles) die("malloc failed for styles");
+        m->styles_cap = n;
+    }
+    for (int i = 0; i < n; i++) {
+        Color fg, bg;
+        style_colors(&s[i], &fg, &bg);
+        m->styles[i] = (ShmStyle){ pack_color(&fg), pack_color(&bg), s[i].attr };
+    }
+}
+
+static void shm_grid_resize(void *r, int rows, int cols) {
+    Shm *m = r;
+    free(m->grid);
+    free(m->row_render);
+    free(m->row_put);
+    m->grid = calloc((size_t)rows * cols, sizeof(*m->grid));
+    m->row_render = malloc(rows);
+    m->row_put = calloc(rows, 1);
+    if (!m->grid || !m->row_render || !m->row_put) die("malloc failed for grid");
+    memset(m->row_render, 1, rows);
+    m->grid_rows = rows; m->grid_cols = cols;
+    m->drawn_cursor_y = -1;
+    m->frame_ok = 0;
+}
+
+static void shm_update_row(void *r, int y, const Cell *line) {
+    Shm *m = r;
+    ShmCell *row = m->grid + (size_t)y * m->grid_cols;
+    for (int x = 0; x < m->grid_cols; x++) {
+        int invisible = m->styles[line[x].style].attr & ATTR_INVISIBLE;
+        row[x] = (ShmCell){ invisible ? 0 : glyph_lookup(line[x].c), line[x].style, line[x].attr };
+    }
+    m->row_render[y] = 1;
+}
+
+// (d * (255 - a) + f * a) / 255, rounded, for one channel
+static inline uint32_t blend_channel(uint32_t d, uint32_t f, uint32_t a) {
+    uint32_t x = d * (255 - a) + f * a + 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+#if !defined(XST_NO_SIMD) && defined(__SSE2__)
+// The same on 16-bit lanes; nothing there goes past 65535.
+static inline __m128i blend_lanes(__m128i d, __m128i f, __m128i a) {
+    __m128i x = _mm_add_epi16(_mm_mullo_epi16(d, _mm_sub_epi16(_mm_set1_epi16(255), a)), _mm_mullo_epi16(f, a));
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+#endif
+
+// Blends fg over n pixels with coverage a.
+static void blend_span(uint32_t *dst, const unsigned char *a, int n, uint32_t fg) {
+    int i = 0;
+#if !defined(XST_NO_SIMD) && defined(__AVX2__)
+    {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i f = _mm256_unpacklo_epi8(_mm256_set1_epi32(fg), zero);
+        for (; i + 8 <= n; i += 8) {
+            long long cov;
+            memcpy(&cov, a + i, 8);
+            if (!cov) continue;
+            // Each coverage byte spread over its pixel's four channels
+            __m256i c = _mm256_mullo_epi32(_mm256_cvtepu8_epi32(_mm_cvtsi64_si128(cov)), _mm256_set1_epi32(0x01010101));
+            __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+            __m256i lo_d = _mm256_unpacklo_epi8(d, zero), hi_d = _mm256_unpackhi_epi8(d, zero);
+            __m256i lo_c = _mm256_unpacklo_epi8(c, zero), hi_c = _mm256_unpackhi_epi8(c, zero);
+            __m256i c255 = _mm256_set1_epi16(255), c128 = _mm256_set1_epi16(128);
+            __m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(lo_d, _mm256_sub_epi16(c255, lo_c)), _mm256_mullo_epi16(f, lo_c));
+            __m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(hi_d, _mm256_sub_epi16(c255, hi_c)), _mm256_mullo_epi16(f, hi_c));
+            lo = _mm256_add_epi16(lo, c128);
+            hi = _mm256_add_epi16(hi, c128);
+            lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+            hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+            _mm256_storeu_si256((__m256i *)(dst + i), _mm256_packus_epi16(lo, hi));
+        }
+    }
+#endif
+#if !defined(XST_NO_SIMD) && defined(__SSE2__)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i f = _mm_unpacklo_epi8(_mm_set1_epi32(fg), zero);
+        for (; i + 4 <= n; i += 4) {
+            int cov;
+            memcpy(&cov, a + i, 4);
+            if (!cov) continue;
+            __m128i c = _mm_cvtsi32_si128(cov);
+            c = _mm_unpacklo_epi8(c, c);
+            c = _mm_unpacklo_epi16(c, c);
+            __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+            __m128i lo = blend_lanes(_mm_unpacklo_epi8(d, zero), f, _mm_unpacklo_epi8(c, zero));
+            __m128i hi = blend_lanes(_mm_unpackhi_epi8(d, zero), f, _mm_unpackhi_epi8(c, zero));
+            _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        if (!a[i]) continue;
+        uint32_t d = dst[i];
+        dst[i] = blend_channel(d >> 16 & 0xff, fg >> 16 & 0xff, a[i]) << 16 |
+                 blend_channel(d >> 8 & 0xff, fg >> 8 & 0xff, a[i]) << 8 |
+                 blend_channel(d & 0xff, fg & 0xff, a[i]);
+    }
+}
+
+static uint32_t *pixel_row(const Shm *m, int y) {
+    return (uint32_t *)(m->image->data + (size_t)y * m->image->bytes_per_line);
+}
+
+static void fill(const Shm *m, int x0, int y0, int x1, int y1, uint32_t c) {
+    for (int y = y0; y < y1; y++) {
+        uint32_t *p = pixel_row(m, y);
+        for (int x = x0; x < x1; x++) p[x] = c;
+    }
+}
+
+static void cell_colors(const Shm *m, const ShmCell *c, uint32_t *fg, uint32_t *bg, unsigned short *attr) {
+    const ShmStyle *st = &m->styles[c->style];
+    *fg = st->fg; *bg = st->bg; *attr = st->attr;
+    if (c->attr & ATTR_MATCH) {
+        *fg = pack_color(&search_colors[0]);
+        *bg = pack_color(&search_colors[(c->attr & ATTR_MATCH_CUR) ? 2 : 1]);
+    }
+    if (c->attr & ATTR_OVERLAY) {
+        *fg = pack_color(&overlay_colors[0]);
+        *bg = pack_color(&overlay_colors[1]);
+        *attr = 0;
+    }
+}
+
+// The parts of the images that fall in pixel rows y0..y1-1.
+static void render_images(const Shm *m, int y0, int y1) {
+    for (int i = 0; i < m->nimages; i++) {
+        const GfxView *v = &m->images[i];
+        const GfxPixels *px = v->px;
+        int ix = (int)(v->x * char_w) + v->off_x, iy = v->y * m->cell_h + v->off_y;
+        int top = iy > y0 ? iy : y0, bot = iy + v->dst_h < y1 ? iy + v->dst_h : y1;
+        int x0 = ix > 0 ? ix : 0, x1 = ix + v->dst_w < m->image->width ? ix + v->dst_w : m->image->width;
+        if (top >= bot || x0 >= x1) continue;
+        // Source steps per destination pixel, 16.16 fixed point
+        long long step_x = ((long long)v->src_w << 16) / v->dst_w, step_y = ((long long)v->src_h << 16) / v->dst_h;
+        for (int py = top; py < bot; py++) {
+            int sy = v->src_y + (int)((py - iy) * step_y >> 16);
+            const unsigned char *src = px->data + ((size_t)sy * px->w + v->src_x) * px->bpp;
+            uint32_t *dst = pixel_row(m, py);
+            for (int x = x0; x < x1; x++) {
+                const unsigned char *s = src + ((x - ix) * step_x >> 16) * px->bpp;
+                uint32_t a = px->bpp == 4 ? s[3] : 255, d = dst[x];
+                if (a == 255) dst[x] = (uint32_t)s[0] << 16 | s[1] << 8 | s[2];
+                else if (a) dst[x] = blend_channel(d >> 16 & 0xff, s[0], a) << 16 |
+                                     blend_channel(d >> 8 & 0xff, s[1], a) << 8 | blend_channel(d & 0xff, s[2], a);
+            }
+        }
+    }
+}
+
+// Composites screen row y: backgrounds, then glyphs, which may reach into
+// the next cell, then decorations, the cursor (cursor_x < 0: none) and
+// images.
+static void render_row(Shm *m, int y, int cursor_x) {
+    const ShmCell *row = m->grid + (size_t)y * m->grid_cols;
+    int cell_h = m->cell_h, y0 = y * cell_h, y1 = y0 + cell_h;
+    if (y1 > m->image->height) y1 = m->image->height;
+    for (int x = 0; x < m->grid_cols; x++) {
+        uint32_t fg, bg;
+        unsigned short attr;
+        cell_colors(m, &row[x], &fg, &bg, &attr);
+        fill(m, (int)(x * char_w), y0, (int)((x + 1) * char_w), y1, bg);
+    }
+    for (int x = 0; x < m->grid_cols; x++) {
+        const Glyph *g = &glyphs[row[x].slot];
+        if (!row[x].slot || g->bw <= 0) continue;
+        uint32_t fg, bg;
+        unsigned short attr;
+        cell_colors(m, &row[x], &fg, &bg, &attr);
+        int gx = (int)(x * char_w) + g->bl, gy = y0 + cell_h - g->bt;
+        int sx = 0, w = g->bw;
+        if (gx < 0) { sx = -gx; w += gx; gx = 0; }
+        if (gx + w > m->image->width) w = m->image->width - gx;
+        if (w <= 0) continue;
+        for (int r = 0; r < g->bh; r++) {
+            int py = gy + r;
+            if (py < y0 || py >= y1) continue;
+            blend_span(pixel_row(m, py) + gx, font_atlas + (size_t)(g->oy + r) * font_atlas_w + g->ox + sx, w, fg);
+        }
+    }
+    for (int x = 0; x < m->grid_cols; x++) {
+        uint32_t fg, bg;
+        unsigned short attr;
+        cell_colors(m, &row[x], &fg, &bg, &attr);
+        int x0 = (int)(x * char_w), x1 = (int)((x + 1) * char_w);
+        if ((attr & ATTR_UNDERLINE) && y0 + cell_h - 2 < y1) fill(m, x0, y0 + cell_h - 2, x1, y0 + cell_h - 1, fg);
+        if ((attr & ATTR_STRUCK) && y0 + cell_h / 2 < y1) fill(m, x0, y0 + cell_h / 2, x1, y0 + cell_h / 2 + 1, fg);
+    }
+    if (cursor_x >= 0 && cursor_x < m->grid_cols) {
+        int x0 = (int)(cursor_x * char_w), x1 = (int)((cursor_x + 1) * char_w);
+        for (int py = y0; py < y1; py++) {
+            uint32_t *p = pixel_row(m, py);
+            for (int x = x0; x < x1; x++) p[x] ^= 0xffffff;
+        }
+    }
+    if (m->nimages) render_images(m, y0, y1);
+}
+
+static void put_rows(const Shm *m, int y0, int y1) {
+    int top = y0 * m->cell_h, h = y1 * m->cell_h - top;
+    if (y1 == m->grid_rows) h = m->image->height - top;     // The margin below the grid goes with the last row
+    if (h <= 0) return;
+    if (m->use_shm) XShmPutImage(dpy, m->win, m->gc, m->image, 0, top, 0, top, m->image->width, h, False);
+    else XPutImage(dpy, m->win, m->gc, m->image, 0, top, 0, top, m->image->width, h);
+}
+
+static void shm_scroll(void *r, int top, int bot, int n) {
+    Shm *m = r;
+    int h = bot - top + 1, keep = h - (n > 0 ? n : -n);
+    int dst = n > 0 ? top : top - n, src = n > 0 ? top + n : top;
+    memmove(m->grid + (size_t)dst * m->grid_cols, m->grid + (size_t)src * m->grid_cols,
+            (size_t)keep * m->grid_cols * sizeof(*m->grid));
+    memmove(m->row_render + dst, m->row_render + src, keep);
+    memmove(m->row_put + dst, m->row_put + src, keep);
+    int bpl = m->image->bytes_per_line, py = dst * m->cell_h, sy = src * m->cell_h, ph = keep * m->cell_h;
+    if (py + ph > m->image->height || sy + ph > m->image->height) return;
+    memmove(m->image->data + (size_t)py * bpl, m->image->data + (size_t)sy * bpl, (size_t)ph * bpl);
+    // The window shifts the same way; parts of it that were covered come
+    // back as GraphicsExpose, which redraws everything.
+    if (m->frame_ok) XCopyArea(dpy, m->win, m->win, m->gc, 0, sy, m->image->width, ph, 0, py);
+    if (m->drawn_cursor_y >= top && m->drawn_cursor_y <= bot) {
+        m->drawn_cursor_y -= n;
+        if (m->drawn_cursor_y < top || m->drawn_cursor_y > bot) m->drawn_cursor_y = -1;
+    }
+}
+
+static void shm_images(void *r, const GfxView *v, int n) {
+    Shm *m = r;
+    m->images = v;
+    m->nimages = n;
+}
+
+static void shm_draw(void *r, int cursor_x, int cursor_y) {
+    Shm *m = r;
+    if (m->drawn_cursor_y >= 0 && m->drawn_cursor_y < m->grid_rows) m->row_render[m->drawn_cursor_y] = 1;
+    if (cursor_y >= 0 && cursor_y < m->grid_rows) m->row_render[cursor_y] = 1;
+    for (int y = 0; y < m->grid_rows; y++) {
+        if (!m->row_render[y]) continue;
+        render_row(m, y, y == cursor_y ? cursor_x : -1);
+        m->row_render[y] = 0;
+        m->row_put[y] = 1;
+    }
+    if (!m->frame_ok) {
+        put_rows(m, 0, m->grid_rows);
+        memset(m->row_put, 0, m->grid_rows);
+    }
+    for (int y = 0; y < m->grid_rows;) {
+        if (!m->row_put[y]) { y++; continue; }
+        int y1 = y;
+        while (y1 < m->grid_rows && m->row_put[y1]) m->row_put[y1++] = 0;
+        put_rows(m, y, y1);
+        y = y1;
+    }
+    m->drawn_cursor_y = cursor_y;
+    m->frame_ok = 1;
+    // The server reads shared pixels while it handles the request, so
+    // they mustn't change before it has.
+    if (m->use_shm) XSync(dpy, False);
+}
+
+static void shm_cleanup(void *r) {
+    Shm *m = r;
+    image_free(m);
+    XFreeGC(dpy, m->gc);
+    free(m->grid);
+    free(m->row_render);
+    free(m->row_put);
+    free(m->styles);
+    free(m);
+}
+
+// The image is in memory, and with MIT-SHM shared with the server rather
+// than copied to it.
+static void shm_memory(void *r, size_t *cpu, size_t *gpu) {
+    const Shm *m = r;
+    size_t image = m->image ? (size_t)m->image->bytes_per_line * m->image->height : 0;
+    *cpu = sizeof(*m) + m->styles_cap * sizeof(*m->styles) + (size_t)m->grid_rows * m->grid_cols * sizeof(*m->grid) +
+           2 * m->grid_rows + image;
+    *gpu = 0;
+}
+
+const Renderer render_shm = {
+    .name = "shm",
+    .software = 1,
+    .init = shm_init,
+    .sync_atlas = shm_sync_atlas,
+    .sync_styles = shm_sync_styles,
+    .viewport = shm_viewport,
+    .grid_resize = shm_grid_resize,
+    .update_row = shm_update_row,
+    .scroll = shm_scroll,
+    .images = shm_images,
+    .draw = shm_draw,
+    .cleanup = shm_cleanup,
+    .memory = shm_memory,
+};
@@ -0,0 +1,255 @@
+// search.c - Incremental search through the screen and scrollback; see
+// search.h.
+//
+// Lines are searched as the UTF-8 text term_line_text gives, which for
+// spilled lines is their record as it sits in the decompressed block. A
+// candidate has to match the query's first and last byte, checked 32 or
+// 16 positions at a time, before the bytes between are compared.
+
+#include <stdlib.h>
+#include <string.h>
+#if !defined(XST_NO_SIMD) && (defined(__SSE2__) || defined(__AVX2__))
+#include <immintrin.h>
+#endif
+
+#include "search.h"
+
+void search_init(Search *s) {
+    memset(s, 0, sizeof(*s));
+}
+
+void search_free(Search *s) {
+    free(s->older);
+    free(s->newer);
+    free(s->screen);
+    free(s->hits);
+    search_init(s);
+}
+
+static void reset(Search *s, const Term *t) {
+    s->nolder = s->newer_head = s->nnewer = s->nscreen = 0;
+    s->lo = s->hi = t->line_seq;
+    s->full = 0;
+    s->gen = t->hist_gen;
+    s->screen_ok = 0;
+    s->stale = 0;
+}
+
+void search_set(Search *s, const char *query, int len) {
+    const unsigned char *q = (const unsigned char *)query;
+    int upper = 0;
+    for (int i = 0; i < len; i++) upper |= q[i] >= 'A' && q[i] <= 'Z';
+    s->len = s->width = 0;
+    s->nolder = s->newer_head = s->nnewer = s->nscreen = 0;
+    s->stale = 1;
+    // Anything that isn't valid UTF-8 is taken as Latin-1, which is what
+    // XLookupString hands out for non-ASCII keys.
+    for (int i = 0; i < len && i < SEARCH_MAX;) {
+        uint32_t c = q[i];
+        int more = c < 0xc0 ? 0 : c < 0xe0 ? 1 : c < 0xf0 ? 2 : c < 0xf8 ? 3 : 0;
+        if (i + more >= len) more = 0;
+        for (int k = 1; k <= more; k++) {
+            if ((q[i + k] & 0xc0) != 0x80) more = 0;
+        }
+        if (more) {
+            c &= 0x3f >> more;
+            for (int k = 1; k <= more; k++) c = c << 6 | (q[i + k] & 0x3f);
+        }
+        i += more + 1;
+        int w = c < 0x20 ? 0 : term_wcwidth(c);
+        if (w == 0 || (c >= 0x80 && c < 0xa0)) continue;    // Never stored in a cell
+        unsigned char *p = s->needle + s->len;
+        if (c < 0x80) {
+            *p++ = !upper && c >= 'A' && c <= 'Z' ? c | 0x20 : c;
+        } else if (c < 0x800) {
+            *p++ = 0xc0 | c >> 6;
+            *p++ = 0x80 | (c & 0x3f);
+        } else if (c < 0x10000) {
+            *p++ = 0xe0 | c >> 12;
+            *p++ = 0x80 | (c >> 6 & 0x3f);
+            *p++ = 0x80 | (c & 0x3f);
+        } else {
+            *p++ = 0xf0 | c >> 18;
+            *p++ = 0x80 | (c >> 12 & 0x3f);
+            *p++ = 0x80 | (c >> 6 & 0x3f);
+            *p++ = 0x80 | (c & 0x3f);
+        }
+        if (w == 2) *p++ = 0;   // The wide character's dummy cell
+        for (unsigned char *f = s->needle + s->len; f < p; f++) {
+            s->fold[f - s->needle] = !upper && *f >= 'a' && *f <= 'z' ? 0x20 : 0;
+        }
+        s->len = p - s->needle;
+        s->width += w;
+    }
+}
+
+static int verify(const Search *s, const unsigned char *h) {
+    for (int j = 1; j < s->len; j++) {
+        if ((h[j] | s->fold[j]) != s->needle[j]) return 0;
+    }
+    return 1;
+}
+
+// Start of the first match in h[i..n), or n if there is none.
+static size_t find(const Search *s, const unsigned char *h, size_t n, size_t i) {
+    size_t m = s->len;
+    if (n < m) return n;
+    size_t end = n - m + 1;     // One past the last possible start
+    const unsigned char *nd = s->needle, *f = s->fold;
+#if !defined(XST_NO_SIMD) && defined(__AVX2__)
+    const __m256i f0 = _mm256_set1_epi8(f[0]), n0 = _mm256_set1_epi8(nd[0]);
+    const __m256i f1 = _mm256_set1_epi8(f[m - 1]), n1 = _mm256_set1_epi8(nd[m - 1]);
+    for (; i + 32 <= end; i += 32) {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_or_si256(_mm256_loadu_si256((const __m256i *)(h + i)), f0), n0);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_or_si256(_mm256_loadu_si256((const __m256i *)(h + i + m - 1)), f1), n1);
+        for (unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(a, b)); mask; mask &= mask - 1) {
+            size_t k = i + __builtin_ctz(mask);
+            if (verify(s, h + k)) return k;
+        }
+    }
+#endif
+#if !defined(XST_NO_SIMD) && defined(__SSE2__)
+    const __m128i g0 = _mm_set1_epi8(f[0]), m0 = _mm_set1_epi8(nd[0]);
+    const __m128i g1 = _mm_set1_epi8(f[m - 1]), m1 = _mm_set1_epi8(nd[m - 1]);
+    for (; i + 16 <= end; i += 16) {
+        __m128i a = _mm_cmpeq_epi8(_mm_or_si128(_mm_loadu_si128((const __m128i *)(h + i)), g0), m0);
+        __m128i b = _mm_cmpeq_epi8(_mm_or_si128(_mm_loadu_si128((const __m128i *)(h + i + m - 1)), g1), m1);
+        for (unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(a, b)); mask; mask &= mask - 1) {
+            size_t k = i + __builtin_ctz(mask);
+            if (verify(s, h + k)) return k;
+        }
+    }
+#endif
+    for (; i < end; i++) {
+        if ((h[i] | f[0]) == nd[0] && verify(s, h + i)) return i;
+    }
+    return n;
+}
+
+int search_text(Search *s, const unsigned char *text, size_t len) {
+    int n = 0, x = 0;
+    if (!s->len) return 0;
+    for (size_t i = 0, at = 0; (i = find(s, text, len, i)) < len; i += s->len) {
+        // One character per cell: the cell is the number of bytes before
+        // the match that start a character.
+        for (; at < i; at++) x += (text[at] & 0xc0) != 0x80;
+        if (n == s->hits_cap) {
+            int cap = s->hits_cap ? s->hits_cap * 2 : 64;
+            int *h = realloc(s->hits, cap * sizeof(*h));
+            if (!h) die("malloc failed for search");
+            s->hits = h;
+            s->hits_cap = cap;
+        }
+        s->hits[n++] = x;
+    }
+    return n;
+}
+
+static void push(SearchMatch **a, int *n, int *cap, long long line, int x) {
+    if (*n == *cap) {
+        int c = *cap ? *cap * 2 : 256;
+        SearchMatch *p = realloc(*a, c * sizeof(*p));
+        if (!p) die("malloc failed for search");
+        *a = p;
+        *cap = c;
+    }
+    (*a)[(*n)++] = (SearchMatch){ line, x };
+}
+
+static long long history_count(const Search *s) {
+    return s->nolder + s->nnewer - s->newer_head;
+}
+
+// Drops every match on the oldest line that has any and returns that
+// line.
+static long long drop_oldest(Search *s) {
+    long long line = s->nolder ? s->older[s->nolder - 1].line : s->newer[s->newer_head].line;
+    while (s->nolder && s->older[s->nolder - 1].line == line) s->nolder--;
+    while (!s->nolder && s->newer_head < s->nnewer && s->newer[s->newer_head].line == line) s->newer_head++;
+    if (s->newer_head == s->nnewer) s->newer_head = s->nnewer = 0;
+    return line;
+}
+
+static void add_newer(Search *s, long long line, int n) {
+    if (s->newer_head && s->nnewer + n > s->newer_cap) {
+        memmove(s->newer, s->newer + s->newer_head, (s->nnewer - s->newer_head) * sizeof(*s->newer));
+        s->nnewer -= s->newer_head;
+        s->newer_head = 0;
+    }
+    for (int i = 0; i < n; i++) push(&s->newer, &s->nnewer, &s->newer_cap, line, s->hits[i]);
+    while (history_count(s) > SEARCH_MAX_MATCHES) {
+        long long dropped = drop_oldest(s);
+        if (s->lo <= dropped) s->lo = dropped + 1;
+        s->full = 1;
+    }
+}
+
+int search_step(Search *s, Term *t, int budget) {
+    if (!s->len) return 0;
+    if (s->stale || s->gen != t->hist_gen) reset(s, t);
+    long long oldest = t->line_seq - term_hist_lines(t);
+    while (history_count(s) && (s->nolder ? s->older[s->nolder - 1].line : s->newer[s->newer_head].line) < oldest) {
+        drop_oldest(s);
+    }
+    if (s->lo < oldest) s->lo = oldest;
+    if (s->hi < s->lo) s->hi = s->lo;
+
+    if (!s->screen_ok || s->screen_bytes != t->stats.bytes) {
+        s->nscreen = 0;
+        for (int y = 0; y < t->rows; y++) {
+            size_t len;
+            const unsigned char *text = term_line_text(t, y, &len);
+            int n = search_text(s, text, len);
+            for (int i = 0; i < n; i++) push(&s->screen, &s->nscreen, &s->screen_cap, t->line_seq + y, s->hits[i]);
+        }
+        s->screen_bytes = t->stats.bytes;
+        s->screen_ok = 1;
+    }
+
+    // Lines that scrolled into history since the last call first, so the
+    // matches next to the screen are always complete.
+    for (; budget > 0 && s->hi < t->line_seq; budget--, s->hi++) {
+        size_t len;
+        const unsigned char *text = term_line_text(t, s->hi - t->line_seq, &len);
+        int n = search_text(s, text, len);
+        if (n) add_newer(s, s->hi, n);
+    }
+    for (; budget > 0 && s->lo > oldest && !s->full; budget--) {
+        size_t len;
+        const unsigned char *text = term_line_text(t, s->lo - 1 - t->line_seq, &len);
+        int n = search_text(s, text, len);
+        if (history_count(s) + n > SEARCH_MAX_MATCHES) {
+            s->full = 1;
+            break;
+        }
+        for (int i = n - 1; i >= 0; i--) push(&s->older, &s->nolder, &s->older_cap, s->lo - 1, s->hits[i]);
+        s->lo--;
+    }
+    return s->hi < t->line_seq || (s->lo > oldest && !s->full);
+}
+
+long long search_count(const Search *s) {
+    return history_count(s) + s->nscreen;
+}
+
+const SearchMatch *search_get(const Search *s, long long i) {
+    if (i < s->nolder) return &s->older[s->nolder - 1 - i];
+    i -= s->nolder;
+    if (i < s->nnewer - s->newer_head) return &s->newer[s->newer_head + i];
+    return &s->screen[i - (s->nnewer - s->newer_head)];
+}
+
+long long search_rank(const Search *s, long long line, int x) {
+    long long a = 0, b = search_count(s);
+    while (a < b) {
+        long long mid = a + (b - a) / 2;
+        const SearchMatch *m = search_get(s, mid);
+        if (m->line < line || (m->line == line && m->x < x)) a = mid + 1;
+        else b = mid;
+    }
+    return a;
+}
+
+int search_covers(const Search *s, const Term *t, long long line) {
+    return s->len && !s->stale && s->gen == t->hist_gen && s->hi >= t->line_seq && (s->lo <= line || s->full);
+}
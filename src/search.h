@@ -0,0 +1,76 @@
+// search.h - Incremental search through the screen and scrollback.
+//
+// The scrollback can run to millions of lines, so it is never searched
+// in one go. search_step scans a slice of lines per call, new history
+// first and then back from the newest line to the oldest, and keeps what
+// it found, so output arriving later only costs a scan of the new lines.
+// Matches are addressed by line number (Term.line_seq) and cell; a match
+// does not run across a wrapped line's rows.
+
+#ifndef XST_SEARCH_H
+#define XST_SEARCH_H
+
+#include "term.h"
+
+#define SEARCH_MAX          256         // Longest query, in bytes
+#define SEARCH_STEP         8192        // Lines search_step scans per call
+#define SEARCH_MAX_MATCHES  (1 << 20)   // Matches kept, newest first
+
+typedef struct {
+    long long line;
+    int x;                  // First cell; every match is `width` cells
+} SearchMatch;
+
+typedef struct {
+    // The query as it shows up in line text (see term_line_text). With no
+    // uppercase letter in it, ASCII case is ignored: `fold` is ORed into
+    // each text byte before comparing against `needle`, which is then
+    // lowercase.
+    unsigned char needle[2 * SEARCH_MAX], fold[2 * SEARCH_MAX];
+    int len;                // 0: no search
+    int width;              // In cells
+
+    // History matches, oldest first: older[nolder-1..0], then
+    // newer[newer_head..nnewer). The scan back from the newest line fills
+    // `older` and the scan of new lines fills `newer`. Screen rows change
+    // all the time and are scanned again whenever output arrives.
+    SearchMatch *older, *newer, *screen;
+    int nolder, older_cap, newer_head, nnewer, newer_cap, nscreen, screen_cap;
+    long long lo, hi;       // History lines scanned, [lo, hi)
+    int full;               // Matches before `lo` were dropped for room
+    unsigned gen;           // Term.hist_gen the line numbers are from
+    unsigned long long screen_bytes;  // Term.stats.bytes when the screen was scanned
+    int screen_ok;
+    int stale;              // The query changed: start over on the next step
+
+    int *hits;              // Scratch: cells where matches start in one line
+    int hits_cap;
+} Search;
+
+void search_init(Search *s);
+void search_free(Search *s);
+
+// Sets the query, `len` bytes of UTF-8, and forgets all matches; an
+// empty query turns searching off.
+void search_set(Search *s, const char *query, int len);
+
+// Scans up to `budget` lines. Returns nonzero while lines are left.
+int search_step(Search *s, Term *t, int budget);
+
+// Finds the matches in one line's text, storing their first cells in
+// s->hits in order. Returns how many there are.
+int search_text(Search *s, const unsigned char *text, size_t len);
+
+// Matches found so far, oldest first, history then screen.
+long long search_count(const Search *s);
+const SearchMatch *search_get(const Search *s, long long i);
+
+// Number of matches before (line, x).
+long long search_rank(const Search *s, long long line, int x);
+
+// Nonzero once no more matches will turn up from `line` down to the
+// screen: every line there has been scanned, or what lies before s->lo
+// was given up for room.
+int search_covers(const Search *s, const Term *t, long long line);
+
+#endif
@@ -0,0 +1,393 @@
+// spill.c - Compressed scrollback in a temporary file; see spill.h.
+//
+// The codec is a byte-oriented LZ77 in the style of LZ4: a token byte
+// holds the literal count in its high nibble and the match length minus
+// LZ_MIN_MATCH in its low one, either extended by 255-bytes when it is 15,
+// followed by the literals and a 16-bit little-endian match offset. The
+// last sequence has literals only. Matches are found through a hash of
+// the next four bytes; there is no entropy stage, so decoding a 64 KB
+// block takes well under a millisecond.
+
+#define _GNU_SOURCE             // fallocate()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "term.h"
+
+#define LZ_MIN_MATCH  4
+#define LZ_HASH_BITS  14
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITS  8         // Matches stop this far from the end
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static unsigned char *put_len(unsigned char *op, size_t n) {
+    for (; n >= 255; n -= 255) *op++ = 255;
+    *op++ = n;
+    return op;
+}
+
+static unsigned char *put_seq(unsigned char *op, const unsigned char *lit, size_t nlit,
+                              size_t off, size_t mlen) {
+    size_t m = mlen ? mlen - LZ_MIN_MATCH : 0;
+    *op++ = (nlit < 15 ? nlit : 15) << 4 | (m < 15 ? m : 15);
+    if (nlit >= 15) op = put_len(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (!mlen) return op;
+    *op++ = off & 0xff;
+    *op++ = off >> 8;
+    if (m >= 15) op = put_len(op, m - 15);
+    return op;
+}
+
+size_t lz_compress(const unsigned char *src, size_t n, unsigned char *dst) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    unsigned char *op = dst;
+    size_t i = 0, anchor = 0;
+    while (n > LZ_LAST_LITS + LZ_MIN_MATCH && i < n - LZ_LAST_LITS - LZ_MIN_MATCH) {
+        uint32_t v = read32(src + i);
+        uint32_t h = (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t cand = table[h];
+        table[h] = i;
+        if (cand >= i || i - cand > LZ_MAX_OFFSET || read32(src + cand) != v) {
+            // Skip faster through data that doesn't compress.
+            i += 1 + ((i - anchor) >> 6);
+            continue;
+        }
+        // Extend the match eight bytes at a time; the first differing
+        // byte is the lowest set one of the XOR (little-endian).
+        size_t m = LZ_MIN_MATCH, lim = n - LZ_LAST_LITS - i;
+        while (m + 8 <= lim) {
+            uint64_t a, b;
+            memcpy(&a, src + cand + m, 8);
+            memcpy(&b, src + i + m, 8);
+            if (a != b) {
+                m += __builtin_ctzll(a ^ b) >> 3;
+                break;
+            }
+            m += 8;
+        }
+        if (m + 8 > lim) {
+            while (m < lim && src[cand + m] == src[i + m]) m++;
+        }
+        op = put_seq(op, src + anchor, i - anchor, i - cand, m);
+        i += m;
+        anchor = i;
+    }
+    return put_seq(op, src + anchor, n - anchor, 0, 0) - dst;
+}
+
+static int get_len(const unsigned char **ip, const unsigned char *end, size_t *n) {
+    unsigned char b;
+    do {
+        if (*ip == end) return -1;
+        b = *(*ip)++;
+        *n += b;
+    } while (b == 255);
+    return 0;
+}
+
+long lz_decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t dst_cap) {
+    const unsigned char *ip = src, *end = src + n;
+    size_t o = 0;
+    while (ip < end) {
+        unsigned token = *ip++;
+        size_t nlit = token >> 4;
+        if (nlit == 15 && get_len(&ip, end, &nlit) < 0) return -1;
+        if (nlit > (size_t)(end - ip) || nlit > dst_cap - o) return -1;
+        memcpy(dst + o, ip, nlit);
+        ip += nlit;
+        o += nlit;
+        if (ip == end) break;
+        if (end - ip < 2) return -1;
+        size_t off = ip[0] | ip[1] << 8;
+        ip += 2;
+        size_t m = (token & 15);
+        if (m == 15 && get_len(&ip, end, &m) < 0) return -1;
+        m += LZ_MIN_MATCH;
+        if (off == 0 || off > o || m > dst_cap - o) return -1;
+        if (off >= m) {
+            memcpy(dst + o, dst + o - off, m);
+        } else {
+            for (size_t k = 0; k < m; k++) dst[o + k] = dst[o - off + k];
+        }
+        o += m;
+    }
+    return o;
+}
+
+void spill_init(Spill *s, size_t max_bytes) {
+    memset(s, 0, sizeof(*s));
+    s->max_bytes = max_bytes;
+    s->fd = -1;
+    for (int i = 0; i < SPILL_CACHE; i++) s->cache[i].first = -1;
+}
+
+static void stage_reset(Spill *s) {
+    for (int i = 0; i < s->stage_nstyles; i++) {
+        unsigned id = s->stage_styles[i];
+        s->stage_seen[id >> 3] &= ~(1 << (id & 7));
+    }
+    s->stage_len = 0;
+    s->stage_lines = 0;
+    s->stage_nstyles = 0;
+}
+
+// Forgets every block. The file is kept open but truncated.
+void spill_clear(Spill *s) {
+    for (int i = s->head; i < s->nblocks; i++) free(s->blocks[i].styles);
+    s->head = s->nblocks = 0;
+    stage_reset(s);
+    s->dropped = s->lines;
+    s->disk_bytes = s->raw_bytes = 0;
+    for (int i = 0; i < SPILL_CACHE; i++) s->cache[i].first = -1;
+    if (s->fd >= 0 && ftruncate(s->fd, 0) == 0) s->file_len = 0;
+}
+
+void spill_free(Spill *s) {
+    spill_clear(s);
+    if (s->fd >= 0) close(s->fd);
+    free(s->blocks);
+    free(s->stage);
+    free(s->stage_off);
+    free(s->stage_styles);
+    free(s->stage_seen);
+    for (int i = 0; i < SPILL_CACHE; i++) {
+        free(s->cache[i].buf);
+        free(s->cache[i].line_off);
+    }
+    free(s->zbuf);
+    spill_init(s, 0);
+}
+
+// Creates the spill file in $TMPDIR, or /var/tmp, which is usually on
+// disk where /tmp may well be in RAM. It is unlinked right away, so it
+// goes with the process however that ends.
+static int spill_open(Spill *s) {
+    const char *dirs[] = { getenv("TMPDIR"), "/var/tmp", "/tmp" };
+    char path[4096];
+    for (int i = 0; i < 3; i++) {
+        if (!dirs[i] || !*dirs[i]) continue;
+        snprintf(path, sizeof(path), "%s/xst-scrollback-XXXXXX", dirs[i]);
+        int fd = mkstemp(path);
+        if (fd < 0) continue;
+        unlink(path);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        s->fd = fd;
+        s->file_len = 0;
+        return 0;
+    }
+    return -1;
+}
+
+static void drop_oldest(Spill *s) {
+    SpillBlock *b = &s->blocks[s->head++];
+#ifdef FALLOC_FL_PUNCH_HOLE
+    // Give the disk space back; the file's length stays put.
+    fallocate(s->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, b->off, b->zlen);
+#endif
+    for (int i = 0; i < SPILL_CACHE; i++) {
+        if (s->cache[i].first == b->first) s->cache[i].first = -1;
+    }
+    s->dropped = b->first + b->nlines;
+    s->disk_bytes -= b->zlen;
+    s->raw_bytes -= b->len;
+    free(b->styles);
+    if (s->head == s->nblocks) {
+        s->head = s->nblocks = 0;
+    } else if (s->head >= 64 && s->head > s->nblocks / 2) {
+        memmove(s->blocks, s->blocks + s->head, (s->nblocks - s->head) * sizeof(*s->blocks));
+        s->nblocks -= s->head;
+        s->head = 0;
+    }
+}
+
+static int write_all(int fd, const unsigned char *p, size_t n, uint64_t off) {
+    while (n > 0) {
+        ssize_t w = pwrite(fd, p, n, off);
+        if (w <= 0) return -1;
+        p += w;
+        n -= w;
+        off += w;
+    }
+    return 0;
+}
+
+// Compresses the block being filled and appends it to the file. If the
+// file can't be created or written, spilling is turned off and lines
+// are dropped, as if there were no spill at all.
+static void seal(Spill *s) {
+    size_t need = lz_bound(s->stage_len);
+    if (need > s->zbuf_cap) {
+        free(s->zbuf);
+        s->zbuf = malloc(need);
+        if (!s->zbuf) die("malloc failed for scrollback spill");
+        s->zbuf_cap = need;
+    }
+    size_t z = lz_compress(s->stage, s->stage_len, s->zbuf);
+    if ((s->fd < 0 && spill_open(s) < 0) || write_all(s->fd, s->zbuf, z, s->file_len) < 0) {
+        perror("xst: scrollback spill file");
+        s->lines -= s->stage_lines;
+        spill_clear(s);
+        s->max_bytes = 0;
+        return;
+    }
+    if (s->nblocks == s->blocks_cap) {
+        s->blocks_cap = s->blocks_cap ? s->blocks_cap * 2 : 64;
+        s->blocks = realloc(s->blocks, s->blocks_cap * sizeof(*s->blocks));
+        if (!s->blocks) die("malloc failed for scrollback spill");
+    }
+    SpillBlock *b = &s->blocks[s->nblocks++];
+    b->off = s->file_len;
+    b->zlen = z;
+    b->len = s->stage_len;
+    b->first = s->lines - s->stage_lines;
+    b->nlines = s->stage_lines;
+    b->nstyles = s->stage_nstyles;
+    b->styles = NULL;
+    if (b->nstyles) {
+        b->styles = malloc(b->nstyles * sizeof(*b->styles));
+        if (!b->styles) die("malloc failed for scrollback spill");
+        memcpy(b->styles, s->stage_styles, b->nstyles * sizeof(*b->styles));
+    }
+    s->file_len += z;
+    s->disk_bytes += z;
+    s->raw_bytes += s->stage_len;
+    stage_reset(s);
+    while (s->disk_bytes > s->max_bytes && s->head < s->nblocks) drop_oldest(s);
+}
+
+void spill_ref(Spill *s, unsigned short id) {
+    if (!s->max_bytes || id == 0) return;
+    if (!s->stage_seen) {
+        s->stage_seen = calloc(65536 / 8, 1);
+        if (!s->stage_seen) die("malloc failed for scrollback spill");
+    }
+    if (s->stage_seen[id >> 3] & (1 << (id & 7))) return;
+    s->stage_seen[id >> 3] |= 1 << (id & 7);
+    if (s->stage_nstyles == s->stage_styles_cap) {
+        s->stage_styles_cap = s->stage_styles_cap ? s->stage_styles_cap * 2 : 64;
+        s->stage_styles = realloc(s->stage_styles, s->stage_styles_cap * sizeof(*s->stage_styles));
+        if (!s->stage_styles) die("malloc failed for scrollback spill");
+    }
+    s->stage_styles[s->stage_nstyles++] = id;
+}
+
+unsigned char *spill_reserve(Spill *s, size_t max) {
+    uint32_t l;
+    if (s->stage_len + sizeof(l) + max > s->stage_cap) {
+        size_t cap = s->stage_cap ? s->stage_cap : SPILL_BLOCK;
+        while (cap < s->stage_len + sizeof(l) + max) cap *= 2;
+        s->stage = realloc(s->stage, cap);
+        if (!s->stage) die("malloc failed for scrollback spill");
+        s->stage_cap = cap;
+    }
+    return s->stage + s->stage_len + sizeof(l);
+}
+
+void spill_commit(Spill *s, size_t len) {
+    uint32_t l = len;
+    if (s->stage_lines == s->stage_off_cap) {
+        s->stage_off_cap = s->stage_off_cap ? s->stage_off_cap * 2 : 256;
+        s->stage_off = realloc(s->stage_off, s->stage_off_cap * sizeof(*s->stage_off));
+        if (!s->stage_off) die("malloc failed for scrollback spill");
+    }
+    s->stage_off[s->stage_lines++] = s->stage_len;
+    memcpy(s->stage + s->stage_len, &l, sizeof(l));
+    s->stage_len += sizeof(l) + len;
+    s->lines++;
+    if (s->stage_len >= SPILL_BLOCK) seal(s);
+}
+
+// Maps block b in, decompresses it into cache entry c and indexes its
+// lines. Returns -1 if it can't be read back.
+static int load(Spill *s, const SpillBlock *b, SpillCache *c) {
+    c->first = -1;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t skew = b->off % page;
+    unsigned char *map = mmap(NULL, b->zlen + skew, PROT_READ, MAP_SHARED, s->fd, b->off - skew);
+    if (map == MAP_FAILED) return -1;
+    unsigned char *buf = realloc(c->buf, b->len);
+    if (!buf) die("malloc failed for scrollback spill");
+    c->buf = buf;
+    long n = lz_decompress(map + skew, b->zlen, c->buf, b->len);
+    munmap(map, b->zlen + skew);
+    if (n != (long)b->len) return -1;
+    if (c->lines_cap < b->nlines) {
+        c->line_off = realloc(c->line_off, b->nlines * sizeof(*c->line_off));
+        if (!c->line_off) die("malloc failed for scrollback spill");
+        c->lines_cap = b->nlines;
+    }
+    uint32_t o = 0;
+    for (int i = 0; i < b->nlines; i++) {
+        uint32_t l;
+        if (o + sizeof(l) > b->len) return -1;
+        memcpy(&l, c->buf + o, sizeof(l));
+        if (l > b->len - o - sizeof(l)) return -1;
+        c->line_off[i] = o;
+        o += sizeof(l) + l;
+    }
+    c->nlines = b->nlines;
+    c->first = b->first;
+    return 0;
+}
+
+const void *spill_line(Spill *s, long long n, size_t *len) {
+    long long i = s->lines - 1 - n;
+    if (n < 0 || i < s->dropped) return NULL;
+    const unsigned char *rec;
+    long long stage_first = s->lines - s->stage_lines;
+    if (i >= stage_first) {
+        rec = s->stage + s->stage_off[i - stage_first];
+    } else {
+        int lo = s->head, hi = s->nblocks - 1;
+        while (lo < hi) {
+            int mid = (lo + hi + 1) / 2;
+            if (s->blocks[mid].first <= i) lo = mid;
+            else hi = mid - 1;
+        }
+        const SpillBlock *b = &s->blocks[lo];
+        SpillCache *c = NULL;
+        for (int k = 0; k < SPILL_CACHE; k++) {
+            if (s->cache[k].first == b->first) c = &s->cache[k];
+        }
+        if (!c) {
+            c = &s->cache[s->cache_next];
+            s->cache_next = (s->cache_next + 1) % SPILL_CACHE;
+            if (load(s, b, c) < 0) return NULL;
+        }
+        rec = c->buf + c->line_off[i - b->first];
+    }
+    uint32_t l;
+    memcpy(&l, rec, sizeof(l));
+    *len = l;
+    return rec + sizeof(l);
+}
+
+size_t spill_ram(const Spill *s) {
+    size_t n = s->blocks_cap * sizeof(*s->blocks) + s->stage_cap + s->zbuf_cap +
+               s->stage_off_cap * sizeof(*s->stage_off) + s->stage_styles_cap * sizeof(*s->stage_styles);
+    if (s->stage_seen) n += 65536 / 8;
+    for (int i = s->head; i < s->nblocks; i++) n += s->blocks[i].nstyles * sizeof(*s->blocks[i].styles);
+    for (int i = 0; i < SPILL_CACHE; i++) {
+        if (s->cache[i].buf) n += SPILL_BLOCK + s->cache[i].lines_cap * sizeof(*s->cache[i].line_off);
+    }
+    return n;
+}
+
+void spill_mark(const Spill *s, unsigned char *used) {
+    for (int i = s->head; i < s->nblocks; i++) {
+        for (int k = 0; k < s->blocks[i].nstyles; k++) used[s->blocks[i].styles[k]] = 1;
+    }
+    for (int k = 0; k < s->stage_nstyles; k++) used[s->stage_styles[k]] = 1;
+}
@@ -0,0 +1,101 @@
+// spill.h - Compressed scrollback beyond the in-memory history.
+//
+// Lines that fall off the end of the line ring are appended here as
+// opaque records. Records are gathered into blocks of about SPILL_BLOCK
+// bytes, and each full block is compressed with a small built-in LZ codec
+// and appended to an unlinked temporary file. A block is mapped back in
+// and decompressed only when one of its lines is asked for. Once the file
+// holds more than max_bytes of blocks the oldest ones are dropped.
+
+#ifndef XST_SPILL_H
+#define XST_SPILL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Uncompressed bytes gathered before a block is compressed
+#define SPILL_BLOCK (64 * 1024)
+
+// Default cap on the compressed size of the spilled scrollback
+#define SPILL_MAX_MB 1024
+
+// Decompressed blocks kept around for scrolling and searching
+#define SPILL_CACHE 2
+
+typedef struct {
+    uint64_t off;               // Offset of the compressed bytes in the file
+    uint32_t zlen, len;         // Compressed and uncompressed size
+    long long first;            // Number of its first line
+    int nlines;
+    unsigned short *styles;     // Style ids its lines refer to
+    int nstyles;
+} SpillBlock;
+
+typedef struct {
+    long long first;            // First line in buf, -1 if the entry is empty
+    unsigned char *buf;         // Decompressed block
+    uint32_t *line_off;         // Where each line's record starts in buf
+    int nlines, lines_cap;
+} SpillCache;
+
+// Lines are numbered from 0 in the order they were pushed; numbers below
+// `dropped` are gone. Blocks blocks[head..nblocks) are live.
+typedef struct {
+    size_t max_bytes;           // 0: spilling is off
+    int fd;                     // -1 until the first block is written
+    uint64_t file_len;
+    SpillBlock *blocks;
+    int head, nblocks, blocks_cap;
+    long long lines, dropped;
+    uint64_t disk_bytes;        // Compressed size of the live blocks
+    uint64_t raw_bytes;         // Their uncompressed size
+
+    // Block being filled
+    unsigned char *stage;
+    uint32_t *stage_off;
+    size_t stage_len, stage_cap;
+    int stage_lines, stage_off_cap;
+    unsigned short *stage_styles;
+    int stage_nstyles, stage_styles_cap;
+    unsigned char *stage_seen;  // Bitmap over style ids, 65536 bits
+
+    SpillCache cache[SPILL_CACHE];
+    int cache_next;
+    unsigned char *zbuf;        // Compression scratch
+    size_t zbuf_cap;
+} Spill;
+
+void spill_init(Spill *s, size_t max_bytes);
+void spill_free(Spill *s);
+void spill_clear(Spill *s);
+
+// Appending a line: spill_reserve returns room for a record of up to
+// `max` bytes, spill_commit adds the first `len` of them as the next
+// line. Style ids the line uses are passed to spill_ref.
+unsigned char *spill_reserve(Spill *s, size_t max);
+void spill_commit(Spill *s, size_t len);
+void spill_ref(Spill *s, unsigned short style);
+
+// Line n lines back from the newest (0 is the newest), or NULL once n is
+// past the oldest line kept. The record stays valid until the next call.
+const void *spill_line(Spill *s, long long n, size_t *len);
+
+// Lines currently held
+static inline long long spill_lines(const Spill *s) {
+    return s->lines - s->dropped;
+}
+
+// Heap memory the spill uses itself: index, block being filled, cache.
+size_t spill_ram(const Spill *s);
+
+// Sets used[id] for every style id a held line refers to.
+void spill_mark(const Spill *s, unsigned char *used);
+
+// The codec. lz_compress needs lz_bound(n) bytes of room in dst and
+// returns the compressed size; lz_decompress returns the decompressed
+// size, or -1 if src is corrupt or would overrun dst_cap.
+#define lz_bound(n) ((n) + (n) / 255 + 16)
+size_t lz_compress(const unsigned char *src, size_t n, unsigned char *dst);
+long lz_decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t dst_cap);
+
+#endif
@@ -0,0 +1,103 @@
+// stats.c - Keypress-to-photon latency and the stats overlay; see stats.h.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+static LatencySample samples[STATS_RING];
+static unsigned long long nsamples;
+static long long frames[STATS_RING];
+static unsigned long long nframes;
+
+static const char *stage_names[] = { "key>write", "write>read", "read>drawn", "drawn>shown", "total" };
+
+void stats_latency(const LatencyProbe *p, long long drawn_ns, long long shown_ns) {
+    LatencySample *s = &samples[nsamples++ % STATS_RING];
+    s->ns[LAT_KEY] = p->key_ns;
+    s->ns[LAT_WRITE] = p->write_ns;
+    s->ns[LAT_READ] = p->read_ns;
+    s->ns[LAT_DRAWN] = drawn_ns;
+    s->ns[LAT_SHOWN] = shown_ns;
+}
+
+void stats_frame(long long ns) {
+    frames[nframes++ % STATS_RING] = ns;
+}
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// p50 and p99 of v[0..n), which gets sorted.
+static void percentiles(long long *v, int n, double *p50, double *p99) {
+    *p50 = *p99 = 0;
+    if (!n) return;
+    qsort(v, n, sizeof(*v), cmp_ll);
+    *p50 = v[n / 2] / 1e6;
+    *p99 = v[(n * 99) / 100] / 1e6;
+}
+
+// Stage durations of the samples held: stage i runs from point i to
+// point i + 1, and the last one is the total.
+static int stage(int i, long long *v) {
+    int n = nsamples < STATS_RING ? (int)nsamples : STATS_RING;
+    int a = i < LAT_POINTS - 1 ? i : LAT_KEY, b = i < LAT_POINTS - 1 ? i + 1 : LAT_SHOWN;
+    for (int k = 0; k < n; k++) v[k] = samples[k].ns[b] - samples[k].ns[a];
+    return n;
+}
+
+int stats_overlay(Overlay *o, const Snapshot *snap, unsigned long long frames_skipped, long long now) {
+    static long long v[STATS_RING];
+    char (*text)[OVERLAY_COLS + 1] = o->text;
+    char old[OVERLAY_ROWS][OVERLAY_COLS + 1];
+    memcpy(old, text, sizeof(old));
+    int row = 0;
+    snprintf(text[row++], OVERLAY_COLS + 1, "latency ms     p50    p99  (%llu keys)", nsamples);
+    for (int i = 0; i < LAT_POINTS; i++) {
+        double p50, p99;
+        percentiles(v, stage(i, v), &p50, &p99);
+        snprintf(text[row++], OVERLAY_COLS + 1, "%-11s %6.2f %6.2f", stage_names[i], p50, p99);
+    }
+    double p50, p99, rate = 0;
+    int n = nframes < STATS_RING ? (int)nframes : STATS_RING;
+    memcpy(v, frames, n * sizeof(*v));
+    percentiles(v, n, &p50, &p99);
+    if (o->ns && snap->parsed >= o->parsed)
+        rate = (snap->parsed - o->parsed) / ((now - o->ns) / 1e9) / 1e6;
+    snprintf(text[row++], OVERLAY_COLS + 1, "frame %.2f/%.2f ms %6.1f MB/s skip %llu", p50, p99, rate, frames_skipped);
+    o->ns = now;
+    o->parsed = snap->parsed;
+    return memcmp(old, text, sizeof(old)) != 0;
+}
+
+unsigned long long stats_frames(double *p50, double *p99) {
+    static long long v[STATS_RING];
+    int n = nframes < STATS_RING ? (int)nframes : STATS_RING;
+    memcpy(v, frames, n * sizeof(*v));
+    percentiles(v, n, p50, p99);
+    return nframes;
+}
+
+void stats_dump(FILE *f) {
+    static long long v[STATS_RING];
+    int n = nsamples < STATS_RING ? (int)nsamples : STATS_RING;
+    fprintf(f, "# xst keypress latency, %llu keys, last %d kept; ms\n", nsamples, n);
+    for (int i = 0; i < LAT_POINTS; i++) {
+        double p50, p99;
+        percentiles(v, stage(i, v), &p50, &p99);
+        fprintf(f, "# %-11s p50 %7.3f p99 %7.3f\n", stage_names[i], p50, p99);
+    }
+    double p50, p99;
+    int nf = nframes < STATS_RING ? (int)nframes : STATS_RING;
+    memcpy(v, frames, nf * sizeof(*v));
+    percentiles(v, nf, &p50, &p99);
+    fprintf(f, "# frame       p50 %7.3f p99 %7.3f\n", p50, p99);
+    fprintf(f, "# key>write write>read read>drawn drawn>shown total (us)\n");
+    for (int k = 0; k < n; k++) {
+        const LatencySample *s = &samples[(nsamples - n + k) % STATS_RING];
+        for (int i = 0; i < LAT_POINTS - 1; i++) fprintf(f, "%lld ", (s->ns[i + 1] - s->ns[i]) / 1000);
+        fprintf(f, "%lld\n", (s->ns[LAT_SHOWN] - s->ns[LAT_KEY]) / 1000);
+    }
+}
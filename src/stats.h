@@ -0,0 +1,50 @@
+// stats.h - Keypress-to-photon latency and the stats overlay.
+//
+// Latency samples and frame times go into fixed rings, newest replacing
+// oldest, that only the render thread touches; the IO thread's part of a
+// sample reaches it in the snapshot (see LatencyProbe). Percentiles are
+// worked out from the rings when the overlay or the exit report needs
+// them.
+
+#ifndef XST_STATS_H
+#define XST_STATS_H
+
+#include <stdio.h>
+
+#include "io.h"
+
+#define STATS_RING      4096        // Samples kept, per ring
+#define OVERLAY_ROWS    7
+#define OVERLAY_COLS    46
+#define OVERLAY_EVERY_NS 250000000LL // How often the overlay text is redone
+
+// A keypress's way to the screen: key (X event), write (to the pty),
+// read (first pty read after it), drawn (end of term_draw), shown (after
+// glXSwapBuffers, and glFinish with --latency-finish).
+enum { LAT_KEY, LAT_WRITE, LAT_READ, LAT_DRAWN, LAT_SHOWN, LAT_POINTS };
+
+typedef struct {
+    long long ns[LAT_POINTS];
+} LatencySample;
+
+void stats_latency(const LatencyProbe *p, long long drawn_ns, long long shown_ns);
+void stats_frame(long long ns);
+// Frames drawn so far; p50 and p99 of the frame times kept, in ms.
+unsigned long long stats_frames(double *p50, double *p99);
+
+// One window's overlay: its text, and when it was last redone, for the
+// parse rate.
+typedef struct {
+    char text[OVERLAY_ROWS][OVERLAY_COLS + 1];
+    long long ns;
+    unsigned long long parsed;
+} Overlay;
+
+// Redoes the overlay text; the parse rate is since the last call.
+// Returns nonzero if it changed.
+int stats_overlay(Overlay *o, const Snapshot *snap, unsigned long long frames_skipped, long long now);
+
+// Percentiles of every stage, then the samples, one per line in µs.
+void stats_dump(FILE *f);
+
+#endif
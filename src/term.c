@@ -0,0 +1,1573 @@
+// term.c - Display-free terminal core: the cell grid and the VT parser.
+
+#define _XOPEN_SOURCE 600
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if !defined(XST_NO_SIMD) && (defined(__SSE2__) || defined(__AVX2__))
+#include <immintrin.h>
+#endif
+
+#include "term.h"
+#include "graphics.h"
+#include "width.h"
+#include "parser_table.h"
+
+static const Cell empty_cell = {' ', 0, 0};
+
+void die(const char *s) {
+    perror(s);
+    exit(1);
+}
+
+static Cell *pool_get(RowPool *p) {
+    if (p->free_len == 0) {
+        Cell *slab = malloc((size_t)ROW_POOL_SLAB * p->width * sizeof(Cell));
+        Cell **slabs = realloc(p->slabs, (p->nslabs + 1) * sizeof(*slabs));
+        if (!slab || !slabs) die("malloc failed for row pool");
+        p->slabs = slabs;
+        p->slabs[p->nslabs++] = slab;
+        if (p->free_cap < ROW_POOL_SLAB) {
+            p->free_rows = realloc(p->free_rows, ROW_POOL_SLAB * sizeof(*p->free_rows));
+            if (!p->free_rows) die("malloc failed for row pool");
+            p->free_cap = ROW_POOL_SLAB;
+        }
+        // Push in reverse so rows are handed out in address order.
+        for (int i = ROW_POOL_SLAB - 1; i >= 0; i--) {
+            p->free_rows[p->free_len++] = slab + (size_t)i * p->width;
+        }
+    }
+    return p->free_rows[--p->free_len];
+}
+
+static void pool_put(RowPool *p, Cell *row) {
+    if (p->free_len == p->free_cap) {
+        p->free_cap *= 2;
+        p->free_rows = realloc(p->free_rows, p->free_cap * sizeof(*p->free_rows));
+        if (!p->free_rows) die("malloc failed for row pool");
+    }
+    p->free_rows[p->free_len++] = row;
+}
+
+static void pool_free(RowPool *p) {
+    for (int i = 0; i < p->nslabs; i++) free(p->slabs[i]);
+    free(p->slabs);
+    free(p->free_rows);
+    memset(p, 0, sizeof(*p));
+}
+
+static void clear_row(Cell *row, int start, int end) {
+    for (int x = start; x < end; x++) row[x] = empty_cell;
+}
+
+// Cells per codepoint: 0 for combining marks, 2 for wide characters.
+int term_wcwidth(uint32_t cp) {
+    if (cp < 0x80) return 1;
+    if (cp >= 0x110000) return 1;
+    return (width_stage2[width_stage1[cp >> 8]][(cp & 0xff) >> 2] >> ((cp & 3) * 2)) & 3;
+}
+
+// Cells x0..x1-1 of `line` are about to be overwritten. Blank out the
+// other half of any wide character that straddles either edge.
+static inline void unwide(Cell *line, int x0, int x1, int cols) {
+    if (x0 > 0 && (line[x0].attr & ATTR_WDUMMY)) {
+        line[x0 - 1].c = ' ';
+        line[x0 - 1].attr &= ~ATTR_WIDE;
+    }
+    if (x1 < cols && (line[x1].attr & ATTR_WDUMMY)) {
+        line[x1].c = ' ';
+        line[x1].attr &= ~ATTR_WDUMMY;
+    }
+}
+
+static unsigned style_hash(uint32_t fg, uint32_t bg, unsigned short attr) {
+    uint32_t h = fg * 0x9e3779b1u ^ bg * 0x85ebca77u ^ attr * 0xc2b2ae3du;
+    return h ^ (h >> 15);
+}
+
+static void styles_rehash(StyleTable *st) {
+    unsigned mask = 2 * st->cap - 1;
+    memset(st->hash, 0, 2 * st->cap * sizeof(*st->hash));
+    for (int id = 0; id < st->len; id++) {
+        if (!st->used[id]) continue;
+        const Style *s = &st->styles[id];
+        unsigned h = style_hash(s->fg, s->bg, s->attr) & mask;
+        while (st->hash[h]) h = (h + 1) & mask;
+        st->hash[h] = id + 1;
+    }
+}
+
+static void styles_alloc(StyleTable *st, int cap) {
+    st->styles = realloc(st->styles, cap * sizeof(*st->styles));
+    st->used = realloc(st->used, cap);
+    st->free_ids = realloc(st->free_ids, cap * sizeof(*st->free_ids));
+    free(st->hash);
+    st->hash = malloc(2 * cap * sizeof(*st->hash));
+    if (!st->styles || !st->used || !st->free_ids || !st->hash) die("malloc failed for style table");
+    memset(st->used + st->len, 0, cap - st->len);
+    st->cap = cap;
+    styles_rehash(st);
+}
+
+static void styles_init(StyleTable *st) {
+    memset(st, 0, sizeof(*st));
+    styles_alloc(st, STYLE_INIT);
+    st->styles[0] = (Style){DEFAULT_FG, DEFAULT_BG, 0};
+    st->used[0] = 1;
+    st->len = 1;
+    styles_rehash(st);
+}
+
+static void styles_free(StyleTable *st) {
+    free(st->styles);
+    free(st->used);
+    free(st->hash);
+    free(st->free_ids);
+    memset(st, 0, sizeof(*st));
+}
+
+static void mark_lines(StyleTable *st, Cell **lines, int line_cap, int cols) {
+    for (int i = 0; i < line_cap; i++) {
+        if (!lines[i]) continue;
+        for (int x = 0; x < cols; x++) st->used[lines[i][x].style] = 1;
+    }
+}
+
+// Mark and sweep: every id used by a cell on either screen or in the
+// scrollback, spilled lines included, or by the pen, survives; the rest
+// go on the free list.
+// Returns the number of free ids.
+static int styles_gc(Term *t) {
+    StyleTable *st = &t->styles;
+    memset(st->used, 0, st->len);
+    st->used[0] = 1;
+    if (!t->pen_stale) st->used[t->pen_style] = 1;
+    mark_lines(st, t->lines, t->line_cap, t->cols);
+    mark_lines(st, t->other.lines, t->other.line_cap, t->cols);
+    mark_lines(st, t->reflow.rows, t->reflow.len, t->reflow_cols);
+    spill_mark(&t->spill, st->used);
+    st->nfree = 0;
+    for (int id = st->len - 1; id > 0; id--) {
+        if (!st->used[id]) st->free_ids[st->nfree++] = id;
+    }
+    styles_rehash(st);
+    return st->nfree;
+}
+
+// Called with no free id left. Collects, and grows the table when that
+// doesn't free a quarter of it. Once the table is at STYLE_MAX and mostly
+// live, collections are spaced out so each is paid for by cap / 4 misses.
+// Returns 0 if there is still no free id.
+static int styles_make_room(Term *t) {
+    StyleTable *st = &t->styles;
+    if (st->gc_wait > 0) {
+        st->gc_wait--;
+        return 0;
+    }
+    int freed = styles_gc(t);
+    if (freed >= st->cap / 4) return 1;
+    if (st->cap < STYLE_MAX) {
+        styles_alloc(st, st->cap * 2);
+        return 1;
+    }
+    st->gc_wait = st->cap / 4;
+    return freed > 0;
+}
+
+// Index into the 6x6x6 color cube of the 256-color palette nearest to an
+// RGB color, for when the style table has no room for the RGB one.
+static unsigned short rgb_to_256(int r, int g, int b) {
+    #define CUBE(v) ((v) < 48 ? 0 : (v) < 115 ? 1 : ((v) - 35) / 40)
+    return 16 + 36 * CUBE(r & 0xff) + 6 * CUBE(g & 0xff) + CUBE(b & 0xff);
+    #undef CUBE
+}
+
+static int style_lookup(const StyleTable *st, uint32_t fg, uint32_t bg, unsigned short attr) {
+    unsigned mask = 2 * st->cap - 1;
+    for (unsigned h = style_hash(fg, bg, attr) & mask; st->hash[h]; h = (h + 1) & mask) {
+        const Style *s = &st->styles[st->hash[h] - 1];
+        if (s->fg == fg && s->bg == bg && s->attr == attr) return st->hash[h] - 1;
+    }
+    return -1;
+}
+
+static uint32_t color_to_256(uint32_t c) {
+    if (!(c & COLOR_RGB)) return c;
+    return rgb_to_256(c >> 16 & 0xff, c >> 8 & 0xff, c & 0xff);
+}
+
+// Id of the style (attr, fg, bg), adding it if it's new. When the table
+// is full of live styles it falls back to an existing style with the
+// colors reduced to the 256-color palette, or the default style.
+static unsigned short style_intern(Term *t, unsigned short attr, uint32_t fg, uint32_t bg) {
+    StyleTable *st = &t->styles;
+    int id = style_lookup(st, fg, bg, attr);
+    if (id >= 0) return id;
+    if (st->nfree == 0 && st->len == st->cap && !styles_make_room(t)) {
+        id = style_lookup(st, color_to_256(fg), color_to_256(bg), attr);
+        return id >= 0 ? id : 0;
+    }
+    id = st->nfree ? st->free_ids[--st->nfree] : st->len++;
+    st->styles[id] = (Style){fg, bg, attr};
+    st->used[id] = 1;
+    unsigned mask = 2 * st->cap - 1, h = style_hash(fg, bg, attr) & mask;
+    while (st->hash[h]) h = (h + 1) & mask;
+    st->hash[h] = id + 1;
+    st->version++;
+    return id;
+}
+
+static inline void pen_update(Term *t) {
+    if (!t->pen_stale) return;
+    t->pen_style = style_intern(t, t->attr, t->fg, t->bg);
+    t->pen_stale = 0;
+}
+
+void term_init(Term *t, int cols, int rows, int scrollback, size_t spill_max) {
+    memset(t, 0, sizeof(*t));
+    t->vt_state = VT_GROUND;
+    t->attr = 0;
+    t->fg = DEFAULT_FG;
+    t->bg = DEFAULT_BG;
+    // DECRC with nothing saved goes home in the default colors.
+    for (int i = 0; i < 2; i++) {
+        t->saved_cursor[i].fg = DEFAULT_FG;
+        t->saved_cursor[i].bg = DEFAULT_BG;
+    }
+    styles_init(&t->styles);
+    spill_init(&t->spill, spill_max);
+    t->scrollback = (scrollback > 0) ? scrollback : 0;
+    term_resize(t, cols, rows);
+}
+
+void term_free(Term *t) {
+    gfx_free(t);
+    pool_free(&t->pool);
+    pool_free(&t->reflow_pool);
+    free(t->reflow.rows);
+    free(t->reflow_out.rows);
+    free(t->lines);
+    free(t->other.lines);
+    free(t->dirty);
+    spill_free(&t->spill);
+    free(t->spill_rec);
+    free(t->spill_view);
+    free(t->line_text);
+    t->spill_rec = NULL;
+    t->spill_view = NULL;
+    t->line_text = NULL;
+    styles_free(&t->styles);
+    t->lines = NULL;
+    t->other.lines = NULL;
+    t->dirty = NULL;
+}
+
+// Swaps the showing screen's line ring with t->other.
+static void swap_rings(Term *t) {
+    Cell **lines = t->lines;
+    t->lines = t->other.lines;
+    t->other.lines = lines;
+    int v;
+    v = t->line_cap; t->line_cap = t->other.line_cap; t->other.line_cap = v;
+    v = t->line_alloc; t->line_alloc = t->other.line_alloc; t->other.line_alloc = v;
+    v = t->top; t->top = t->other.top; t->other.top = v;
+    v = t->hist_len; t->hist_len = t->other.hist_len; t->other.hist_len = v;
+    v = t->scrollback; t->scrollback = t->other.scrollback; t->other.scrollback = v;
+}
+
+static void rows_push(RowList *l, Cell *row) {
+    if (l->len == l->cap) {
+        int cap = l->cap ? l->cap * 2 : 256;
+        Cell **rows = realloc(l->rows, cap * sizeof(*rows));
+        if (!rows) die("malloc failed for row list");
+        l->rows = rows;
+        l->cap = cap;
+    }
+    l->rows[l->len++] = row;
+}
+
+static int row_wraps(const Cell *row, int cols) {
+    return (row[cols - 1].attr & ATTR_WRAP) != 0;
+}
+
+static int cell_blank(Cell c) {
+    return c.c == ' ' && c.style == 0 && c.attr == 0;
+}
+
+static int row_blank(const Cell *row, int cols) {
+    for (int x = 0; x < cols; x++) {
+        if (!cell_blank(row[x])) return 0;
+    }
+    return 1;
+}
+
+// Returns a row of the pending scrollback to the pool it came from. A
+// retired pool is freed whole once the last of them is gone.
+static void reflow_release(Term *t, Cell *row) {
+    if (!t->reflow_pool.width) pool_put(&t->pool, row);
+}
+
+static void reflow_discard(Term *t) {
+    for (int i = 0; i < t->reflow.len; i++) reflow_release(t, t->reflow.rows[i]);
+    t->reflow.len = 0;
+    pool_free(&t->reflow_pool);
+}
+
+static unsigned char *put16(unsigned char *p, unsigned v) {
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+    return p + 2;
+}
+
+static unsigned get16(const unsigned char *p) {
+    return p[0] | p[1] << 8;
+}
+
+static unsigned char *put_utf8(unsigned char *p, uint32_t c) {
+    if (c < 0x80) {
+        *p++ = c;
+    } else if (c < 0x800) {
+        *p++ = 0xc0 | c >> 6;
+        *p++ = 0x80 | (c & 0x3f);
+    } else if (c < 0x10000) {
+        *p++ = 0xe0 | c >> 12;
+        *p++ = 0x80 | (c >> 6 & 0x3f);
+        *p++ = 0x80 | (c & 0x3f);
+    } else {
+        *p++ = 0xf0 | c >> 18;
+        *p++ = 0x80 | (c >> 12 & 0x3f);
+        *p++ = 0x80 | (c >> 6 & 0x3f);
+        *p++ = 0x80 | (c & 0x3f);
+    }
+    return p;
+}
+
+// End of the run of cells from x on that share row[x]'s style and cell
+// attributes. The vector loops compare the (style, attr) half of several
+// cells at once.
+static int cell_run(const Cell *row, int x, int n) {
+    int e = x + 1;
+#if !defined(XST_NO_SIMD) && (defined(__SSE2__) || defined(__AVX2__))
+    uint32_t key;
+    memcpy(&key, (const char *)(row + x) + 4, 4);
+#endif
+#if !defined(XST_NO_SIMD) && defined(__AVX2__)
+    const __m256i key8 = _mm256_set_epi32(key, 0, key, 0, key, 0, key, 0);
+    for (; e + 4 <= n; e += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(row + e));
+        unsigned mask = (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, key8)));
+        if ((mask & 0xaa) != 0xaa) break;
+    }
+#endif
+#if !defined(XST_NO_SIMD) && defined(__SSE2__)
+    const __m128i key4 = _mm_set_epi32(key, 0, key, 0);
+    for (; e + 2 <= n; e += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(row + e));
+        unsigned mask = (unsigned)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, key4)));
+        if ((mask & 0xa) != 0xa) break;
+    }
+#endif
+    while (e < n && row[e].style == row[x].style && row[e].attr == row[x].attr) e++;
+    return e;
+}
+
+static unsigned char *put_ascii(unsigned char *restrict p, const Cell *restrict row, int n) {
+    for (int x = 0; x < n; x++) p[x] = row[x].c;
+    return p + n;
+}
+
+// Lines go to the spill as every cell's codepoint in UTF-8, then the
+// style runs as (cells, style, cell attr), then the number of runs, with
+// trailing blanks left off. A dummy cell's codepoint is a 0 byte. The
+// runs are gathered in spill_rec, then copied in after the text. An
+// all-ASCII line, the usual case, skips put_utf8.
+static void spill_row(Term *t, const Cell *row, int cols) {
+    if (!t->spill.max_bytes) return;
+    int n = cols;
+    while (n > 0 && cell_blank(row[n - 1])) n--;
+    if ((size_t)n * 6 > t->spill_rec_cap) {
+        free(t->spill_rec);
+        t->spill_rec = malloc((size_t)n * 6);
+        if (!t->spill_rec) die("malloc failed for scrollback spill");
+        t->spill_rec_cap = (size_t)n * 6;
+    }
+    unsigned char *rec = spill_reserve(&t->spill, (size_t)n * 10 + 2), *p = rec;
+    uint32_t any = 0;
+    for (int x = 0; x < n; x++) any |= row[x].c;
+    if (any < 0x80) {
+        p = put_ascii(p, row, n);
+    } else {
+        for (int x = 0; x < n; x++) p = put_utf8(p, row[x].c);
+    }
+    unsigned char *r = t->spill_rec;
+    for (int x = 0, e; x < n; x = e) {
+        e = cell_run(row, x, n);
+        spill_ref(&t->spill, row[x].style);
+        r = put16(put16(put16(r, e - x), row[x].style), row[x].attr);
+    }
+    if (r > t->spill_rec) memcpy(p, t->spill_rec, r - t->spill_rec);
+    p = put16(p + (r - t->spill_rec), (r - t->spill_rec) / 6);
+    spill_commit(&t->spill, p - rec);
+}
+
+// Spilled line n back from the newest, laid out in t->spill_view at the
+// current width. Cells past the width are cut off; wrap flags are dropped,
+// as the line keeps the width it was spilled at.
+static const Cell *spill_view_line(Term *t, long long n) {
+    if (t->spill_view_cap < t->cols) {
+        free(t->spill_view);
+        t->spill_view = malloc(t->cols * sizeof(Cell));
+        if (!t->spill_view) die("malloc failed for scrollback spill");
+        t->spill_view_cap = t->cols;
+    }
+    Cell *row = t->spill_view;
+    clear_row(row, 0, t->cols);
+    size_t len;
+    const unsigned char *rec = spill_line(&t->spill, n, &len);
+    if (!rec || len < 2 || 6 * get16(rec + len - 2) > len - 2) return row;
+    const unsigned char *end = rec + len - 2 - 6 * get16(rec + len - 2), *p = rec;
+    int x = 0;
+    for (const unsigned char *run = end; run < rec + len - 2 && x < t->cols; run += 6) {
+        Cell c = { 0, get16(run + 2), get16(run + 4) & ~ATTR_WRAP };
+        for (int k = get16(run); k > 0 && p < end && x < t->cols; k--) {
+            int more = *p < 0x80 ? 0 : *p < 0xe0 ? 1 : *p < 0xf0 ? 2 : 3;
+            c.c = more ? *p & (0x3f >> more) : *p;
+            if (end - p <= more) return row;
+            while (more--) c.c = c.c << 6 | (*++p & 0x3f);
+            p++;
+            row[x++] = c;
+        }
+    }
+    if (row[t->cols - 1].attr & ATTR_WIDE) row[t->cols - 1] = empty_cell;
+    return row;
+}
+
+// Line y of the view scrolled back into history: term_line() as far as
+// the ring goes, then the spill. Past the oldest line it is blank.
+const Cell *term_view_line(Term *t, long long y) {
+    if (y >= -t->hist_len) return term_line(t, y);
+    long long n = -y - t->hist_len - 1;
+    if (y < -term_hist_lines(t)) n = -1;
+    return spill_view_line(t, n);
+}
+
+// The text of line y of the view (as for term_view_line) in UTF-8, one
+// character per cell with a 0 byte for the right half of a wide one, and
+// trailing blanks left off. Spilled lines come straight from their record
+// and keep the width they were spilled at. Valid until the next call.
+const unsigned char *term_line_text(Term *t, long long y, size_t *len) {
+    *len = 0;
+    if (y < -t->hist_len) {
+        if (y < -term_hist_lines(t)) return NULL;
+        size_t n;
+        const unsigned char *rec = spill_line(&t->spill, -y - t->hist_len - 1, &n);
+        if (!rec || n < 2 || 6 * get16(rec + n - 2) > n - 2) return NULL;
+        *len = n - 2 - 6 * get16(rec + n - 2);
+        return rec;
+    }
+    const Cell *row = term_line(t, y);
+    int n = t->cols;
+    while (n > 0 && cell_blank(row[n - 1])) n--;
+    if ((size_t)n * 4 > t->line_text_cap) {
+        free(t->line_text);
+        t->line_text = malloc((size_t)n * 4);
+        if (!t->line_text) die("malloc failed for line text");
+        t->line_text_cap = (size_t)n * 4;
+    }
+    unsigned char *p = t->line_text;
+    uint32_t any = 0;
+    for (int x = 0; x < n; x++) any |= row[x].c;
+    if (any < 0x80) {
+        p = put_ascii(p, row, n);
+    } else {
+        for (int x = 0; x < n; x++) p = put_utf8(p, row[x].c);
+    }
+    *len = p - t->line_text;
+    return t->line_text;
+}
+
+// Moves whatever is still pending reflow to the spill, oldest row first.
+// It is older than anything left in the ring.
+static void spill_pending(Term *t) {
+    for (int i = 0; i < t->reflow.len; i++) spill_row(t, t->reflow.rows[i], t->reflow_cols);
+    reflow_discard(t);
+}
+
+// Appends one cell to the line being built in `out`, moving on to a new
+// row, and marking the full one as wrapped, at column `cols`.
+static void reflow_put(Term *t, RowList *out, int cols, int *x, Cell c) {
+    if (*x == cols) {
+        out->rows[out->len - 1][cols - 1].attr |= ATTR_WRAP;
+        rows_push(out, pool_get(&t->pool));
+        *x = 0;
+    }
+    out->rows[out->len - 1][(*x)++] = c;
+}
+
+// Lays the logical line held in src[0..n) (rows w cells wide, all but the
+// last wrapped) out again in rows of `cols` cells, appended to `out`. If
+// the cursor is on row `cur` of the line, at column cx, its new position
+// is stored in *ocy (an index into out) and *ocx.
+static void reflow_line(Term *t, Cell *const *src, int n, int w, int cols, RowList *out,
+                        int cur, int cx, int *ocy, int *ocx) {
+    int x = 0;
+    rows_push(out, pool_get(&t->pool));
+    int last = w;
+    while (last > 0 && cell_blank(src[n - 1][last - 1])) last--;
+    if (cur == n - 1 && last <= cx) last = (cx < w) ? cx + 1 : w;
+    for (int i = 0; i < n; i++) {
+        const Cell *row = src[i];
+        int end = (i == n - 1) ? last : w;
+        // term_put leaves the last cell behind when a wide character
+        // doesn't fit there; it is not part of the line.
+        Cell edge = row[w - 1];
+        edge.attr &= ~ATTR_WRAP;
+        if (i < n - 1 && cell_blank(edge) && (src[i + 1][0].attr & ATTR_WIDE)) end = w - 1;
+        for (int j = 0; j < end; j++) {
+            Cell c = row[j];
+            c.attr &= ~ATTR_WRAP;
+            int pair = (c.attr & ATTR_WIDE) && j + 1 < w && (row[j + 1].attr & ATTR_WDUMMY);
+            if (c.attr & ATTR_WDUMMY) c = empty_cell;   // Its first half was cut off
+            if (pair && cols < 2) {
+                c.attr &= ~ATTR_WIDE;                   // No room for both halves
+                pair = 0;
+                j++;
+            } else if (!pair) {
+                c.attr &= ~ATTR_WIDE;
+            }
+            if (pair && x == cols - 1) reflow_put(t, out, cols, &x, empty_cell);
+            reflow_put(t, out, cols, &x, c);
+            if (i == cur && (j == cx || (pair && j + 1 == cx))) {
+                *ocy = out->len - 1;
+                *ocx = x - 1;
+            }
+            if (pair) {
+                Cell d = row[++j];
+                d.attr &= ~ATTR_WRAP;
+                reflow_put(t, out, cols, &x, d);
+            }
+        }
+        // A cursor past the end of the line, waiting to wrap
+        if (i == cur && cx >= end) {
+            *ocy = out->len - 1;
+            *ocx = x;
+        }
+    }
+    clear_row(out->rows[out->len - 1], x, cols);
+}
+
+static void reverse_slots(Cell **l, int a, int b) {
+    for (; a < b; a++, b--) {
+        Cell *tmp = l[a];
+        l[a] = l[b];
+        l[b] = tmp;
+    }
+}
+
+// Rotates the ring in place so that the oldest history line is in slot 0
+// and the screen follows it.
+static void ring_linearize(Term *t) {
+    int k = t->top - t->hist_len;
+    if (k < 0) k += t->line_cap;
+    if (k) {
+        reverse_slots(t->lines, 0, k - 1);
+        reverse_slots(t->lines, k, t->line_cap - 1);
+        reverse_slots(t->lines, 0, t->line_cap - 1);
+    }
+    t->top = t->hist_len;
+}
+
+// Sets the ring to scrollback + rows slots, keeping its contents, which
+// must already be linear.
+static void ring_reserve(Term *t, int rows) {
+    int line_cap = t->scrollback + rows;
+    if (line_cap > t->line_alloc) {
+        // Room for twice the rows; the scrollback part never changes.
+        int alloc = line_cap + rows;
+        Cell **lines = realloc(t->lines, alloc * sizeof(*lines));
+        if (!lines) die("malloc failed for new grid");
+        memset(lines + t->line_alloc, 0, (alloc - t->line_alloc) * sizeof(*lines));
+        t->lines = lines;
+        t->line_alloc = alloc;
+    }
+    t->line_cap = line_cap;
+}
+
+// Resizes the showing screen without reflowing it: the screen keeps its
+// top rows, truncated or padded. Used for the alternate screen, whose
+// programs redraw on resize anyway. `old` is the pool the rows live in;
+// if it is not t->pool they are copied over.
+static void ring_resize(Term *t, int cols, int rows, RowPool *old) {
+    ring_linearize(t);
+    int old_rows = t->rows;
+    for (int y = rows; y < old_rows; y++) {
+        if (old == &t->pool) pool_put(&t->pool, t->lines[y]);
+        t->lines[y] = NULL;
+    }
+    ring_reserve(t, rows);
+    int min_cols = (t->cols < cols) ? t->cols : cols;
+    for (int y = 0; y < rows; y++) {
+        Cell *row = t->lines[y];
+        if (!row) {
+            row = pool_get(&t->pool);
+            clear_row(row, 0, cols);
+        } else {
+            if (old != &t->pool) {
+                row = pool_get(&t->pool);
+                memcpy(row, t->lines[y], min_cols * sizeof(Cell));
+            }
+            clear_row(row, min_cols, cols);
+            row[cols - 1].attr &= ~ATTR_WRAP;
+            if (row[cols - 1].attr & ATTR_WIDE) row[cols - 1] = empty_cell;
+        }
+        t->lines[y] = row;
+    }
+}
+
+// Resizes the main screen, which is showing. The cursor (*cx, *cy) stays
+// on the line it was on: blank rows below it go first when the screen
+// shrinks, then rows from the top move into history. When the width
+// changes the screen is reflowed, and so is the logical line that runs
+// into it from the history; the rest of the history is left to
+// term_reflow. `old` is the pool the rows live in before the resize.
+static void main_resize(Term *t, int cols, int rows, RowPool *old, int *cx, int *cy) {
+    ring_linearize(t);
+    int end = t->hist_len + t->rows;
+    int keep = t->hist_len;     // History rows that stay where they are
+    int cur = t->hist_len + *cy;
+    int ocy = *cy, ocx = *cx;
+    RowList *out = &t->reflow_out;
+    out->len = 0;
+
+    if (cols == t->cols) {
+        for (int i = keep; i < end; i++) rows_push(out, t->lines[i]);
+    } else {
+        // With scrollback still pending from an earlier width, the part
+        // already reflowed is done again now, so that the pending rows
+        // stay the oldest.
+        int s = 0;
+        if (!t->reflow.len) {
+            s = t->hist_len;
+            while (s > 0 && row_wraps(t->lines[s - 1], t->cols)) s--;
+            for (int i = 0; i < s; i++) rows_push(&t->reflow, t->lines[i]);
+            t->reflow_cols = t->cols;
+        }
+        keep = 0;
+        ocy = -1;
+        for (int i = s; i < end;) {
+            int j = i;
+            while (j < end - 1 && row_wraps(t->lines[j], t->cols)) j++;
+            int on = (cur >= i && cur <= j) ? cur - i : -1;
+            reflow_line(t, t->lines + i, j - i + 1, t->cols, cols, out, on, *cx, &ocy, &ocx);
+            i = j + 1;
+        }
+        for (int i = s; i < end; i++) {
+            if (old == &t->pool) pool_put(&t->pool, t->lines[i]);
+        }
+        if (ocy < 0) { ocy = out->len - 1; ocx = 0; }
+    }
+    for (int i = keep; i < end; i++) t->lines[i] = NULL;
+
+    // Fit the rows to the screen, keeping the cursor on it.
+    int n = out->len;
+    while (n > rows && n > ocy + 1 && row_blank(out->rows[n - 1], cols)) pool_put(&t->pool, out->rows[--n]);
+    int up = n - rows;
+    if (up > ocy) up = ocy;
+    if (up < 0) up = 0;
+    while (n > up + rows) pool_put(&t->pool, out->rows[--n]);
+
+    // History overflow spills the oldest lines, after anything still
+    // pending, which is older still.
+    int drop = keep + up - t->scrollback;
+    if (drop > 0) {
+        spill_pending(t);
+        int k = drop < keep ? drop : keep;
+        for (int i = 0; i < k; i++) {
+            spill_row(t, t->lines[i], t->cols);
+            pool_put(&t->pool, t->lines[i]);
+        }
+        memmove(t->lines, t->lines + k, (keep - k) * sizeof(*t->lines));
+        memset(t->lines + keep - k, 0, k * sizeof(*t->lines));
+        keep -= k;
+        int o = drop - k;
+        for (int i = 0; i < o; i++) {
+            spill_row(t, out->rows[i], cols);
+            pool_put(&t->pool, out->rows[i]);
+        }
+        memmove(out->rows, out->rows + o, (n - o) * sizeof(*out->rows));
+        n -= o;
+        up -= o;
+        ocy -= o;
+    }
+    int hist = keep + up;
+    ring_reserve(t, rows);
+    for (int i = 0; i < n; i++) t->lines[keep + i] = out->rows[i];
+    for (int y = n - up; y < rows; y++) {
+        Cell *row = pool_get(&t->pool);
+        clear_row(row, 0, cols);
+        t->lines[hist + y] = row;
+    }
+    out->len = 0;
+    t->hist_len = hist;
+    t->top = hist;
+    *cy = ocy - up;
+    *cx = ocx;
+}
+
+void term_memory(const Term *t, TermMemory *m) {
+    size_t cells = (size_t)t->pool.nslabs * t->pool.width + (size_t)t->reflow_pool.nslabs * t->reflow_pool.width;
+    m->rows = cells * ROW_POOL_SLAB * sizeof(Cell) + (size_t)(t->line_alloc + t->other.line_alloc) * sizeof(Cell *);
+    m->spill_ram = spill_ram(&t->spill) + t->spill_rec_cap + t->spill_view_cap * sizeof(Cell);
+    m->spill_lines = spill_lines(&t->spill);
+    m->spill_disk = t->spill.disk_bytes;
+    m->spill_raw = t->spill.raw_bytes;
+    m->images = gfx_memory(t);
+}
+
+// Resizes both screens. Rows move to a new, wider pool only when the
+// width outgrows the current one; the old pool is kept as reflow_pool
+// while pending scrollback still lives in it.
+void term_resize(Term *t, int cols, int rows) {
+    if (cols < 1) cols = 1;
+    if (rows < 1) rows = 1;
+
+    if (!t->lines) {
+        t->pool.width = cols;
+        for (int screen = 0; screen < 2; screen++) {
+            ring_reserve(t, rows);
+            for (int y = 0; y < rows; y++) {
+                t->lines[y] = pool_get(&t->pool);
+                clear_row(t->lines[y], 0, cols);
+            }
+            swap_rings(t);
+        }
+    } else {
+        if (cols == t->cols && rows == t->rows) return;
+        RowPool *src = &t->pool;
+        if (cols > t->pool.width) {
+            // Pending rows would end up in a third pool; finish them first.
+            if (t->reflow_pool.width) term_reflow(t, INT_MAX);
+            int width = t->pool.width + t->pool.width / 2;
+            t->reflow_pool = t->pool;
+            t->pool = (RowPool){ .width = width > cols ? width : cols };
+            src = &t->reflow_pool;
+        }
+        // The alternate screen first: it may still have rows in the old
+        // pool, which the main screen's resize can free.
+        if (!t->alt_screen) swap_rings(t);
+        ring_resize(t, cols, rows, src);
+        swap_rings(t);
+        if (t->alt_screen) main_resize(t, cols, rows, src, &t->saved_cursor[0].x, &t->saved_cursor[0].y);
+        else main_resize(t, cols, rows, src, &t->cursor_x, &t->cursor_y);
+        if (t->alt_screen) swap_rings(t);
+        if (!t->reflow.len) pool_free(&t->reflow_pool);
+    }
+
+    if (rows > t->dirty_cap) {
+        free(t->dirty);
+        t->dirty = malloc(rows);
+        if (!t->dirty) die("malloc failed for new grid");
+        t->dirty_cap = rows;
+    }
+
+    t->cols = cols; t->rows = rows;
+    t->hist_gen++;
+    term_dirty_all(t);
+
+    // main_resize has already moved the main screen's cursor.
+    if (t->alt_screen) {
+        if (t->cursor_x >= cols) t->cursor_x = cols - 1;
+        if (t->cursor_y >= rows) t->cursor_y = rows - 1;
+    }
+    t->scroll_top = 0;
+    t->scroll_bot = rows - 1;
+}
+
+// Reflows up to `budget` rows of the scrollback left pending by a width
+// change, newest first, and puts them in front of the history. Returns
+// nonzero while there is more to do.
+int term_reflow(Term *t, int budget) {
+    if (!t->reflow.len) return 0;
+    if (t->alt_screen) swap_rings(t);
+    RowList *out = &t->reflow_out;
+    while (budget > 0 && t->reflow.len) {
+        int e = t->reflow.len, s = e - 1;
+        while (s > 0 && row_wraps(t->reflow.rows[s - 1], t->reflow_cols)) s--;
+        out->len = 0;
+        int unused;
+        reflow_line(t, t->reflow.rows + s, e - s, t->reflow_cols, t->cols, out, -1, 0, &unused, &unused);
+        for (int i = s; i < e; i++) reflow_release(t, t->reflow.rows[i]);
+        t->reflow.len = s;
+        budget -= e - s;
+        for (int i = out->len - 1; i >= 0; i--) {
+            if (t->hist_len == t->scrollback) {
+                // The ring is full: the rest goes to the spill, oldest first.
+                spill_pending(t);
+                for (int k = 0; k <= i; k++) {
+                    spill_row(t, out->rows[k], t->cols);
+                    pool_put(&t->pool, out->rows[k]);
+                }
+                break;
+            }
+            int slot = t->top - t->hist_len - 1;
+            if (slot < 0) slot += t->line_cap;
+            t->lines[slot] = out->rows[i];
+            t->hist_len++;
+        }
+        out->len = 0;
+    }
+    if (!t->reflow.len) pool_free(&t->reflow_pool);
+    if (t->alt_screen) swap_rings(t);
+    return t->reflow.len > 0;
+}
+
+static void save_cursor(Term *t) {
+    t->saved_cursor[t->alt_screen].x = t->cursor_x;
+    t->saved_cursor[t->alt_screen].y = t->cursor_y;
+    t->saved_cursor[t->alt_screen].attr = t->attr;
+    t->saved_cursor[t->alt_screen].fg = t->fg;
+    t->saved_cursor[t->alt_screen].bg = t->bg;
+}
+
+static void restore_cursor(Term *t) {
+    t->cursor_x = t->saved_cursor[t->alt_screen].x;
+    t->cursor_y = t->saved_cursor[t->alt_screen].y;
+    t->attr = t->saved_cursor[t->alt_screen].attr;
+    t->fg = t->saved_cursor[t->alt_screen].fg;
+    t->bg = t->saved_cursor[t->alt_screen].bg;
+    t->pen_stale = 1;
+    if (t->cursor_x >= t->cols) t->cursor_x = t->cols - 1;
+    if (t->cursor_y >= t->rows) t->cursor_y = t->rows - 1;
+}
+
+// Shows the alternate screen (alt = 1) or the main one. Both are always
+// allocated, so this is a swap of ring pointers plus one full damage.
+static void switch_screen(Term *t, int alt) {
+    if (t->alt_screen == alt) return;
+    swap_rings(t);
+    t->alt_screen = alt;
+    t->hist_gen++;
+    term_dirty_all(t);
+    if (t->gfx) gfx_screen(t);
+}
+
+// Blanks the showing screen, leaving the cursor and history alone.
+static void erase_screen(Term *t) {
+    for (int y = 0; y < t->rows; y++) clear_row(term_line(t, y), 0, t->cols);
+    term_dirty_all(t);
+}
+
+// DEC private modes (CSI ? Pm h / CSI ? Pm l)
+static void set_private_mode(Term *t, int mode, int on) {
+    switch (mode) {
+        case 47: // Alternate screen
+            switch_screen(t, on);
+            break;
+        case 1047: // Alternate screen, cleared on leaving
+            if (!on && t->alt_screen) erase_screen(t);
+            switch_screen(t, on);
+            break;
+        case 1049: // Save cursor and switch to a cleared alternate screen
+            if (on) {
+                if (t->alt_screen) break;
+                save_cursor(t);
+                switch_screen(t, 1);
+                erase_screen(t);
+            } else {
+                if (!t->alt_screen) break;
+                switch_screen(t, 0);
+                restore_cursor(t);
+            }
+            break;
+        case 2004: // Bracketed paste; io.c does the wrapping
+            t->bracketed_paste = on;
+            break;
+        case 2026: // Synchronized output; io.c holds the screen back
+            t->sync_update = on;
+            break;
+    }
+}
+
+// DECRQM (CSI ? Pm $ p): whether a private mode is set (1), reset (2) or
+// not known (0). Programs ask about 2026 before using it.
+static void report_private_mode(Term *t, int mode) {
+    int state;
+    switch (mode) {
+        case 47: case 1047: case 1049: state = t->alt_screen ? 1 : 2; break;
+        case 2004: state = t->bracketed_paste ? 1 : 2; break;
+        case 2026: state = t->sync_update ? 1 : 2; break;
+        default: state = 0; break;
+    }
+    if (t->report_mode) t->report_mode(t, mode, state);
+}
+
+void osc_dispatch(Term *t) {
+    // Only handling window title (OSC 2) for now
+    if (t->osc_len > 2 && t->osc_buf[0] == '2' && t->osc_buf[1] == ';') {
+        if (t->set_title) t->set_title(t, &t->osc_buf[2]);
+    }
+}
+
+static uint32_t rgb(int r, int g, int b) {
+    return COLOR_RGB | (r & 0xff) << 16 | (g & 0xff) << 8 | (b & 0xff);
+}
+
+// Parses the color that follows SGR 38 or 48 at params[i], in either the
+// colon form (38:5:n, 38:2::r:g:b, 38:2:r:g:b) or the semicolon form
+// (38;5;n, 38;2;r;g;b). Sets *color if the color is valid and returns the
+// index of the last parameter consumed.
+static int sgr_color(const int *params, int n, unsigned sub, int i, uint32_t *color) {
+    if (i + 1 < n && (sub >> (i + 1) & 1)) {
+        int j = i + 1;
+        while (j + 1 < n && (sub >> (j + 1) & 1)) j++;
+        int nsub = j - i;
+        if (params[i + 1] == 5 && nsub >= 2) *color = params[i + 2] & 0xff;
+        else if (params[i + 1] == 2 && nsub >= 5) *color = rgb(params[i + 3], params[i + 4], params[i + 5]);
+        else if (params[i + 1] == 2 && nsub == 4) *color = rgb(params[i + 2], params[i + 3], params[i + 4]);
+        return j;
+    }
+    if (i + 2 < n && params[i + 1] == 5) {
+        *color = params[i + 2] & 0xff;
+        return i + 2;
+    }
+    if (i + 4 < n && params[i + 1] == 2) {
+        *color = rgb(params[i + 2], params[i + 3], params[i + 4]);
+        return i + 4;
+    }
+    return i;
+}
+
+static void sgr(Term *t, const int *params, int n) {
+    t->pen_stale = 1;
+    if (n == 0) { // ESC[m is same as ESC[0m
+        t->attr = 0; t->fg = DEFAULT_FG; t->bg = DEFAULT_BG;
+        return;
+    }
+    unsigned sub = t->param_sub;
+    for (int i = 0; i < n; i++) {
+        int p = params[i];
+        switch (p) {
+            case 0: t->attr = 0; t->fg = DEFAULT_FG; t->bg = DEFAULT_BG; break;
+            case 1: t->attr |= ATTR_BOLD; break;
+            case 2: t->attr |= ATTR_FAINT; break;
+            case 3: t->attr |= ATTR_ITALIC; break;
+            case 4: // 4:0 is "no underline"; 4:1 to 4:5 are underline styles
+                if (i + 1 < n && (sub >> (i + 1) & 1) && params[i + 1] == 0) t->attr &= ~ATTR_UNDERLINE;
+                else t->attr |= ATTR_UNDERLINE;
+                break;
+            case 5: t->attr |= ATTR_BLINK; break;
+            case 7: t->attr |= ATTR_REVERSE; break;
+            case 8: t->attr |= ATTR_INVISIBLE; break;
+            case 9: t->attr |= ATTR_STRUCK; break;
+            case 22: t->attr &= ~(ATTR_BOLD | ATTR_FAINT); break;
+            case 23: t->attr &= ~ATTR_ITALIC; break;
+            case 24: t->attr &= ~ATTR_UNDERLINE; break;
+            case 25: t->attr &= ~ATTR_BLINK; break;
+            case 27: t->attr &= ~ATTR_REVERSE; break;
+            case 28: t->attr &= ~ATTR_INVISIBLE; break;
+            case 29: t->attr &= ~ATTR_STRUCK; break;
+            case 38: i = sgr_color(params, n, sub, i, &t->fg); break;
+            case 39: t->fg = DEFAULT_FG; break;
+            case 48: i = sgr_color(params, n, sub, i, &t->bg); break;
+            case 49: t->bg = DEFAULT_BG; break;
+            default:
+                if (p >= 30 && p <= 37) t->fg = p - 30;
+                else if (p >= 40 && p <= 47) t->bg = p - 40;
+                else if (p >= 90 && p <= 97) t->fg = p - 90 + 8;
+                else if (p >= 100 && p <= 107) t->bg = p - 100 + 8;
+                break;
+        }
+        // Sub-parameters nobody consumed belong to p; skip them.
+        while (i + 1 < n && (sub >> (i + 1) & 1)) i++;
+    }
+}
+
+void csi_dispatch(Term *t, char final) {
+    int n = t->nparams < VT_MAX_PARAMS ? t->nparams : VT_MAX_PARAMS;
+    const int *params = t->params;
+
+    if (t->nintermediates) {
+        if (t->private_marker == '?' && t->nintermediates == 1 && t->intermediates[0] == '$' && final == 'p') {
+            report_private_mode(t, n > 0 ? params[0] : 0);
+        }
+        return;
+    }
+    if (t->private_marker == '?' && (final == 'h' || final == 'l')) {
+        for (int i = 0; i < n; i++) set_private_mode(t, params[i], final == 'h');
+        return;
+    }
+    if (t->private_marker) return;
+
+    int p0 = n > 0 ? params[0] : 0;
+    int count = p0 > 0 ? p0 : 1;
+
+    switch (final) {
+        case 'H': // Set cursor position
+        case 'f':
+            t->cursor_y = count - 1;
+            t->cursor_x = (n > 1 && params[1] > 0) ? params[1] - 1 : 0;
+            break;
+        case 'A': t->cursor_y -= count; break; // Up
+        case 'B': t->cursor_y += count; break; // Down
+        case 'C': t->cursor_x += count; break; // Forward
+        case 'D': t->cursor_x -= count; break; // Backward
+        case 'J': clear_screen(t, p0); break;
+        case 'K': clear_line(t, p0); break;
+        case 'm': sgr(t, params, n); return; // Select Graphic Rendition
+        case 'r': { // Set scrolling region
+            int top = count - 1;
+            int bot = (n > 1 && params[1] > 0) ? params[1] - 1 : t->rows - 1;
+            if (bot >= t->rows) bot = t->rows - 1;
+            if (top >= bot) break;
+            t->scroll_top = top;
+            t->scroll_bot = bot;
+            t->cursor_x = t->cursor_y = 0;
+            break;
+        }
+        case 'L': // Insert lines
+        case 'M': // Delete lines
+            if (t->cursor_y < t->scroll_top || t->cursor_y > t->scroll_bot) break;
+            if (final == 'L') scroll_down(t, t->cursor_y, count);
+            else scroll_up(t, t->cursor_y, count);
+            t->cursor_x = 0;
+            break;
+        case 'S': // Scroll up
+            if (t->scroll_top == 0 && t->scroll_bot == t->rows - 1) {
+                for (int i = 0; i < count && i < t->rows; i++) term_scroll(t);
+            } else {
+                scroll_up(t, t->scroll_top, count);
+            }
+            break;
+        case 'T': scroll_down(t, t->scroll_top, count); break; // Scroll down
+        case '@': insert_chars(t, count); break;
+        case 'P': delete_chars(t, count); break;
+        case 'X': erase_chars(t, count); break;
+    }
+
+    if (t->cursor_x < 0) t->cursor_x = 0;
+    if (t->cursor_x >= t->cols) t->cursor_x = t->cols - 1;
+    if (t->cursor_y < 0) t->cursor_y = 0;
+    if (t->cursor_y >= t->rows) t->cursor_y = t->rows - 1;
+}
+
+void clear_screen(Term *t, int mode) {
+    switch(mode) {
+        case 0: // From cursor to end of screen
+            clear_line(t, 0);
+            for(int y = t->cursor_y + 1; y < t->rows; y++) {
+                clear_row(term_line(t, y), 0, t->cols);
+                t->dirty[y] = 1;
+            }
+            break;
+        case 1: // From cursor to beginning of screen
+            for(int y = 0; y < t->cursor_y; y++) {
+                clear_row(term_line(t, y), 0, t->cols);
+                t->dirty[y] = 1;
+            }
+            clear_line(t, 1);
+            break;
+        case 3: // Entire screen + scrollback
+            for (int y = -t->hist_len; y < 0; y++) {
+                int i = (t->top + y + t->line_cap) % t->line_cap;
+                pool_put(&t->pool, t->lines[i]);
+                t->lines[i] = NULL;
+            }
+            t->hist_len = 0;
+            t->hist_gen++;
+            if (!t->alt_screen) {
+                reflow_discard(t);
+                spill_clear(&t->spill);
+            }
+            // fall through
+        case 2: // Entire screen
+            for(int y = 0; y < t->rows; y++) {
+                clear_row(term_line(t, y), 0, t->cols);
+            }
+            term_dirty_all(t);
+            if (t->gfx) gfx_clear(t, mode == 3);
+            t->cursor_x = t->cursor_y = 0;
+            break;
+    }
+}
+
+void clear_line(Term *t, int mode) {
+    int start, end;
+    switch(mode) {
+        case 0: start = t->cursor_x; end = t->cols; break; // To end of line
+        case 1: start = 0; end = t->cursor_x + 1; break; // To beginning of line
+        case 2: start = 0; end = t->cols; break; // Entire line
+        default: return;
+    }
+    if (t->cursor_y < 0 || t->cursor_y >= t->rows) return;
+    if (start < 0) start = 0;
+    if (end > t->cols) end = t->cols;
+    clear_row(term_line(t, t->cursor_y), start, end);
+    t->dirty[t->cursor_y] = 1;
+}
+
+// Swaps the row pointers of screen rows a..b inclusive end for end.
+static void reverse_rows(Term *t, int a, int b) {
+    for (; a < b; a++, b--) {
+        int i = t->top + a, j = t->top + b;
+        if (i >= t->line_cap) i -= t->line_cap;
+        if (j >= t->line_cap) j -= t->line_cap;
+        Cell *tmp = t->lines[i];
+        t->lines[i] = t->lines[j];
+        t->lines[j] = tmp;
+    }
+}
+
+// Records that rows top..bot moved up by n (down if negative), taking
+// their dirty flags along; the rows they leave are dirty. A move that
+// doesn't add up with the pending one (another region or direction)
+// dirties the pending one's region instead.
+static void term_moved(Term *t, int top, int bot, int n) {
+    int h = bot - top + 1;
+    if (t->move_n && (t->move_top != top || t->move_bot != bot || (t->move_n > 0) != (n > 0))) {
+        memset(t->dirty + t->move_top, 1, t->move_bot - t->move_top + 1);
+        t->move_n = 0;
+    }
+    if (n >= h || n <= -h) {
+        memset(t->dirty + top, 1, h);
+    } else if (n > 0) {
+        memmove(t->dirty + top, t->dirty + top + n, h - n);
+        memset(t->dirty + bot - n + 1, 1, n);
+    } else {
+        memmove(t->dirty + top - n, t->dirty + top, h + n);
+        memset(t->dirty + top, 1, -n);
+    }
+    t->move_top = top;
+    t->move_bot = bot;
+    t->move_n += n;
+    if (t->move_n > h) t->move_n = h;
+    if (t->move_n < -h) t->move_n = -h;
+}
+
+// Scrolls screen rows top..scroll_bot up by n. The rows are rotated in
+// place by swapping pointers, and the n that fall off the top come back
+// cleared at the bottom; no cells are copied and nothing goes to history.
+void scroll_up(Term *t, int top, int n) {
+    int bot = t->scroll_bot;
+    if (n > bot - top + 1) n = bot - top + 1;
+    if (n <= 0) return;
+    if (n <= bot - top) {
+        reverse_rows(t, top, top + n - 1);
+        reverse_rows(t, top + n, bot);
+        reverse_rows(t, top, bot);
+    }
+    for (int y = bot - n + 1; y <= bot; y++) clear_row(term_line(t, y), 0, t->cols);
+    term_moved(t, top, bot, n);
+}
+
+// Scrolls screen rows top..scroll_bot down by n; the counterpart of
+// scroll_up.
+void scroll_down(Term *t, int top, int n) {
+    int bot = t->scroll_bot;
+    if (n > bot - top + 1) n = bot - top + 1;
+    if (n <= 0) return;
+    if (n <= bot - top) {
+        reverse_rows(t, top, bot - n);
+        reverse_rows(t, bot - n + 1, bot);
+        reverse_rows(t, top, bot);
+    }
+    for (int y = top; y < top + n; y++) clear_row(term_line(t, y), 0, t->cols);
+    term_moved(t, top, bot, -n);
+}
+
+// Column the character operations act on; a cursor waiting to wrap past
+// the last column acts on the last column.
+static int cursor_col(const Term *t) {
+    return t->cursor_x < t->cols ? t->cursor_x : t->cols - 1;
+}
+
+// Shifts the rest of the cursor line right by n, blanking n cells at the
+// cursor. A wide character split by the cursor or pushed half off the
+// edge is blanked.
+void insert_chars(Term *t, int n) {
+    int x = cursor_col(t);
+    if (n > t->cols - x) n = t->cols - x;
+    Cell *line = term_line(t, t->cursor_y);
+    unwide(line, x, x, t->cols);
+    int edge = t->cols - n;
+    if (edge > x && (line[edge].attr & ATTR_WDUMMY)) {
+        line[edge - 1].c = ' ';
+        line[edge - 1].attr &= ~ATTR_WIDE;
+    }
+    unsigned short wrap = line[t->cols - 1].attr & ATTR_WRAP;
+    memmove(line + x + n, line + x, (t->cols - x - n) * sizeof(Cell));
+    clear_row(line, x, x + n);
+    line[t->cols - 1].attr = (line[t->cols - 1].attr & ~ATTR_WRAP) | wrap;
+    t->dirty[t->cursor_y] = 1;
+}
+
+// Deletes n cells at the cursor, shifting the rest of the line left and
+// blanking the cells freed at its end.
+void delete_chars(Term *t, int n) {
+    int x = cursor_col(t);
+    if (n > t->cols - x) n = t->cols - x;
+    Cell *line = term_line(t, t->cursor_y);
+    unwide(line, x, x + n, t->cols);
+    unsigned short wrap = line[t->cols - 1].attr & ATTR_WRAP;
+    memmove(line + x, line + x + n, (t->cols - x - n) * sizeof(Cell));
+    clear_row(line, t->cols - n, t->cols);
+    if (t->cols - n - 1 >= x) line[t->cols - n - 1].attr &= ~ATTR_WRAP;
+    line[t->cols - 1].attr |= wrap;
+    t->dirty[t->cursor_y] = 1;
+}
+
+// Blanks n cells from the cursor on without moving anything.
+void erase_chars(Term *t, int n) {
+    int x = cursor_col(t);
+    if (n > t->cols - x) n = t->cols - x;
+    Cell *line = term_line(t, t->cursor_y);
+    unwide(line, x, x + n, t->cols);
+    clear_row(line, x, x + n);
+    t->dirty[t->cursor_y] = 1;
+}
+
+// Moves the screen down one line in the ring. The top line becomes
+// scrollback; the new bottom line is a fresh pool row, or the oldest
+// history line once the scrollback is full, which on the main screen is
+// spilled first.
+void term_scroll(Term *t) {
+    int slot = t->top + t->rows;
+    if (slot >= t->line_cap) slot -= t->line_cap;
+    if (!t->lines[slot]) {
+        t->lines[slot] = pool_get(&t->pool);
+        t->hist_len++;
+    } else if (!t->alt_screen) {
+        if (t->reflow.len) spill_pending(t);    // Older than the ring
+        spill_row(t, t->lines[slot], t->cols);
+    }
+    clear_row(t->lines[slot], 0, t->cols);
+    t->top = (t->top + 1 == t->line_cap) ? 0 : t->top + 1;
+    if (!t->alt_screen) t->line_seq++;
+    if (t->move_n > 0 && t->move_top == 0 && t->move_bot == t->rows - 1) {
+        // Output scrolling a line at a time adds to the pending move.
+        memmove(t->dirty, t->dirty + 1, t->rows - 1);
+        t->dirty[t->rows - 1] = 1;
+        if (t->move_n < t->rows) t->move_n++;
+    } else {
+        term_moved(t, 0, t->rows - 1, 1);
+    }
+    t->stats.scrolls++;
+}
+
+// Moves the cursor down a line, scrolling the region when it is on the
+// bottom margin. Below the region it stops at the last row.
+static void linefeed(Term *t) {
+    if (t->cursor_y == t->scroll_bot) {
+        if (t->scroll_top == 0 && t->scroll_bot == t->rows - 1) term_scroll(t);
+        else scroll_up(t, t->scroll_top, 1);
+    } else if (t->cursor_y < t->rows - 1) {
+        t->cursor_y++;
+    }
+}
+
+// Moves the cursor up a line, scrolling the region down when it is on the
+// top margin.
+static void reverse_linefeed(Term *t) {
+    if (t->cursor_y == t->scroll_top) scroll_down(t, t->scroll_top, 1);
+    else if (t->cursor_y > 0) t->cursor_y--;
+}
+
+// Writes one codepoint at the cursor, wrapping first if it doesn't fit.
+static void term_put(Term *t, uint32_t cp) {
+    if (cp >= 0x80 && cp < 0xa0) return; // C1 controls
+    int w = term_wcwidth(cp);
+    if (w == 0) return;                  // Combining marks are not stored
+    if (w > t->cols) w = 1;
+    if (t->cursor_x + w > t->cols) {
+        term_line(t, t->cursor_y)[t->cols - 1].attr |= ATTR_WRAP;
+        t->cursor_x = 0;
+        linefeed(t);
+    }
+    pen_update(t);
+    Cell *line = term_line(t, t->cursor_y);
+    int x = t->cursor_x;
+    unwide(line, x, x + w, t->cols);
+    line[x] = (Cell){cp, t->pen_style, 0};
+    if (w == 2) {
+        line[x].attr = ATTR_WIDE;
+        line[x + 1] = (Cell){0, t->pen_style, ATTR_WDUMMY};
+    }
+    t->dirty[t->cursor_y] = 1;
+    t->cursor_x += w;
+    t->stats.cells++;
+}
+
+// Feeds one byte >= 0x80 to the UTF-8 decoder. Malformed, overlong and
+// surrogate sequences come out as U+FFFD.
+static void utf8_byte(Term *t, char c) {
+    unsigned char b = c;
+    if (t->utf8_need > 0 && (b & 0xc0) == 0x80) {
+        t->utf8_cp = (t->utf8_cp << 6) | (b & 0x3f);
+        if (--t->utf8_need == 0) {
+            uint32_t cp = t->utf8_cp;
+            if (cp < t->utf8_min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) cp = 0xfffd;
+            term_put(t, cp);
+        }
+        return;
+    }
+    if (b >= 0xc2 && b <= 0xdf) {
+        t->utf8_cp = b & 0x1f; t->utf8_need = 1; t->utf8_min = 0x80;
+    } else if (b >= 0xe0 && b <= 0xef) {
+        t->utf8_cp = b & 0x0f; t->utf8_need = 2; t->utf8_min = 0x800;
+    } else if (b >= 0xf0 && b <= 0xf4) {
+        t->utf8_cp = b & 0x07; t->utf8_need = 3; t->utf8_min = 0x10000;
+    } else {
+        term_put(t, 0xfffd);
+    }
+}
+
+// C0 controls
+static void execute(Term *t, unsigned char c) {
+    switch (c) {
+        case '\n': linefeed(t); break;
+        case '\r': t->cursor_x = 0; break;
+        case '\b': if (t->cursor_x > 0) t->cursor_x--; break;
+        case '\t': t->cursor_x = (t->cursor_x + 8) & ~7; break;
+    }
+}
+
+// Digits accumulate into the current parameter; ';' and ':' start the
+// next one. An empty parameter reads as 0.
+static void param(Term *t, unsigned char c) {
+    if (t->nparams == 0) {
+        t->params[0] = 0;
+        t->nparams = 1;
+    }
+    if (t->nparams > VT_MAX_PARAMS) return;
+    if (c >= '0' && c <= '9') {
+        int *p = &t->params[t->nparams - 1];
+        *p = *p * 10 + (c - '0');
+        if (*p > VT_MAX_PARAM) *p = VT_MAX_PARAM;
+    } else if (t->nparams++ < VT_MAX_PARAMS) {
+        t->params[t->nparams - 1] = 0;
+        if (c == ':') t->param_sub |= 1u << (t->nparams - 1);
+    }
+}
+
+static void collect(Term *t, unsigned char c) {
+    if (c >= 0x3c) t->private_marker = c;
+    else if (t->nintermediates++ < (int)sizeof(t->intermediates)) t->intermediates[t->nintermediates - 1] = c;
+}
+
+static void esc_dispatch(Term *t, unsigned char c) {
+    if (t->nintermediates) return;
+    switch (c) {
+        case 'D': linefeed(t); break;                       // Index
+        case 'E': t->cursor_x = 0; linefeed(t); break;      // Next line
+        case 'M': reverse_linefeed(t); break;               // Reverse index
+        case '7': save_cursor(t); break;
+        case '8': restore_cursor(t); break;
+    }
+}
+
+// A complete graphics command. The cursor moves past an image placed at
+// it, as kitty does: down to the image's last row, then to the column
+// after it.
+static void apc_dispatch(Term *t) {
+    int cols, rows;
+    if (!gfx_apc_end(t, &cols, &rows)) return;
+    for (int i = 1; i < rows; i++) linefeed(t);
+    t->cursor_x = cursor_col(t) + cols;
+    if (t->cursor_x > t->cols) t->cursor_x = t->cols;
+}
+
+static void vt_clear(Term *t) {
+    t->nparams = 0;
+    t->param_sub = 0;
+    t->private_marker = 0;
+    t->nintermediates = 0;
+}
+
+// Everything but the per-byte actions, which vt_step handles inline.
+static void vt_action(Term *t, int action, unsigned char c) {
+    switch (action) {
+        case VA_CLEAR: vt_clear(t); break;
+        case VA_ESC_DISPATCH: if (t->nintermediates <= 2) esc_dispatch(t, c); break;
+        case VA_HOOK: case VA_PUT: case VA_UNHOOK: break; // No DCS sequences yet
+        case VA_OSC_START: t->osc_len = 0; break;
+        case VA_OSC_END: // Terminated by BEL or ESC, rather than cancelled
+            if (c == 0x07 || c == 0x1b) {
+                t->osc_buf[t->osc_len] = '\0';
+                osc_dispatch(t);
+            }
+            break;
+        case VA_APC_START: gfx_apc_start(t); break;
+        case VA_APC_END: // Terminated by ESC rather than cancelled
+            if (c == 0x1b) apc_dispatch(t);
+            else gfx_apc_cancel(t);
+            break;
+        default: break;
+    }
+}
+
+static void vt_transition(Term *t, unsigned e, unsigned char c) {
+    VtState next = e & VT_STATE_MASK;
+    int action = e >> VT_ACTION_SHIFT;
+    if (vt_exit_action[t->vt_state]) vt_action(t, vt_exit_action[t->vt_state], c);
+    switch (action) {
+        case VA_NONE: break;
+        case VA_EXECUTE: execute(t, c); break;
+        case VA_COLLECT: collect(t, c); break;
+        case VA_PARAM: param(t, c); break;
+        case VA_CSI_DISPATCH: if (t->nintermediates <= 2) csi_dispatch(t, c); break;
+        default: vt_action(t, action, c); break;
+    }
+    t->vt_state = next;
+    // Entering CSI_ENTRY, ESCAPE and DCS_ENTRY is by far the most common.
+    if (vt_entry_action[next] == VA_CLEAR) vt_clear(t);
+    else if (vt_entry_action[next]) vt_action(t, vt_entry_action[next], c);
+}
+
+static inline void vt_step(Term *t, unsigned char c) {
+    // A byte that can't continue a pending UTF-8 sequence ends it.
+    if (t->utf8_need > 0 && (c & 0xc0) != 0x80) {
+        t->utf8_need = 0;
+        term_put(t, 0xfffd);
+    }
+    unsigned e = vt_table[t->vt_state][c];
+    if (e & VT_TRANSITION) {
+        vt_transition(t, e, c);
+        return;
+    }
+    switch (e >> VT_ACTION_SHIFT) {
+        case VA_NONE: break;
+        case VA_PRINT: term_put(t, c); break;
+        case VA_UTF8: utf8_byte(t, c); break;
+        case VA_EXECUTE: execute(t, c); break;
+        case VA_COLLECT: collect(t, c); break;
+        case VA_PARAM: param(t, c); break;
+        case VA_OSC_PUT:
+            if (t->osc_len < (int)sizeof(t->osc_buf) - 1) t->osc_buf[t->osc_len++] = c;
+            break;
+        case VA_APC_PUT: gfx_apc_put(t, (const char *)&c, 1); break;
+        default: vt_action(t, e >> VT_ACTION_SHIFT, c); break;
+    }
+}
+
+void term_handle_char(Term *t, char c) {
+    vt_step(t, c);
+}
+
+// Length of the leading run of bytes that term_handle_char would print
+// as-is in VT_GROUND, i.e. everything that is >= 32 as a signed char
+// (0x20-0x7f). Stops at the first control, escape or high-bit byte.
+static size_t printable_run(const char *s, size_t n) {
+    size_t i = 0;
+#if !defined(XST_NO_SIMD) && defined(__AVX2__)
+    const __m256i lim32 = _mm256_set1_epi8(31);
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpgt_epi8(v, lim32));
+        if (mask != 0xffffffffu) return i + __builtin_ctz(~mask);
+    }
+#endif
+#if !defined(XST_NO_SIMD) && defined(__SSE2__)
+    const __m128i lim16 = _mm_set1_epi8(31);
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpgt_epi8(v, lim16));
+        if (mask != 0xffffu) return i + __builtin_ctz(~mask & 0xffffu);
+    }
+#endif
+    while (i < n && (signed char)s[i] >= 32) i++;
+    return i;
+}
+
+// Bulk equivalent of calling term_handle_char for each byte of a printable
+// run: wrap and scroll are handled once per row, and each row segment is
+// filled in a single pass.
+static void term_put_run(Term *t, const char *s, size_t n) {
+    pen_update(t);
+    const Cell tmpl = {0, t->pen_style, 0};
+    t->stats.cells += n;
+    while (n > 0) {
+        if (t->cursor_x >= t->cols) {
+            term_line(t, t->cursor_y)[t->cols - 1].attr |= ATTR_WRAP;
+            t->cursor_x = 0;
+            linefeed(t);
+        }
+        size_t space = t->cols - t->cursor_x;
+        size_t k = (n < space) ? n : space;
+        Cell *line = term_line(t, t->cursor_y);
+        Cell *dst = line + t->cursor_x;
+        unwide(line, t->cursor_x, t->cursor_x + k, t->cols);
+        t->dirty[t->cursor_y] = 1;
+        for (size_t i = 0; i < k; i++) {
+            dst[i] = tmpl;
+            dst[i].c = (unsigned char)s[i];
+        }
+        t->cursor_x += k;
+        s += k;
+        n -= k;
+    }
+}
+
+// Bulk equivalent of calling vt_step for each byte of a run of parameter
+// bytes in VT_CSI_ENTRY or VT_CSI_PARAM: the current parameter is
+// accumulated in a register and stored once per separator. Returns the
+// bytes consumed.
+static size_t param_run(Term *t, const unsigned char *s, size_t n) {
+    int np = t->nparams, cur = 0;
+    if (np == 0) np = 1;    // First parameter of the sequence
+    else cur = t->params[np - 1];
+    unsigned sub = t->param_sub;
+    size_t i = 0;
+    for (; i < n; i++) {
+        unsigned d = s[i] - '0';
+        if (d < 10) {
+            cur = cur * 10 + d;
+            if (cur > VT_MAX_PARAM) cur = VT_MAX_PARAM;
+            continue;
+        }
+        if (s[i] != ';' && s[i] != ':') break;
+        if (np <= VT_MAX_PARAMS) {
+            t->params[np - 1] = cur;
+            np++;
+            if (s[i] == ':' && np <= VT_MAX_PARAMS) sub |= 1u << (np - 1);
+        }
+        cur = 0;
+    }
+    if (np <= VT_MAX_PARAMS) t->params[np - 1] = cur;
+    if (i > 0) {
+        t->nparams = np;
+        t->param_sub = sub;
+        t->vt_state = VT_CSI_PARAM;
+    }
+    return i;
+}
+
+void term_write(Term *t, const char *buf, size_t len) {
+    t->stats.bytes += len;
+    size_t i = 0;
+    while (i < len) {
+        // The runs below stop at a byte they don't handle, which always
+        // goes through the state machine next. ESC [ straight out of a
+        // printable run is the same as stepping both bytes, minus the
+        // redundant clear on entering VT_ESCAPE.
+        if (t->vt_state == VT_GROUND && t->utf8_need == 0) {
+            size_t run = printable_run(buf + i, len - i);
+            if (run) term_put_run(t, buf + i, run);
+            i += run;
+            if (i + 1 < len && buf[i] == '\x1b' && buf[i + 1] == '[') {
+                vt_clear(t);
+                t->vt_state = VT_CSI_ENTRY;
+                i += 2;
+            }
+        }
+        if ((t->vt_state == VT_CSI_ENTRY || t->vt_state == VT_CSI_PARAM) && t->nparams <= VT_MAX_PARAMS) {
+            i += param_run(t, (const unsigned char *)buf + i, len - i);
+        }
+        // Image data is base64, so the same scan finds where it ends.
+        if (t->vt_state == VT_APC_STRING) {
+            size_t run = printable_run(buf + i, len - i);
+            if (run) gfx_apc_put(t, buf + i, run);
+            i += run;
+        }
+        if (i < len) vt_step(t, buf[i++]);
+    }
+}
@@ -0,0 +1,331 @@
+// term.h - Display-free terminal core: the cell grid and the VT parser.
+//
+// Nothing in here knows about X11, GLX or FreeType, so the core can be
+// driven headless (see bench.c) as well as from the xst front end.
+
+#ifndef XST_TERM_H
+#define XST_TERM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "spill.h"
+
+// Attribute flags. Bits 0-7 belong to a Style; ATTR_WIDE, ATTR_WDUMMY and
+// ATTR_WRAP are per cell and live in Cell.attr. ATTR_MATCH and
+// ATTR_MATCH_CUR are never set in a Term, only in the rows io.c hands to
+// the renderer, and ATTR_OVERLAY only in the stats overlay xst.c draws.
+#define ATTR_BOLD      (1 << 0)
+#define ATTR_FAINT     (1 << 1)
+#define ATTR_ITALIC    (1 << 2)
+#define ATTR_UNDERLINE (1 << 3)
+#define ATTR_BLINK     (1 << 4)
+#define ATTR_REVERSE   (1 << 5)
+#define ATTR_INVISIBLE (1 << 6)
+#define ATTR_STRUCK    (1 << 7)
+#define ATTR_WIDE      (1 << 8)    // First half of a double-width character
+#define ATTR_WDUMMY    (1 << 9)    // Second half; its c is 0
+#define ATTR_WRAP      (1 << 10)   // On a row's last cell: the line goes on in the next row
+#define ATTR_MATCH     (1 << 11)   // Part of a search match
+#define ATTR_MATCH_CUR (1 << 12)   // Part of the selected search match
+#define ATTR_OVERLAY   (1 << 13)   // Stats overlay text
+
+// Default number of scrollback lines kept in memory above the screen.
+// Older lines go to the compressed spill (spill.h).
+#define SCROLLBACK_LINES 10000
+
+// Rows are carved out of slabs of this many rows at a time
+#define ROW_POOL_SLAB 1024
+
+// Scrollback rows term_reflow handles per call
+#define REFLOW_STEP 2048
+
+// Colors are a palette index (0-255, DEFAULT_FG, DEFAULT_BG) or, with
+// COLOR_RGB set, 24-bit 0xRRGGBB.
+#define DEFAULT_FG  256
+#define DEFAULT_BG  257
+#define COLOR_RGB   (1u << 24)
+
+// Styles are interned: every distinct (attr, fg, bg) gets one id, and
+// cells refer to it by id. Id 0 is the default style. Ids no cell refers
+// to any more are reclaimed by a mark-and-sweep pass over the screens and
+// scrollback when the table fills up.
+#define STYLE_INIT  256         // Initial table size
+#define STYLE_MAX   65536       // Ids must fit a Cell's style field
+
+typedef struct {
+    uint32_t fg, bg;
+    unsigned short attr;    // ATTR_BOLD .. ATTR_STRUCK
+} Style;
+
+typedef struct {
+    Style *styles;          // cap entries, ids 0..len-1 handed out so far
+    unsigned char *used;    // Nonzero while an id is assigned
+    uint32_t *hash;         // Open addressing, 2 * cap slots of id + 1
+    unsigned short *free_ids;
+    int len, cap, nfree;
+    int gc_wait;            // Full table: misses to take before the next GC
+    unsigned version;       // Bumped whenever an id is (re)assigned
+} StyleTable;
+
+typedef struct {
+    uint32_t c;             // Unicode codepoint
+    unsigned short style;   // Style id
+    unsigned short attr;    // ATTR_WIDE, ATTR_WDUMMY
+} Cell;
+
+// Parser states, after Paul Williams' DEC-compatible state machine
+// (https://vt100.net/emu/dec_ansi_parser). The transition table for them
+// is generated at build time by mkparser.c.
+typedef enum {
+    VT_GROUND,
+    VT_ESCAPE,
+    VT_ESCAPE_INTERMEDIATE,
+    VT_CSI_ENTRY,
+    VT_CSI_PARAM,
+    VT_CSI_INTERMEDIATE,
+    VT_CSI_IGNORE,
+    VT_DCS_ENTRY,
+    VT_DCS_PARAM,
+    VT_DCS_INTERMEDIATE,
+    VT_DCS_PASSTHROUGH,
+    VT_DCS_IGNORE,
+    VT_OSC_STRING,
+    VT_SOS_PM_APC_STRING,   // SOS and PM, which are ignored
+    VT_APC_STRING,          // APC, for the graphics protocol (graphics.h)
+    VT_NSTATES
+} VtState;
+
+// What the parser does with a byte, besides changing state.
+typedef enum {
+    VA_NONE,
+    VA_PRINT,           // Printable ASCII in ground state
+    VA_UTF8,            // High byte in ground state, to the UTF-8 decoder
+    VA_EXECUTE,         // C0 control
+    VA_CLEAR,           // Forget params, intermediates and private marker
+    VA_COLLECT,         // Intermediate or private-marker byte
+    VA_PARAM,           // Digit, ';' or ':'
+    VA_ESC_DISPATCH,
+    VA_CSI_DISPATCH,
+    VA_HOOK,            // DCS final byte
+    VA_PUT,             // DCS data
+    VA_UNHOOK,
+    VA_OSC_START,
+    VA_OSC_PUT,
+    VA_OSC_END,
+    VA_APC_START,
+    VA_APC_PUT,
+    VA_APC_END,
+} VtAction;
+
+// Layout of a transition table entry
+#define VT_STATE_MASK   0x0f
+#define VT_TRANSITION   0x10        // Run exit/entry actions around the action
+#define VT_ACTION_SHIFT 5
+
+#define VT_MAX_PARAMS   16
+#define VT_MAX_PARAM    65535
+
+// Running counters, cheap enough to keep on in normal use.
+typedef struct {
+    unsigned long long bytes;   // Bytes fed to the parser
+    unsigned long long cells;   // Cells written by printable characters
+    unsigned long long scrolls; // Lines scrolled off the top
+} TermStats;
+
+// Where a Term's memory goes; see term_memory().
+typedef struct {
+    size_t rows;                // Row pools: screens, history and spare rows
+    size_t spill_ram;           // Spill index, block being filled and cache
+    long long spill_lines;      // Lines spilled and still held
+    unsigned long long spill_disk, spill_raw;  // Their compressed and raw size
+    size_t images;              // Pixels in the inline image store
+} TermMemory;
+
+// Fixed-width row allocator. Rows come from large slabs and go back on a
+// free list, so a long session reuses the same memory instead of churning
+// the heap one line at a time. Rows may be wider than the grid: the width
+// only grows, by half again each time, so resizing the window back and
+// forth reuses the same rows.
+typedef struct {
+    int width;              // Cells per row
+    Cell **free_rows;       // Stack of rows ready for reuse
+    int free_len, free_cap;
+    Cell **slabs;
+    int nslabs;
+} RowPool;
+
+typedef struct {
+    Cell **rows;
+    int len, cap;
+} RowList;
+
+typedef struct Term {
+    int cols, rows;
+
+    // Line ring. Screen row y lives in lines[(top + y) % line_cap]; the
+    // hist_len slots before `top` hold scrollback, newest last. All other
+    // slots are NULL. Scrolling only advances `top`.
+    Cell **lines;
+    int line_cap;           // scrollback + rows
+    int line_alloc;         // Slots allocated; grows, never shrinks
+    int top;
+    int hist_len;
+    int scrollback;         // Maximum hist_len
+    RowPool pool;
+
+    // The screen that is not showing: the alternate screen while the main
+    // one is up, or the main screen and its history while the alternate
+    // one is. Both are allocated up front from the same pool and resized
+    // together; switching swaps these fields with the ones above. The
+    // alternate screen has no scrollback.
+    struct {
+        Cell **lines;
+        int line_cap, line_alloc, top, hist_len, scrollback;
+    } other;
+    int alt_screen;         // The alternate screen is showing
+
+    // A width change reflows the main screen right away but leaves its
+    // scrollback here, still at reflow_cols, oldest row first. term_reflow
+    // moves it back in front of the history a few logical lines at a time.
+    // reflow_pool owns these rows if the ring has since moved to a pool of
+    // wider rows; otherwise they belong to `pool`.
+    RowList reflow;
+    int reflow_cols;
+    RowPool reflow_pool;
+    RowList reflow_out;     // Scratch for the rows being built
+
+    // Main-screen lines that fell off the end of the ring, oldest first,
+    // behind anything still pending reflow. They keep the width they had.
+    Spill spill;
+    unsigned char *spill_rec;   // Scratch for encoding a line
+    size_t spill_rec_cap;
+    Cell *spill_view;           // Scratch for decoding one
+    int spill_view_cap;
+
+    // Damage, one flag per screen row. Set by everything that changes what
+    // a screen row shows; the renderer clears a flag once it has picked the
+    // row up.
+    unsigned char *dirty;
+    int dirty_cap;
+
+    int cursor_x, cursor_y;
+
+    // Scrolling region (DECSTBM), screen rows scroll_top..scroll_bot
+    // inclusive. Only a full-screen region scrolls lines into history.
+    int scroll_top, scroll_bot;
+
+    // Cursor and attributes saved by DECSC, one slot per screen
+    struct {
+        int x, y;
+        unsigned short attr;
+        uint32_t fg, bg;
+    } saved_cursor[2];
+
+    // Escape sequence parser. Parameters are accumulated as their digits
+    // arrive; nparams > VT_MAX_PARAMS means there were too many and the
+    // extras are dropped. Bit i of param_sub is set when params[i] was
+    // introduced by ':' rather than ';', i.e. is a sub-parameter.
+    VtState vt_state;
+    int params[VT_MAX_PARAMS];
+    int nparams;
+    unsigned param_sub;
+    char private_marker;    // '<', '=', '>' or '?' leading the params, or 0
+    char intermediates[2];
+    int nintermediates;     // May exceed 2; such sequences are not dispatched
+    char osc_buf[512];
+    int osc_len;
+
+    // Incremental UTF-8 decoder; a sequence may span term_write calls.
+    uint32_t utf8_cp, utf8_min;
+    int utf8_need;
+
+    // Terminal state for new characters. pen_style is their interned
+    // style, looked up again on the next write when pen_stale is set.
+    unsigned short attr;
+    uint32_t fg, bg;
+    unsigned short pen_style;
+    int pen_stale;
+    StyleTable styles;
+
+    TermStats stats;
+
+    // Main-screen lines are numbered in the order they scroll into
+    // history: line y of the view is number line_seq + y, and keeps it
+    // while it moves up into the history and on to the spill. hist_gen
+    // changes whenever the numbering is redone (resize, ED 3, switching
+    // screens), so anything holding line numbers must start over.
+    long long line_seq;
+    unsigned hist_gen;
+    unsigned char *line_text;   // Scratch for term_line_text
+    size_t line_text_cap;
+
+    int bracketed_paste;        // Mode 2004: pastes come wrapped in ESC [200~ .. ESC [201~
+    int sync_update;            // Mode 2026: the program is in the middle of a screen update
+
+    // Scroll damage: since the dirty flags were last collected, screen
+    // rows move_top..move_bot have moved up by move_n rows (down if
+    // negative), and the dirty flags moved with them, so a clean row in
+    // there shows what a clean row move_n below it showed before. The
+    // renderer can shift what it has instead of redrawing. 0: no move.
+    int move_top, move_bot, move_n;
+
+    // Inline images (graphics.h), allocated on first use, and the cell
+    // size in pixels they are laid out with (0 until the front end says)
+    struct Graphics *gfx;
+    int cell_w, cell_h;
+
+    // Optional front-end hooks for OSC 2, for answering DECRQM and for
+    // other replies to the program (graphics protocol); NULL when running
+    // headless. `user` is the front end's, for the hooks to find their way
+    // back to it.
+    void (*set_title)(struct Term *t, const char *title);
+    void (*report_mode)(struct Term *t, int mode, int state);
+    void (*respond)(struct Term *t, const char *s, size_t len);
+    void *user;
+} Term;
+
+void die(const char *s);
+
+// Line y of the screen, or of the scrollback for -hist_len <= y < 0.
+static inline Cell *term_line(const Term *t, int y) {
+    int i = t->top + y;
+    if (i < 0) i += t->line_cap;
+    else if (i >= t->line_cap) i -= t->line_cap;
+    return t->lines[i];
+}
+
+// Scrollback lines that can be shown above the screen: the ring's history
+// and, on the main screen, the spill behind it once nothing is pending.
+static inline long long term_hist_lines(const Term *t) {
+    if (t->alt_screen || t->reflow.len) return t->hist_len;
+    return t->hist_len + spill_lines(&t->spill);
+}
+
+static inline void term_dirty_all(Term *t) {
+    for (int y = 0; y < t->rows; y++) t->dirty[y] = 1;
+    t->move_n = 0;
+}
+
+int term_wcwidth(uint32_t cp);
+void term_init(Term *t, int cols, int rows, int scrollback, size_t spill_max);
+void term_free(Term *t);
+const Cell *term_view_line(Term *t, long long y);
+const unsigned char *term_line_text(Term *t, long long y, size_t *len);
+void term_memory(const Term *t, TermMemory *m);
+void term_resize(Term *t, int cols, int rows);
+int term_reflow(Term *t, int budget);
+void term_write(Term *t, const char *buf, size_t len);
+void term_handle_char(Term *t, char c);
+void term_scroll(Term *t);
+void csi_dispatch(Term *t, char final);
+void osc_dispatch(Term *t);
+void clear_line(Term *t, int mode);
+void clear_screen(Term *t, int mode);
+void scroll_up(Term *t, int top, int n);
+void scroll_down(Term *t, int top, int n);
+void insert_chars(Term *t, int n);
+void delete_chars(Term *t, int n);
+void erase_chars(Term *t, int n);
+
+#endif
@@ -1,100 +1,149 @@
 // xst.c - A simple X11+OpenGL terminal.
 //
 // To compile:
-// gcc xst.c -o xst $(pkg-config --cflags --libs x11 gl freetype2) -lutil -lm
+// make
 //
 // To run:
 // ./xst
+// ./xst [--scrollback <lines>] [--scrollback-spill <MB>] [--renderer=gl33|legacy|shm] [--verbose]
+//       [--latency-log <file|->] [--latency-finish] [--startup-trace] [font_size]
+// ./xst --daemon [options] [font_size]   (one process for every window; xstc opens them)
+// ./xst --bench <file>   (headless parser benchmark, no X connection)
+// ./xst [--renderer=...] --bench-render <file>   (frame times drawing `cat file`)
 
 #define _XOPEN_SOURCE 600
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <pty.h>
-#include <fcntl.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <pthread.h>
 #include <errno.h>
 #include <limits.h>
-#include <sys/ioctl.h>
 #include <sys/types.h>
+#include <time.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/Xatom.h>
+#include <X11/keysym.h>
 #include <GL/gl.h>
 #include <GL/glx.h>
 
-#include <ft2build.h>
-#include FT_FREETYPE_H
+#include "term.h"
+#include "bench.h"
+#include "xst.h"
+#include "io.h"
+#include "stats.h"
 
-// --- Structs & Enums ---
+// --- Globals ---
+// Shared by every window: the X connection, the GL framebuffer config and
+// the atoms. Each window's own state is in its Win.
+Display *dpy;
+GLXFBConfig fbconfig;
+XVisualInfo *gl_visual;             // NULL: no GLX on this display
+Atom atom_clipboard, atom_utf8, atom_incr, atom_paste, atom_wm_delete;
+int verbose = 0;
+
+// Renderer damage state. full_damage forces every row to be resent to
+// the renderer (expose, resize); drawn_version holds the snapshot row
+// versions currently on screen, and drawn_cursor_* where the cursor is.
+//
+// The live terminal belongs to the IO thread (io.c) once it is opened;
+// this thread only draws the snapshots it publishes.
+struct Win {
+    Window xwin;
+    Colormap cmap;
+    GLXContext ctx;                 // NULL for a software renderer
+    const Renderer *renderer;
+    void *r;
+    int width, height;
+    Term term;
+    Io *io;
+    int closing;                    // WM_DELETE_WINDOW came
+    int geom_rows, geom_cols;
+    int full_damage;
+    unsigned long long *drawn_version;
+    int drawn_cursor_x, drawn_cursor_y;
+    unsigned drawn_style_version;
+    int styles_synced;
+    unsigned drawn_title_version, drawn_search_version;
+    int drawn_move_top, drawn_move_bot;
+    long long drawn_move_seq;
+    // The image placements on screen, as of the last frame; only
+    // compared, their pixels may be gone.
+    GfxView *drawn_images;
+    int ndrawn_images, drawn_images_cap;
+    int redraw, searching;
+    long long next_frame;
+    // Latency and the stats overlay (stats.c). The overlay sits in the
+    // top right corner, patched into copies of the rows under it;
+    // Ctrl+Shift+S toggles it.
+    unsigned last_probe_id;
+    int overlay_on, overlay_dirty;
+    long long overlay_due;
+    Overlay overlay;
+    Cell *overlay_row;
+    // A paste coming in; see paste_request.
+    char *paste_buf;
+    size_t paste_len, paste_cap;
+    int paste_incr;
+    long long t0, bench_t0;         // Opened; --bench-render started
+    int startup_frames;             // 1 once the first frame is out, 2 once the first prompt is
+};
 
-// Attribute flags
-#define ATTR_BOLD      (1 << 0)
-#define ATTR_FAINT     (1 << 1)
-#define ATTR_ITALIC    (1 << 2)
-#define ATTR_UNDERLINE (1 << 3)
-#define ATTR_BLINK     (1 << 4)
-#define ATTR_REVERSE   (1 << 5)
-#define ATTR_INVISIBLE (1 << 6)
-#define ATTR_STRUCK    (1 << 7)
+static Win **wins;
+static int nwins, wins_cap;
+static Win *current;                // Whose context is current
 
-// Color definitions (indices into the palette)
-#define DEFAULT_FG  256
-#define DEFAULT_BG  257
+// Atlas changes not yet uploaded to each renderer's windows. The GL
+// renderers' windows share one atlas texture per renderer, so a change
+// goes up once, with whichever of them draws next.
+static const Renderer *const renderers[] = { &render_gl33, &render_legacy, &render_shm };
+static AtlasDamage atlas_pending[3];
+unsigned long long frames_drawn = 0, frames_skipped = 0, frames_scrolled = 0;
 
+// The event loop sleeps in epoll_wait on the X connection, the IO
+// thread's wake fd, a timerfd armed only while a frame is being held back,
+// a signalfd for SIGUSR1, which prints the counters below, and whatever
+// else is watched with loop_watch.
+#define MAX_WATCHES 64
 typedef struct {
-    float r, g, b;
-} Color;
+    int fd;
+    void (*fn)(int fd);
+} Watch;
+static Watch watches[MAX_WATCHES];
+static int nwatches;
+static int loop_ep = -1, frame_timer = -1, loop_done;
+static long long timer_at;
+int sig_fd = -1;
+unsigned long long wakeups = 0, timer_wakeups = 0;
 
-typedef struct {
-    float ax; float ay; float bw; float bh;
-    float bl; float bt; float tx;
-} Glyph;
+const char *latency_log;            // --latency-log: where the report goes on exit
+int latency_finish;                 // --latency-finish: glFinish after each swap
+const char *bench_render;           // --bench-render: run `cat file`, report frame times
+
+// Startup runs in parallel: the shell is spawned and its output parsed
+// at a guessed size while the font loads on a worker thread and the
+// window and GL context are set up here; win_resize then brings the pty
+// to the real size. --startup-trace prints how long each phase took.
+// Monospace advances are close to STARTUP_EM_W of the font size.
+#define STARTUP_EM_W 0.6f
+int startup_trace;
+long long startup_t0;
 
 typedef struct {
-    char c;                 // Character code
-    unsigned short attr;    // Attribute flags
-    unsigned short fg;      // Foreground color index
-    unsigned short bg;      // Background color index
-} Cell;
-
-typedef enum {
-    STATE_NORMAL,
-    STATE_ESC,
-    STATE_CSI,
-    STATE_OSC,
-} AnsiState;
+    const char *path;
+    int size;
+    long long start, end;
+    pthread_t thread;
+} FontJob;
 
-// --- Globals ---
-Display *dpy;
-Window win;
-GLXContext ctx;
-int pty_master_fd;
-
-int COLS = 80, ROWS = 24;
-int win_width = 800, win_height = 600;
-Cell *grid = NULL;
-
-int cursor_x = 0, cursor_y = 0;
-
-FT_Library ft_lib;
-FT_Face ft_face;
-Glyph glyphs[128];
-GLuint font_texture;
-int font_atlas_w, font_atlas_h;
-float char_w, char_h;
-
-AnsiState ansi_state = STATE_NORMAL;
-char csi_buf[256];
-int csi_len = 0;
-char osc_buf[512];
-int osc_len = 0;
-
-// Terminal state for new characters
-unsigned short term_attr = 0;
-unsigned short term_fg = DEFAULT_FG;
-unsigned short term_bg = DEFAULT_BG;
+static FontJob *font_job;           // Loading on the worker thread until font_wait
 
 // xterm 256 color palette
 const Color color_palette[258] = {
@@ -149,493 +198,972 @@ const Color color_palette[258] = {
     [DEFAULT_BG] = {0.1f, 0.1f, 0.1f},
 };
 
-// --- Function Prototypes ---
-void die(const char *s);
-void x11_init();
-void gl_init();
-void font_init(const char* font_path, int font_size);
-void pty_init();
-void main_loop();
-void term_draw();
-void term_handle_char(char c);
-void term_scroll();
-void term_resize(int w, int h);
-void csi_dispatch();
-void osc_dispatch();
-void clear_line(int mode);
-void clear_screen(int mode);
+// Search highlights: text, match background, selected match background
+const Color search_colors[3] = {
+    {0.0f, 0.0f, 0.0f},
+    {0.80f, 0.70f, 0.20f},
+    {1.00f, 0.50f, 0.10f},
+};
+
+// Stats overlay: text, background
+const Color overlay_colors[2] = {
+    {0.60f, 1.00f, 0.60f},
+    {0.00f, 0.00f, 0.00f},
+};
+
+static Color style_color(uint32_t c) {
+    if (!(c & COLOR_RGB)) return color_palette[c];
+    return (Color){ ((c >> 16) & 0xff) / 255.0f, ((c >> 8) & 0xff) / 255.0f, (c & 0xff) / 255.0f };
+}
+
+// Resolves a style to the colors it is drawn with: reverse video, bold
+// brightening of the first 8 palette colors and 24-bit RGB. Returns 0 if
+// the background is the default one.
+int style_colors(const Style *s, Color *fg, Color *bg) {
+    uint32_t f = (s->attr & ATTR_REVERSE) ? s->bg : s->fg;
+    uint32_t b = (s->attr & ATTR_REVERSE) ? s->fg : s->bg;
+    if ((s->attr & ATTR_BOLD) && f < 8) f += 8;
+    *fg = style_color(f);
+    *bg = style_color(b);
+    return b != DEFAULT_BG;
+}
 
 // --- Implementation ---
 
-void die(const char *s) {
-    perror(s);
-    exit(1);
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// One --startup-trace line: a phase of w's startup that ran from `start`
+// until now.
+static void trace(const Win *w, const char *phase, long long start) {
+    if (!startup_trace) return;
+    long long now = now_ns();
+    fprintf(stderr, "xst: startup: %-14s %8.2f ms, done at %8.2f ms\n", phase,
+            (now - start) / 1e6, (now - w->t0) / 1e6);
 }
 
-void osc_dispatch() {
-    // Only handling window title (OSC 2) for now
-    if (osc_len > 2 && osc_buf[0] == '2' && osc_buf[1] == ';') {
-        XStoreName(dpy, win, &osc_buf[2]);
+// Makes w's context current, for its renderer's calls.
+static void win_current(Win *w) {
+    if (w == current) return;
+    if (w->ctx) glXMakeCurrent(dpy, w->xwin, w->ctx);
+    current = w;
+}
+
+static AtlasDamage *atlas_pending_for(const Renderer *r) {
+    for (int i = 0; i < 3; i++) {
+        if (renderers[i] == r) return &atlas_pending[i];
     }
+    return NULL;
 }
 
-void csi_dispatch() {
-    char *p = csi_buf;
-    char cmd = csi_buf[csi_len - 1];
-    csi_buf[csi_len - 1] = '\0';
+static void span_merge(int *a0, int *a1, int b0, int b1) {
+    if (b1 <= b0) return;
+    if (*a1 <= *a0) { *a0 = b0; *a1 = b1; return; }
+    if (b0 < *a0) *a0 = b0;
+    if (b1 > *a1) *a1 = b1;
+}
 
-    int params[16] = {0};
-    int num_params = 0;
-    if (csi_len > 1) { // if there are any parameters
-        char *tok = strtok(p, ";");
-        while (tok && num_params < 16) {
-            params[num_params++] = atoi(tok);
-            tok = strtok(NULL, ";");
-        }
+// Adds the glyph cache's new changes to what every renderer in use has
+// yet to upload.
+static void atlas_collect() {
+    AtlasDamage d;
+    if (!glyph_damage(&d)) return;
+    for (int i = 0; i < 3; i++) {
+        int used = 0;
+        for (int k = 0; k < nwins && !used; k++) used = wins[k]->renderer == renderers[i];
+        if (!used) continue;
+        AtlasDamage *p = &atlas_pending[i];
+        p->resized |= d.resized;
+        span_merge(&p->y0, &p->y1, d.y0, d.y1);
+        span_merge(&p->slot0, &p->slot1, d.slot0, d.slot1);
     }
+}
 
-    switch (cmd) {
-        case 'H': // Set cursor position
-        case 'f': {
-            int r = (num_params > 0 && params[0] > 0) ? params[0] - 1 : 0;
-            int c = (num_params > 1 && params[1] > 0) ? params[1] - 1 : 0;
-            cursor_y = r;
-            cursor_x = c;
-            break;
+// The grid itself is resized on the IO thread; the next snapshot comes
+// back with the new size.
+static void win_resize(Win *w, int width, int height) {
+    w->width = width; w->height = height;
+    win_current(w);
+    w->renderer->viewport(w->r, width, height);
+    int cols = width / char_w, rows = height / char_h;
+    IoEvent ev = { .type = IO_RESIZE, .a = cols > 0 ? cols : 1, .b = rows > 0 ? rows : 1, .w = width, .h = height };
+    io_send(w->io, &ev);
+}
+
+static int ctx_error = 0;
+
+static int ctx_error_handler(Display *d, XErrorEvent *ev) {
+    (void)d; (void)ev;
+    ctx_error = 1;
+    return 0;
+}
+
+// Asks for a GL 3.3 core context sharing objects with `share`; returns
+// NULL (without dying on the X error some drivers raise) if the server
+// can't provide one.
+static GLXContext create_core_context(GLXContext share) {
+    typedef GLXContext (*CreateContextAttribs)(Display *, GLXFBConfig, GLXContext, Bool, const int *);
+    CreateContextAttribs create = (CreateContextAttribs)
+        glXGetProcAddress((const GLubyte *)"glXCreateContextAttribsARB");
+    if (!create) return NULL;
+    int attribs[] = {
+        GLX_CONTEXT_MAJOR_VERSION_ARB, 3,
+        GLX_CONTEXT_MINOR_VERSION_ARB, 3,
+        GLX_CONTEXT_PROFILE_MASK_ARB, GLX_CONTEXT_CORE_PROFILE_BIT_ARB,
+        None
+    };
+    ctx_error = 0;
+    int (*old_handler)(Display *, XErrorEvent *) = XSetErrorHandler(ctx_error_handler);
+    GLXContext c = create(dpy, fbconfig, share, True, attribs);
+    XSync(dpy, False);
+    XSetErrorHandler(old_handler);
+    if (ctx_error && c) {
+        glXDestroyContext(dpy, c);
+        c = NULL;
+    }
+    return c;
+}
+
+// Connects to the X server (name NULL: $DISPLAY) and finds the GLX
+// framebuffer config every GL window uses. Once open, the display stays
+// for good; asking for another one is an error.
+int display_open(const char *name, char *err, size_t n) {
+    if (dpy) {
+        if (!name || strcmp(name, DisplayString(dpy)) == 0) return 1;
+        snprintf(err, n, "already on display %s", DisplayString(dpy));
+        return 0;
+    }
+    dpy = XOpenDisplay(name);
+    if (!dpy) {
+        snprintf(err, n, "cannot connect to X server %s", XDisplayName(name));
+        return 0;
+    }
+    int att[] = {
+        GLX_X_RENDERABLE, True,
+        GLX_DRAWABLE_TYPE, GLX_WINDOW_BIT,
+        GLX_RENDER_TYPE, GLX_RGBA_BIT,
+        GLX_DEPTH_SIZE, 24,
+        GLX_DOUBLEBUFFER, True,
+        None
+    };
+    if (glXQueryExtension(dpy, NULL, NULL)) {
+        int nconfigs;
+        GLXFBConfig *configs = glXChooseFBConfig(dpy, DefaultScreen(dpy), att, &nconfigs);
+        if (configs && nconfigs > 0) {
+            fbconfig = configs[0];
+            gl_visual = glXGetVisualFromFBConfig(dpy, fbconfig);
         }
-        case 'A': cursor_y -= (num_params > 0 && params[0] > 0) ? params[0] : 1; break; // Up
-        case 'B': cursor_y += (num_params > 0 && params[0] > 0) ? params[0] : 1; break; // Down
-        case 'C': cursor_x += (num_params > 0 && params[0] > 0) ? params[0] : 1; break; // Forward
-        case 'D': cursor_x -= (num_params > 0 && params[0] > 0) ? params[0] : 1; break; // Backward
-        case 'J': clear_screen((num_params > 0) ? params[0] : 0); break;
-        case 'K': clear_line((num_params > 0) ? params[0] : 0); break;
-        case 'm': { // Select Graphic Rendition (SGR)
-            if (num_params == 0) { // ESC[m is same as ESC[0m
-                params[0] = 0;
-                num_params = 1;
-            }
-            int i = 0;
-            while (i < num_params) {
-                int p = params[i];
-                switch (p) {
-                    case 0: term_attr = 0; term_fg = DEFAULT_FG; term_bg = DEFAULT_BG; break;
-                    case 1: term_attr |= ATTR_BOLD; break;
-                    case 2: term_attr |= ATTR_FAINT; break;
-                    case 3: term_attr |= ATTR_ITALIC; break;
-                    case 4: term_attr |= ATTR_UNDERLINE; break;
-                    case 5: term_attr |= ATTR_BLINK; break;
-                    case 7: term_attr |= ATTR_REVERSE; break;
-                    case 8: term_attr |= ATTR_INVISIBLE; break;
-                    case 9: term_attr |= ATTR_STRUCK; break;
-                    case 22: term_attr &= ~(ATTR_BOLD | ATTR_FAINT); break;
-                    case 23: term_attr &= ~ATTR_ITALIC; break;
-                    case 24: term_attr &= ~ATTR_UNDERLINE; break;
-                    case 25: term_attr &= ~ATTR_BLINK; break;
-                    case 27: term_attr &= ~ATTR_REVERSE; break;
-                    case 28: term_attr &= ~ATTR_INVISIBLE; break;
-                    case 29: term_attr &= ~ATTR_STRUCK; break;
-                    case 39: term_fg = DEFAULT_FG; break;
-                    case 49: term_bg = DEFAULT_BG; break;
-                    case 38: // FG 256 color
-                        if (i + 2 < num_params && params[i+1] == 5) {
-                            term_fg = params[i+2] & 0xFF;
-                            i += 2;
-                        }
-                        break;
-                    case 48: // BG 256 color
-                        if (i + 2 < num_params && params[i+1] == 5) {
-                            term_bg = params[i+2] & 0xFF;
-                            i += 2;
-                        }
-                        break;
-                    default:
-                        if (p >= 30 && p <= 37) term_fg = p - 30;
-                        else if (p >= 40 && p <= 47) term_bg = p - 40;
-                        else if (p >= 90 && p <= 97) term_fg = p - 90 + 8;
-                        else if (p >= 100 && p <= 107) term_bg = p - 100 + 8;
-                        break;
-                }
-                i++;
-            }
-            break;
+        if (configs) XFree(configs);
+    }
+    atom_clipboard = XInternAtom(dpy, "CLIPBOARD", False);
+    atom_utf8 = XInternAtom(dpy, "UTF8_STRING", False);
+    atom_incr = XInternAtom(dpy, "INCR", False);
+    atom_paste = XInternAtom(dpy, "XST_PASTE", False);
+    atom_wm_delete = XInternAtom(dpy, "WM_DELETE_WINDOW", False);
+    loop_watch(ConnectionNumber(dpy), NULL);
+    return 1;
+}
+
+static void x11_window(Win *w) {
+    if (!w->renderer->software && !gl_visual) {
+        fprintf(stderr, "xst: no GLX visual, using shm renderer\n");
+        w->renderer = &render_shm;
+    }
+    XVisualInfo *vi = w->renderer->software ? NULL : gl_visual;
+    Window root = DefaultRootWindow(dpy);
+    Visual *visual = vi ? vi->visual : DefaultVisual(dpy, DefaultScreen(dpy));
+    int depth = vi ? vi->depth : DefaultDepth(dpy, DefaultScreen(dpy));
+    w->cmap = XCreateColormap(dpy, root, visual, AllocNone);
+    XSetWindowAttributes swa;
+    swa.colormap = w->cmap;
+    swa.event_mask = ExposureMask | KeyPressMask | ButtonPressMask | StructureNotifyMask | PropertyChangeMask;
+    w->xwin = XCreateWindow(dpy, root, 0, 0, w->width, w->height, 0, depth, InputOutput, visual,
+                            CWColormap | CWEventMask, &swa);
+    XMapWindow(dpy, w->xwin);
+    XStoreName(dpy, w->xwin, "xst");
+    XSetWMProtocols(dpy, w->xwin, &atom_wm_delete, 1);
+}
+
+// True if GL is drawn by the CPU (Mesa's llvmpipe and softpipe, swrast,
+// OpenSWR); the shm renderer does less work for the same pixels.
+static int gl_software() {
+    const char *r = (const char *)glGetString(GL_RENDERER);
+    return r && (strstr(r, "llvmpipe") || strstr(r, "softpipe") || strstr(r, "Software Rasterizer") ||
+                 strstr(r, "SWR"));
+}
+
+// A context to share objects with: any other window's of the same
+// renderer.
+static GLXContext share_context(const Renderer *r) {
+    for (int i = 0; i < nwins; i++) {
+        if (wins[i]->renderer == r && wins[i]->ctx) return wins[i]->ctx;
+    }
+    return NULL;
+}
+
+static void gl_drop(Win *w) {
+    glXMakeCurrent(dpy, None, NULL);
+    glXDestroyContext(dpy, w->ctx);
+    w->ctx = NULL;
+    current = NULL;
+}
+
+// Initializes w's renderer, the first of its kind getting the whole atlas.
+static int renderer_init(Win *w) {
+    int first = 1;
+    for (int i = 0; first && i < nwins; i++) first = wins[i]->renderer != w->renderer;
+    w->r = w->renderer->init(w->xwin);
+    if (!w->r) return 0;
+    if (first) *atlas_pending_for(w->renderer) = (AtlasDamage){ 1, 0, 0, 0, GLYPH_SLOTS };
+    return 1;
+}
+
+// Creates the GL context for the requested renderer, in the share group
+// of the other windows using it. The GL 3.3 path falls back to the
+// fixed-function renderer when the driver can't create a core context or
+// compile the shaders. Unless a renderer was asked for, a software GL is
+// dropped for the shm renderer. Returns 0 if no renderer would do.
+static int gl_init(Win *w, int forced) {
+    current = NULL;
+    if (w->renderer->software) return renderer_init(w);
+    if (w->renderer == &render_gl33) {
+        w->ctx = create_core_context(share_context(w->renderer));
+        if (w->ctx) {
+            glXMakeCurrent(dpy, w->xwin, w->ctx);
+            current = w;
+            if (renderer_init(w)) goto check;
+            gl_drop(w);
         }
+        fprintf(stderr, "xst: GL 3.3 renderer unavailable, using legacy renderer\n");
+        w->renderer = &render_legacy;
+    }
+    w->ctx = glXCreateNewContext(dpy, fbconfig, GLX_RGBA_TYPE, share_context(w->renderer), True);
+    if (!w->ctx) return 0;
+    glXMakeCurrent(dpy, w->xwin, w->ctx);
+    current = w;
+    if (!renderer_init(w)) {
+        gl_drop(w);
+        return 0;
     }
+check:
+    if (forced || !gl_software()) return 1;
+    fprintf(stderr, "xst: GL renderer is %s, using shm renderer\n", (const char *)glGetString(GL_RENDERER));
+    w->renderer->cleanup(w->r);
+    gl_drop(w);
+    w->renderer = &render_shm;
+    return renderer_init(w);
+}
 
-    if (cursor_x < 0) cursor_x = 0;
-    if (cursor_x >= COLS) cursor_x = COLS - 1;
-    if (cursor_y < 0) cursor_y = 0;
-    if (cursor_y >= ROWS) cursor_y = ROWS - 1;
+// Row y with the overlay text over its right end.
+static const Cell *overlay_patch(Win *w, int y, const Cell *line, int cols) {
+    int x0 = cols > OVERLAY_COLS ? cols - OVERLAY_COLS : 0;
+    memcpy(w->overlay_row, line, cols * sizeof(*line));
+    if (x0 > 0 && (w->overlay_row[x0 - 1].attr & ATTR_WIDE)) w->overlay_row[x0 - 1] = (Cell){ ' ', 0, 0 };
+    const char *s = w->overlay.text[y];
+    for (int x = x0; x < cols; x++) {
+        w->overlay_row[x] = (Cell){ *s ? (unsigned char)*s : ' ', 0, ATTR_OVERLAY };
+        if (*s) s++;
+    }
+    return w->overlay_row;
 }
 
-void clear_screen(int mode) {
-    Cell empty = {' ', 0, DEFAULT_FG, DEFAULT_BG};
-    switch(mode) {
-        case 0: // From cursor to end of screen
-            clear_line(0);
-            for(int y = cursor_y + 1; y < ROWS; y++) {
-                for (int x = 0; x < COLS; x++) grid[y * COLS + x] = empty;
-            }
-            break;
-        case 1: // From cursor to beginning of screen
-            for(int y = 0; y < cursor_y; y++) {
-                for (int x = 0; x < COLS; x++) grid[y * COLS + x] = empty;
-            }
-            clear_line(1);
-            break;
-        case 2: // Entire screen
-        case 3: // Entire screen + scrollback (not implemented)
-            for(int i = 0; i < ROWS * COLS; i++) grid[i] = empty;
-            cursor_x = cursor_y = 0;
-            break;
-    }
-}
-
-void clear_line(int mode) {
-    int start, end;
-    Cell empty = {' ', 0, DEFAULT_FG, DEFAULT_BG};
-    switch(mode) {
-        case 0: start = cursor_x; end = COLS; break; // To end of line
-        case 1: start = 0; end = cursor_x + 1; break; // To beginning of line
-        case 2: start = 0; end = COLS; break; // Entire line
-        default: return;
-    }
-    for(int x = start; x < end; x++) {
-        if (cursor_y >= 0 && cursor_y < ROWS && x >= 0 && x < COLS) {
-            grid[cursor_y * COLS + x] = empty;
+// Rows y..y+n-1, as far as they are on screen, are drawn again.
+static void damage_rows(Win *w, int y, int n) {
+    for (int r = y > 0 ? y : 0; r < y + n && r < w->geom_rows; r++) w->drawn_version[r] = 0;
+}
+
+// Images moved by a scroll of rows top..bot by n: those entirely in the
+// region went with it; any other one it touched is drawn again, in both
+// places.
+static void scroll_images(Win *w, int top, int bot, int n) {
+    int rows = w->geom_rows;
+    for (int i = 0; i < w->ndrawn_images; i++) {
+        GfxView *v = &w->drawn_images[i];
+        int y0 = v->y > 0 ? v->y : 0, y1 = v->y + v->rows < rows ? v->y + v->rows : rows;
+        if (y1 <= top || y0 > bot) continue;
+        int moved0 = y0 - n > 0 ? y0 - n : 0, moved1 = y1 - n < rows ? y1 - n : rows;
+        if (y0 >= top && y1 <= bot + 1 && (moved0 >= top || top == 0) && (moved1 <= bot + 1 || bot == rows - 1)) {
+            v->y -= n;
+            continue;
         }
+        damage_rows(w, v->y, v->rows);
+        damage_rows(w, v->y - n, v->rows);
+        v->serial = 0;
+    }
+}
+
+// Rows under images that came, went or changed since the last frame are
+// drawn again, and so are all images' rows while one is still uploading.
+static void image_damage(Win *w, const Snapshot *snap) {
+    int same = snap->nimages == w->ndrawn_images && !image_uploads_pending;
+    for (int i = 0; same && i < w->ndrawn_images; i++) {
+        same = !memcmp(&w->drawn_images[i].serial, &snap->images[i].serial, sizeof(GfxView) - offsetof(GfxView, serial));
+    }
+    if (same) return;
+    for (int i = 0; i < w->ndrawn_images; i++) damage_rows(w, w->drawn_images[i].y, w->drawn_images[i].rows);
+    for (int i = 0; i < snap->nimages; i++) damage_rows(w, snap->images[i].y, snap->images[i].rows);
+    if (snap->nimages > w->drawn_images_cap) {
+        w->drawn_images_cap = snap->nimages;
+        w->drawn_images = realloc(w->drawn_images, w->drawn_images_cap * sizeof(*w->drawn_images));
+        if (!w->drawn_images) die("malloc failed for drawn images");
     }
+    memcpy(w->drawn_images, snap->images, snap->nimages * sizeof(*w->drawn_images));
+    w->ndrawn_images = snap->nimages;
 }
 
-void term_resize(int w, int h) {
-    win_width = w; win_height = h;
-    int new_cols = win_width / char_w;
-    int new_rows = win_height / char_h;
-    if (new_cols < 1) new_cols = 1;
-    if (new_rows < 1) new_rows = 1;
+// Shifts what is on screen along with rows that moved since the last
+// frame (see Snapshot.move_seq), so they don't have to be sent and drawn
+// again. Only rows whose version turns up where the move says it came
+// from count; everything else stays damaged.
+static void scroll_rows(Win *w, const Snapshot *snap) {
+    int top = snap->move_top, bot = snap->move_bot;
+    long long k = snap->move_seq - w->drawn_move_seq;
+    int same = top == w->drawn_move_top && bot == w->drawn_move_bot;
+    w->drawn_move_top = top;
+    w->drawn_move_bot = bot;
+    w->drawn_move_seq = snap->move_seq;
+    if (!w->renderer->scroll || w->full_damage || !same || k == 0 || k > bot - top || -k > bot - top) return;
+    int n = k, hits = 0;
+    for (int y = top; y <= bot; y++) {
+        int from = y + n;
+        if (from >= top && from <= bot && snap->row_version[y] != w->drawn_version[y] &&
+            snap->row_version[y] == w->drawn_version[from]) hits++;
+    }
+    if (!hits) return;
+    w->renderer->scroll(w->r, top, bot, n);
+    // The overlay doesn't move; rows it covered came along blank.
+    int y0 = n > 0 ? top : bot, step = n > 0 ? 1 : -1;
+    for (int y = y0; y >= top && y <= bot; y += step) {
+        int from = y + n;
+        int valid = from >= top && from <= bot && !(w->overlay_on && from < OVERLAY_ROWS);
+        w->drawn_version[y] = valid ? w->drawn_version[from] : 0;
+    }
+    scroll_images(w, top, bot, n);
+    if (w->overlay_on) w->overlay_dirty = 1;
+    frames_scrolled++;
+}
 
-    if (new_cols == COLS && new_rows == ROWS) return;
+// Draws a snapshot if anything on screen changed, handing the renderer
+// only the rows whose version moved since the last frame. Returns 1 if it
+// drew.
+static int term_draw(Win *w, const Snapshot *snap) {
+    if (snap->rows <= 0 || snap->cols <= 0) return 0;
+    long long start = now_ns();
+    const Renderer *renderer = w->renderer;
+    win_current(w);
+    if (w->geom_rows != snap->rows || w->geom_cols != snap->cols) {
+        renderer->grid_resize(w->r, snap->rows, snap->cols);
+        free(w->drawn_version);
+        w->drawn_version = calloc(snap->rows, sizeof(*w->drawn_version));
+        free(w->overlay_row);
+        w->overlay_row = malloc(snap->cols * sizeof(*w->overlay_row));
+        if (!w->drawn_version || !w->overlay_row) die("malloc failed for row versions");
+        w->geom_rows = snap->rows; w->geom_cols = snap->cols;
+        w->full_damage = 1;
+    }
+    scroll_rows(w, snap);
+    if (renderer->images) {
+        image_damage(w, snap);
+        renderer->images(w->r, snap->images, snap->nimages);
+    }
+
+    int damaged = w->full_damage || snap->cursor_x != w->drawn_cursor_x || snap->cursor_y != w->drawn_cursor_y;
+    // Styles first: the rows below may refer to ids that are new or were
+    // reassigned since the last frame.
+    if (!w->styles_synced || snap->style_version != w->drawn_style_version) {
+        renderer->sync_styles(w->r, snap->styles, snap->nstyles);
+        w->drawn_style_version = snap->style_version;
+        w->styles_synced = 1;
+    }
+    // Resolving rows can make the glyph cache evict slots or grow the
+    // atlas, which stales rows already on the GPU, this window's and the
+    // others'; resolve everything again when that happens.
+    glyph_frame();
+    int moved = 0;
+    for (int pass = 0; pass < 3; pass++) {
+        glyphs_moved = 0;
+        for (int y = 0; y < snap->rows; y++) {
+            int over = w->overlay_on && y < OVERLAY_ROWS;
+            if (!w->full_damage && snap->row_version[y] == w->drawn_version[y] && !(over && w->overlay_dirty)) continue;
+            const Cell *line = snap->cells + (size_t)y * snap->cols;
+            renderer->update_row(w->r, y, over ? overlay_patch(w, y, line, snap->cols) : line);
+            w->drawn_version[y] = snap->row_version[y];
+            damaged = 1;
+        }
+        if (!glyphs_moved) break;
+        w->full_damage = moved = 1;
+    }
+    for (int i = 0; moved && i < nwins; i++) {
+        if (wins[i] == w) continue;
+        wins[i]->full_damage = 1;
+        wins[i]->redraw = 1;
+    }
+    atlas_collect();
+    AtlasDamage *pending = atlas_pending_for(renderer);
+    if (pending->resized || pending->y1 > pending->y0 || pending->slot1 > pending->slot0) {
+        renderer->sync_atlas(pending);
+        memset(pending, 0, sizeof(*pending));
+    }
+    w->overlay_dirty = 0;
+    if (!damaged) {
+        frames_skipped++;
+        return 0;
+    }
+    w->full_damage = 0;
+    w->drawn_cursor_x = snap->cursor_x;
+    w->drawn_cursor_y = snap->cursor_y;
+    frames_drawn++;
 
-    Cell* old_grid = grid;
-    int old_cols = COLS;
-    int old_rows = ROWS;
+    renderer->draw(w->r, snap->cursor_x, snap->cursor_y);
+    long long drawn = now_ns();
+    if (!renderer->software) {
+        glXSwapBuffers(dpy, w->xwin);
+        if (latency_finish) glFinish();
+    }
+    long long shown = now_ns();
+    stats_frame(shown - start);
+    // The first frame showing a key's echo finishes its sample.
+    if (snap->probe.id != w->last_probe_id && snap->probe.read_ns) {
+        stats_latency(&snap->probe, drawn, shown);
+        w->last_probe_id = snap->probe.id;
+    }
+    return 1;
+}
 
-    COLS = new_cols; ROWS = new_rows;
-    grid = malloc(ROWS * COLS * sizeof(Cell));
-    if (!grid) die("malloc failed for new grid");
+// Pasting. The selection is asked for as UTF8_STRING, or STRING if the
+// owner has no UTF-8, in the XST_PASTE property of the window. Big ones
+// come INCR, a property change at a time. The whole text then goes to the
+// IO thread, which streams it into the pty.
+static void paste_request(Win *w, Atom selection) {
+    free(w->paste_buf);
+    w->paste_buf = NULL;
+    w->paste_len = w->paste_cap = 0;
+    w->paste_incr = 0;
+    XConvertSelection(dpy, selection, atom_utf8, atom_paste, w->xwin, CurrentTime);
+}
 
-    Cell empty = {' ', 0, DEFAULT_FG, DEFAULT_BG};
-    for(int i = 0; i < ROWS * COLS; ++i) grid[i] = empty;
+// Appends n bytes, converting them from Latin-1 (STRING) to UTF-8 if need be.
+static void paste_append(Win *w, const unsigned char *p, size_t n, int latin1) {
+    if (w->paste_len + 2 * n > w->paste_cap) {
+        size_t cap = w->paste_cap ? w->paste_cap : 4096;
+        while (cap < w->paste_len + 2 * n) cap *= 2;
+        char *b = realloc(w->paste_buf, cap);
+        if (!b) die("malloc failed for paste");
+        w->paste_buf = b;
+        w->paste_cap = cap;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (latin1 && p[i] >= 0x80) {
+            w->paste_buf[w->paste_len++] = 0xc0 | p[i] >> 6;
+            w->paste_buf[w->paste_len++] = 0x80 | (p[i] & 0x3f);
+        } else {
+            w->paste_buf[w->paste_len++] = p[i];
+        }
+    }
+}
 
-    if (old_grid) {
-        int min_rows = (old_rows < ROWS) ? old_rows : ROWS;
-        int min_cols = (old_cols < COLS) ? old_cols : COLS;
-        for (int y = 0; y < min_rows; y++) {
-            memcpy(&grid[y * COLS], &old_grid[y * old_cols], min_cols * sizeof(Cell));
+// Moves the paste property's contents into paste_buf and deletes it.
+// Returns the number of bytes it held, or -1 if the owner announced an
+// INCR transfer instead.
+static long paste_read(Win *w) {
+    long off = 0, got = 0;
+    unsigned long n, left;
+    do {
+        Atom type;
+        int format;
+        unsigned char *data;
+        if (XGetWindowProperty(dpy, w->xwin, atom_paste, off, 65536, False, AnyPropertyType,
+                               &type, &format, &n, &left, &data) != Success) break;
+        if (type == atom_incr) {
+            XFree(data);
+            XDeleteProperty(dpy, w->xwin, atom_paste);
+            return -1;
         }
-        free(old_grid);
+        size_t bytes = n * (format / 8);
+        paste_append(w, data, bytes, type == XA_STRING);
+        XFree(data);
+        got += bytes;
+        off += bytes / 4;   // The offset counts 32-bit units
+    } while (left > 0);
+    XDeleteProperty(dpy, w->xwin, atom_paste);
+    return got;
+}
+
+static void paste_finish(Win *w) {
+    if (w->paste_len > 0 && w->paste_len <= INT_MAX) {
+        IoEvent ev = { .type = IO_PASTE, .len = (int)w->paste_len, .data = w->paste_buf };
+        io_send(w->io, &ev);
+        w->paste_buf = NULL;
     }
+    free(w->paste_buf);
+    w->paste_buf = NULL;
+    w->paste_len = w->paste_cap = 0;
+    w->paste_incr = 0;
+}
 
-    if (cursor_x >= COLS) cursor_x = COLS - 1;
-    if (cursor_y >= ROWS) cursor_y = ROWS - 1;
+static void *font_main(void *arg) {
+    FontJob *job = arg;
+    job->start = now_ns();
+    font_init(job->path, job->size);
+    job->end = now_ns();
+    return NULL;
+}
 
-    glViewport(0, 0, win_width, win_height);
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    glOrtho(0.0, win_width, win_height, 0.0, -1.0, 1.0);
-    glMatrixMode(GL_MODELVIEW);
+// Waits for the font the worker thread is loading, if any.
+static void font_wait(const Win *w) {
+    if (!font_job) return;
+    long long t = now_ns();
+    pthread_join(font_job->thread, NULL);
+    if (startup_trace) {
+        fprintf(stderr, "xst: startup: %-14s %8.2f ms, done at %8.2f ms\n", "font (worker)",
+                (font_job->end - font_job->start) / 1e6, (font_job->end - w->t0) / 1e6);
+    }
+    font_job = NULL;
+    trace(w, "font wait", t);
+}
 
-    struct winsize ws = { .ws_row = ROWS, .ws_col = COLS, .ws_xpixel = w, .ws_ypixel = h };
-    ioctl(pty_master_fd, TIOCSWINSZ, &ws);
+static void print_stats() {
+    IoStats io;
+    io_stats(&io);
+    fprintf(stderr, "xst: wakeups: %llu render (%llu frame timer), %llu io; %llu snapshots; "
+            "frames: %llu drawn (%llu scrolled on the GPU), %llu skipped; synchronized updates: %llu, %llu snapshots held back, "
+            "%llu timed out\n",
+            wakeups, timer_wakeups, io.wakeups, io.snapshots, frames_drawn, frames_scrolled, frames_skipped,
+            io.sync_updates, io.sync_held, io.sync_timeouts);
 }
 
-void x11_init() {
-    dpy = XOpenDisplay(NULL);
-    if (!dpy) die("Cannot connect to X server");
-    Window root = DefaultRootWindow(dpy);
-    GLint att[] = { GLX_RGBA, GLX_DEPTH_SIZE, 24, GLX_DOUBLEBUFFER, None };
-    XVisualInfo *vi = glXChooseVisual(dpy, 0, att);
-    if (!vi) die("No appropriate visual found");
-    Colormap cmap = XCreateColormap(dpy, root, vi->visual, AllocNone);
-    XSetWindowAttributes swa;
-    swa.colormap = cmap;
-    swa.event_mask = ExposureMask | KeyPressMask | StructureNotifyMask;
-    win = XCreateWindow(dpy, root, 0, 0, win_width, win_height, 0, vi->depth, InputOutput, vi->visual, CWColormap | CWEventMask, &swa);
-    XMapWindow(dpy, win);
-    XStoreName(dpy, win, "xst");
-    Atom wm_delete_window = XInternAtom(dpy, "WM_DELETE_WINDOW", False);
-    XSetWMProtocols(dpy, win, &wm_delete_window, 1);
-    ctx = glXCreateContext(dpy, vi, NULL, GL_TRUE);
-    glXMakeCurrent(dpy, win, ctx);
-}
-
-void gl_init() {
-    glEnable(GL_TEXTURE_2D);
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-}
-
-void font_init(const char* font_path, int font_size) {
-    if (FT_Init_FreeType(&ft_lib)) die("Could not init freetype library");
-    if (FT_New_Face(ft_lib, font_path, 0, &ft_face)) die("Could not open font");
-    FT_Set_Pixel_Sizes(ft_face, 0, font_size);
-    FT_GlyphSlot g = ft_face->glyph;
-    char_h = font_size;
-    if (FT_Load_Char(ft_face, 'M', FT_LOAD_RENDER)) die("Could not load 'M' character");
-    char_w = (g->advance.x >> 6);
-    if (char_w == 0) char_w = font_size / 2.0f;
-    font_atlas_w = 0; font_atlas_h = 0;
-    for (int i = 32; i < 128; i++) {
-        if (FT_Load_Char(ft_face, i, FT_LOAD_RENDER)) continue;
-        font_atlas_w += g->bitmap.width;
-        font_atlas_h = (g->bitmap.rows > font_atlas_h) ? g->bitmap.rows : font_atlas_h;
-    }
-    glGenTextures(1, &font_texture);
-    glBindTexture(GL_TEXTURE_2D, font_texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, font_atlas_w, font_atlas_h, 0, GL_ALPHA, GL_UNSIGNED_BYTE, NULL);
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    int x = 0;
-    for (int i = 32; i < 128; i++) {
-        if (FT_Load_Char(ft_face, i, FT_LOAD_RENDER)) continue;
-        glTexSubImage2D(GL_TEXTURE_2D, 0, x, 0, g->bitmap.width, g->bitmap.rows,
-                        GL_ALPHA, GL_UNSIGNED_BYTE, g->bitmap.buffer);
-        glyphs[i] = (Glyph){ .ax = g->advance.x >> 6, .ay = g->advance.y >> 6,
-                             .bw = g->bitmap.width, .bh = g->bitmap.rows,
-                             .bl = g->bitmap_left, .bt = g->bitmap_top,
-                             .tx = (float)x / font_atlas_w };
-        x += g->bitmap.width;
-    }
-}
-
-void pty_init() {
-    pid_t pid = forkpty(&pty_master_fd, NULL, NULL, NULL);
-    if (pid < 0) die("forkpty failed");
-    if (pid == 0) {
-        setenv("TERM", "xterm-256color", 1);
-        char *shell = getenv("SHELL");
-        if (!shell) shell = "/bin/sh";
-        execl(shell, shell, (char *)NULL);
-        exit(0);
-    }
-    int flags = fcntl(pty_master_fd, F_GETFL, 0);
-    fcntl(pty_master_fd, F_SETFL, flags | O_NONBLOCK);
-}
-
-void term_scroll() {
-    memmove(&grid[0], &grid[COLS], (ROWS - 1) * COLS * sizeof(Cell));
-    Cell empty = {' ', 0, DEFAULT_FG, DEFAULT_BG};
-    for (int i = 0; i < COLS; i++) {
-        grid[(ROWS - 1) * COLS + i] = empty;
-    }
-    cursor_y--;
-}
-
-void term_handle_char(char c) {
-    switch (ansi_state) {
-        case STATE_NORMAL:
-            if (c == '\x1b') {
-                ansi_state = STATE_ESC;
-            } else if (c == '\n') {
-                cursor_y++;
-            } else if (c == '\r') {
-                cursor_x = 0;
-            } else if (c == '\b') {
-                if (cursor_x > 0) cursor_x--;
-            } else if (c == '\t') {
-                cursor_x = (cursor_x + 8) & ~7;
-            } else if (c >= 32) {
-                if (cursor_x >= COLS) {
-                    cursor_x = 0;
-                    cursor_y++;
-                }
-                if (cursor_y >= ROWS) {
-                    term_scroll();
-                }
-                if (cursor_y < ROWS && cursor_x < COLS) {
-                    grid[cursor_y * COLS + cursor_x] = (Cell){c, term_attr, term_fg, term_bg};
-                    cursor_x++;
-                }
-            }
-            break;
-        case STATE_ESC:
-            if (c == '[') {
-                ansi_state = STATE_CSI;
-                csi_len = 0;
-                memset(csi_buf, 0, sizeof(csi_buf));
-            } else if (c == ']') {
-                ansi_state = STATE_OSC;
-                osc_len = 0;
-                memset(osc_buf, 0, sizeof(osc_buf));
-            } else {
-                ansi_state = STATE_NORMAL;
-            }
-            break;
-        case STATE_CSI:
-            if (csi_len < sizeof(csi_buf) - 1) {
-                csi_buf[csi_len++] = c;
-                if ((c >= '@' && c <= '~')) {
-                    csi_dispatch();
-                    ansi_state = STATE_NORMAL;
-                }
-            } else {
-                ansi_state = STATE_NORMAL;
-            }
-            break;
-        case STATE_OSC:
-            if (c == '\x07') {
-                osc_buf[osc_len] = '\0';
-                osc_dispatch();
-                ansi_state = STATE_NORMAL;
-            } else if (c == '\x1b') { // Likely ST (ESC \) terminator, abort and start new ESC
-                ansi_state = STATE_ESC;
-            } else if (osc_len < sizeof(osc_buf) - 1) {
-                osc_buf[osc_len++] = c;
-            } else {
-                ansi_state = STATE_NORMAL; // buffer full, abort
-            }
-            break;
+void window_defaults(WinOptions *o) {
+    *o = (WinOptions){ SCROLLBACK_LINES, SPILL_MAX_MB, &render_gl33, 0 };
+}
+
+// Handles the window option at argv[*argi], moving *argi past its
+// argument. Returns 0 if it isn't one.
+int window_option(WinOptions *o, int argc, char *argv[], int *argi) {
+    const char *arg = argv[*argi];
+    if (strcmp(arg, "--scrollback") == 0 && *argi + 1 < argc) {
+        o->scrollback = atoi(argv[++*argi]);
+        if (o->scrollback < 0) o->scrollback = 0;
+    } else if (strcmp(arg, "--scrollback-spill") == 0 && *argi + 1 < argc) {
+        o->spill_mb = atoi(argv[++*argi]);
+        if (o->spill_mb < 0) o->spill_mb = 0;
+    } else if (strcmp(arg, "--renderer=gl33") == 0) {
+        o->renderer = &render_gl33;
+        o->renderer_forced = 1;
+    } else if (strcmp(arg, "--renderer=legacy") == 0) {
+        o->renderer = &render_legacy;
+        o->renderer_forced = 1;
+    } else if (strcmp(arg, "--renderer=shm") == 0) {
+        o->renderer = &render_shm;
+        o->renderer_forced = 1;
+    } else {
+        return 0;
     }
+    return 1;
+}
 
-    if (cursor_y >= ROWS) {
-        term_scroll();
+// The shell is spawned first, since it usually takes longest to get to
+// a prompt; whatever it writes meanwhile is parsed into the grid, at a
+// guessed size if the font is still loading.
+Win *window_open(const WinOptions *o, char *const *cmd, char *const *env, const char *cwd, char *err, size_t n) {
+    if (!dpy) {
+        snprintf(err, n, "no display");
+        return NULL;
     }
+    Win *w = calloc(1, sizeof(*w));
+    if (!w) die("malloc failed for window");
+    w->renderer = o->renderer;
+    w->width = 800; w->height = 600;
+    w->full_damage = w->redraw = 1;
+    w->drawn_cursor_x = w->drawn_cursor_y = -1;
+    w->drawn_move_top = w->drawn_move_bot = -1;
+    // The first window of a process that is still loading its font
+    // counts its startup from the process's.
+    w->t0 = font_job ? startup_t0 : now_ns();
+
+    long long t = now_ns();
+    float cw = font_job ? font_job->size * STARTUP_EM_W : char_w, ch = font_job ? font_job->size : char_h;
+    int cols = w->width / cw, rows = w->height / ch;
+    if (cols < 1) cols = 1;
+    if (rows < 1) rows = 1;
+    term_init(&w->term, cols, rows, o->scrollback, (size_t)o->spill_mb << 20);
+    w->io = io_open(&w->term, w->width, w->height, cmd, env, cwd);
+    if (!w->io) {
+        snprintf(err, n, "can't start a shell: %s", strerror(errno));
+        term_free(&w->term);
+        free(w);
+        return NULL;
+    }
+    trace(w, "shell spawned", t);
+
+    t = now_ns();
+    x11_window(w);
+    trace(w, "x11", t);
+    t = now_ns();
+    if (!gl_init(w, o->renderer_forced)) {
+        snprintf(err, n, "could not initialize the %s renderer", w->renderer->name);
+        io_close(w->io);
+        XDestroyWindow(dpy, w->xwin);
+        XFreeColormap(dpy, w->cmap);
+        XFlush(dpy);
+        term_free(&w->term);
+        free(w);
+        return NULL;
+    }
+    trace(w, "gl", t);
+    font_wait(w);
+    win_resize(w, w->width, w->height);
+    w->bench_t0 = now_ns();
+
+    if (nwins == wins_cap) {
+        wins_cap = wins_cap ? wins_cap * 2 : 4;
+        wins = realloc(wins, wins_cap * sizeof(*wins));
+        if (!wins) die("malloc failed for windows");
+    }
+    wins[nwins++] = w;
+    return w;
+}
+
+// Closes window i: the shell is hung up on, and the renderer state, the
+// context and the X window go.
+static void win_close(int i) {
+    Win *w = wins[i];
+    io_close(w->io);
+    if (bench_render) {
+        double p50, p99, secs = (now_ns() - w->bench_t0) / 1e9;
+        unsigned long long n = stats_frames(&p50, &p99);
+        printf("%s: %llu frames (%llu scrolled), frame p50 %.3f ms p99 %.3f ms, %.1f MB in %.2f s\n",
+               w->renderer->name, n, frames_scrolled, p50, p99, w->term.stats.bytes / 1e6, secs);
+    }
+    if (verbose) {
+        TermMemory m;
+        term_memory(&w->term, &m);
+        fprintf(stderr, "xst: scrollback: %.1f MB of rows in memory; %lld lines spilled, "
+                "%.1f MB compressed to %.1f MB on disk, %.1f MB of spill buffers\n",
+                m.rows / 1e6, m.spill_lines, m.spill_raw / 1e6, m.spill_disk / 1e6, m.spill_ram / 1e6);
+        fprintf(stderr, "xst: window %#lx closed, %d left\n", w->xwin, nwins - 1);
+    }
+    win_current(w);
+    w->renderer->cleanup(w->r);
+    if (w->ctx) gl_drop(w);
+    current = NULL;
+    XDestroyWindow(dpy, w->xwin);
+    XFreeColormap(dpy, w->cmap);
+    term_free(&w->term);
+    free(w->drawn_version);
+    free(w->drawn_images);
+    free(w->overlay_row);
+    free(w->paste_buf);
+    free(w);
+    wins[i] = wins[--nwins];
+}
+
+unsigned long window_id(const Win *w) {
+    return w->xwin;
+}
+
+int window_count() {
+    return nwins;
 }
 
-void term_draw() {
-    const Color *default_bg = &color_palette[DEFAULT_BG];
-    glClearColor(default_bg->r, default_bg->g, default_bg->b, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT);
+void window_memory(int i, WinMemory *m) {
+    Win *w = wins[i];
+    m->xid = w->xwin;
+    io_memory(w->io, &m->term, &m->snapshots);
+    w->renderer->memory(w->r, &m->render_cpu, &m->render_gpu);
+    m->renderer = w->renderer->name;
+}
+
+static Win *win_find(Window xwin) {
+    for (int i = 0; i < nwins; i++) {
+        if (wins[i]->xwin == xwin) return wins[i];
+    }
+    return NULL;
+}
+
+static void key_press(Win *w, XKeyEvent *xkey) {
+    IoEvent ev = { .type = IO_KEY, .stamp = now_ns() };
+    KeySym ks;
+    ev.len = XLookupString(xkey, ev.text, sizeof(ev.text), &ks, NULL);
+    int shift = xkey->state & ShiftMask;
+    if (shift && (ks == XK_Prior || ks == XK_Next)) {
+        int page = w->geom_rows / 2 > 0 ? w->geom_rows / 2 : 1;
+        ev.type = IO_SCROLL;
+        ev.a = (ks == XK_Prior) ? page : -page;
+        io_send(w->io, &ev);
+    } else if (shift && (xkey->state & ControlMask) && (ks == XK_V || ks == XK_v)) {
+        paste_request(w, atom_clipboard);
+    } else if (shift && ks == XK_Insert) {
+        paste_request(w, XA_PRIMARY);
+    } else if (shift && (xkey->state & ControlMask) && (ks == XK_S || ks == XK_s)) {
+        w->overlay_on = !w->overlay_on;
+        w->overlay_due = 0;
+        w->full_damage = 1;
+        w->redraw = 1;
+    } else if (shift && (xkey->state & ControlMask) && (ks == XK_F || ks == XK_f)) {
+        // Ctrl+Shift+F starts a search, or goes to the next older match
+        // in one.
+        ev.type = w->searching ? IO_SEARCH_STEP : IO_SEARCH;
+        ev.a = w->searching;
+        ev.len = 0;
+        w->searching = 1;
+        io_send(w->io, &ev);
+    } else if (w->searching) {
+        // While searching, keys edit the query: Enter or Up goes to the
+        // next older match, Shift+Enter or Down to the next newer one,
+        // Escape ends the search.
+        if (ks == XK_Escape) {
+            ev.type = IO_SEARCH_END;
+            w->searching = 0;
+        } else if (ks == XK_Return || ks == XK_KP_Enter || ks == XK_Up || ks == XK_Down) {
+            ev.type = IO_SEARCH_STEP;
+            ev.a = (ks == XK_Down || (shift && ks != XK_Up)) ? -1 : 1;
+        } else if (ks == XK_BackSpace) {
+            ev.type = IO_SEARCH;
+            ev.a = 1;
+            ev.len = 0;
+        } else if (ev.len > 0 && (unsigned char)ev.text[0] >= 0x20 && ev.text[0] != 0x7f) {
+            ev.type = IO_SEARCH;
+        } else {
+            return;
+        }
+        io_send(w->io, &ev);
+    } else if (ev.len > 0) {
+        io_send(w->io, &ev);
+    }
+}
 
-    // --- Draw Cell Backgrounds ---
-    glDisable(GL_TEXTURE_2D);
-    glBegin(GL_QUADS);
-    for (int y = 0; y < ROWS; y++) {
-        for (int x = 0; x < COLS; x++) {
-            Cell *cell = &grid[y * COLS + x];
-            unsigned short bg_idx = (cell->attr & ATTR_REVERSE) ? cell->fg : cell->bg;
-            if (bg_idx != DEFAULT_BG) {
-                const Color *c = &color_palette[bg_idx];
-                glColor3f(c->r, c->g, c->b);
-                glVertex2f(x * char_w, y * char_h);
-                glVertex2f((x + 1) * char_w, y * char_h);
-                glVertex2f((x + 1) * char_w, (y + 1) * char_h);
-                glVertex2f(x * char_w, (y + 1) * char_h);
+// X events go to the IO thread of the window they are for, as IoEvents.
+static void x_event(XEvent *e) {
+    Win *w = win_find(e->xany.window);
+    if (!w) return;
+    if (e->type == KeyPress) {
+        key_press(w, &e->xkey);
+    } else if (e->type == ButtonPress) {
+        if (e->xbutton.button == Button2) paste_request(w, XA_PRIMARY);
+    } else if (e->type == SelectionNotify) {
+        XSelectionEvent *se = &e->xselection;
+        if (se->property == None) {
+            // No UTF-8 from this owner; plain STRING then.
+            if (se->target == atom_utf8) XConvertSelection(dpy, se->selection, XA_STRING, atom_paste, w->xwin, CurrentTime);
+        } else if (paste_read(w) < 0) {
+            w->paste_incr = 1;
+        } else {
+            paste_finish(w);
+        }
+    } else if (e->type == PropertyNotify) {
+        // INCR: each new value is the next chunk, the empty one ends it.
+        if (w->paste_incr && e->xproperty.atom == atom_paste && e->xproperty.state == PropertyNewValue) {
+            if (paste_read(w) == 0) paste_finish(w);
+        }
+    } else if (e->type == ConfigureNotify) {
+        XConfigureEvent xce = e->xconfigure;
+        if (xce.width != w->width || xce.height != w->height) win_resize(w, xce.width, xce.height);
+    } else if (e->type == Expose || e->type == GraphicsExpose) {
+        w->full_damage = 1;
+        w->redraw = 1;
+    } else if (e->type == ClientMessage) {
+        if ((Atom)e->xclient.data.l[0] == atom_wm_delete) w->closing = 1;
+    }
+}
+
+// Takes w's newest snapshot and draws it if a frame is due. Returns when
+// w next needs a frame or its overlay redone, 0 if it doesn't.
+static long long win_update(Win *w, long long now) {
+    int fresh;
+    const Snapshot *snap = io_snapshot(w->io, &fresh);
+    if (fresh) {
+        w->redraw = 1;
+        if (snap->title_version != w->drawn_title_version || snap->search_version != w->drawn_search_version) {
+            if (snap->searching) {
+                char status[SEARCH_MAX + 64];
+                snprintf(status, sizeof(status), "search: %s  [%lld/%lld%s]", snap->search_query,
+                         snap->search_index, snap->search_count, snap->search_more ? "+" : "");
+                XStoreName(dpy, w->xwin, status);
+            } else {
+                XStoreName(dpy, w->xwin, snap->title);
             }
+            w->drawn_title_version = snap->title_version;
+            w->drawn_search_version = snap->search_version;
         }
     }
-    glEnd();
-
-    // --- Draw Glyphs and Decorations ---
-    glEnable(GL_TEXTURE_2D);
-    glBindTexture(GL_TEXTURE_2D, font_texture);
-    glBegin(GL_QUADS);
-    for (int y = 0; y < ROWS; y++) {
-        for (int x = 0; x < COLS; x++) {
-            Cell *cell = &grid[y * COLS + x];
-            if (cell->c < 32 || cell->c > 126 || (cell->attr & ATTR_INVISIBLE)) continue;
-
-            unsigned short fg_idx = (cell->attr & ATTR_REVERSE) ? cell->bg : cell->fg;
-            if ((cell->attr & ATTR_BOLD) && fg_idx < 8) fg_idx += 8;
-
-            const Color *c = &color_palette[fg_idx];
-            glColor3f(c->r, c->g, c->b);
-
-            Glyph *g = &glyphs[(int)cell->c];
-            float xpos = x * char_w + g->bl;
-            float ypos = y * char_h + (char_h - g->bt);
-            float w = g->bw; float h = g->bh;
-            float u0 = g->tx, v0 = 0.0f;
-            float u1 = g->tx + g->bw / font_atlas_w, v1 = g->bh / font_atlas_h;
-            glTexCoord2f(u0, v0); glVertex2f(xpos, ypos);
-            glTexCoord2f(u1, v0); glVertex2f(xpos + w, ypos);
-            glTexCoord2f(u1, v1); glVertex2f(xpos + w, ypos + h);
-            glTexCoord2f(u0, v1); glVertex2f(xpos, ypos + h);
+
+    if (w->overlay_on && now >= w->overlay_due) {
+        if (stats_overlay(&w->overlay, snap, frames_skipped, now)) {
+            w->overlay_dirty = 1;
+            w->redraw = 1;
         }
+        w->overlay_due = now + OVERLAY_EVERY_NS;
     }
-    glEnd();
-
-    // --- Draw Underlines and Strikethroughs ---
-    glDisable(GL_TEXTURE_2D);
-    glBegin(GL_LINES);
-    for (int y = 0; y < ROWS; y++) {
-        for (int x = 0; x < COLS; x++) {
-            Cell *cell = &grid[y * COLS + x];
-            if (!(cell->attr & (ATTR_UNDERLINE | ATTR_STRUCK))) continue;
-
-            unsigned short fg_idx = (cell->attr & ATTR_REVERSE) ? cell->bg : cell->fg;
-            if ((cell->attr & ATTR_BOLD) && fg_idx < 8) fg_idx += 8;
-            const Color *c = &color_palette[fg_idx];
-            glColor3f(c->r, c->g, c->b);
-
-            if (cell->attr & ATTR_UNDERLINE) {
-                float ypos = (y + 1) * char_h - 2; // -2 for better positioning
-                glVertex2f(x * char_w, ypos);
-                glVertex2f((x + 1) * char_w, ypos);
+    if (w->redraw && now >= w->next_frame) {
+        if (term_draw(w, snap)) {
+            w->next_frame = now + (snap->fast_forward ? 2 * FRAME_INTERVAL_NS : FRAME_INTERVAL_NS);
+            // The first prompt is the first frame with shell output.
+            if (w->startup_frames == 0) {
+                trace(w, "first frame", w->t0);
+                w->startup_frames = 1;
             }
-            if (cell->attr & ATTR_STRUCK) {
-                float ypos = y * char_h + char_h / 2.0f;
-                glVertex2f(x * char_w, ypos);
-                glVertex2f((x + 1) * char_w, ypos);
+            if (w->startup_frames == 1 && snap->parsed) {
+                trace(w, "first prompt", w->t0);
+                w->startup_frames = 2;
             }
         }
+        // Images still uploading need the frames after this one.
+        w->redraw = image_uploads_pending;
+    }
+
+    long long at = w->redraw ? w->next_frame : 0;
+    if (w->overlay_on && (!at || w->overlay_due < at)) at = w->overlay_due;
+    return at;
+}
+
+static void loop_init() {
+    if (loop_ep >= 0) return;
+    loop_ep = epoll_create1(EPOLL_CLOEXEC);
+    frame_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (loop_ep < 0 || frame_timer < 0) die("epoll/timerfd setup failed");
+    loop_watch(frame_timer, NULL);
+    if (sig_fd >= 0) loop_watch(sig_fd, NULL);
+}
+
+// Wakes the loop when fd is readable and calls fn(fd) then; the loop's
+// own fds have no fn.
+void loop_watch(int fd, void (*fn)(int fd)) {
+    loop_init();
+    if (nwatches == MAX_WATCHES) die("too many fds to watch");
+    epoll_watch(loop_ep, fd);
+    watches[nwatches++] = (Watch){ fd, fn };
+}
+
+void loop_unwatch(int fd) {
+    for (int i = 0; i < nwatches; i++) {
+        if (watches[i].fd != fd) continue;
+        epoll_ctl(loop_ep, EPOLL_CTL_DEL, fd, NULL);
+        watches[i] = watches[--nwatches];
+        return;
     }
-    glEnd();
-
-    // --- Draw Cursor ---
-    glBlendFunc(GL_ONE_MINUS_DST_COLOR, GL_ZERO); // Invert color
-    glColor3f(1.0f, 1.0f, 1.0f); // White will invert everything
-    glRectf(cursor_x * char_w, cursor_y * char_h, (cursor_x + 1) * char_w, (cursor_y + 1) * char_h);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA); // Restore blend func
-
-    glXSwapBuffers(dpy, win);
-}
-
-void main_loop() {
-    XEvent e;
-    char buf[4096];
-    int running = 1;
-    while (running) {
-        fd_set fds;
-        FD_ZERO(&fds);
-        FD_SET(ConnectionNumber(dpy), &fds);
-        FD_SET(pty_master_fd, &fds);
-        struct timeval timeout = { .tv_sec = 0, .tv_usec = 16666 };
-        select(pty_master_fd + 1, &fds, NULL, NULL, &timeout);
-        while (XPending(dpy)) {
+}
+
+void loop_quit() {
+    loop_done = 1;
+}
+
+// New snapshots are drawn at most once per frame interval, per window.
+void loop_run(int keep) {
+    loop_init();
+    loop_watch(io_wake_fd(), NULL);
+    while (!loop_done && (keep || nwins)) {
+        // Xlib may already hold queued events, so drain those before
+        // deciding how long to sleep.
+        while (dpy && XPending(dpy)) {
+            XEvent e;
             XNextEvent(dpy, &e);
-            if (e.type == KeyPress) {
-                int count = XLookupString(&e.xkey, buf, sizeof(buf), NULL, NULL);
-                if (count > 0) write(pty_master_fd, buf, count);
-            } else if (e.type == ConfigureNotify) {
-                XConfigureEvent xce = e.xconfigure;
-                if (xce.width != win_width || xce.height != win_height) {
-                    term_resize(xce.width, xce.height);
-                }
-            } else if (e.type == ClientMessage) {
-                running = 0;
+            x_event(&e);
+        }
+        // Acked before the windows are looked at, so a snapshot published
+        // meanwhile wakes the next round.
+        io_wake_ack();
+        long long now = now_ns(), at = 0;
+        for (int i = 0; i < nwins; i++) {
+            if (wins[i]->closing || io_done(wins[i]->io)) {
+                win_close(i--);
+                continue;
             }
+            long long t = win_update(wins[i], now);
+            if (t && (!at || t < at)) at = t;
+        }
+        if (!keep && !nwins) break;
+
+        // Sleep until an X event or a new snapshot arrives, or until a
+        // held-back frame or an overlay is due; without the overlay idle
+        // terminals sleep indefinitely.
+        if (at != timer_at) {
+            struct itimerspec its = { .it_value = { at / 1000000000LL, at % 1000000000LL } };
+            timerfd_settime(frame_timer, TFD_TIMER_ABSTIME, &its, NULL);
+            timer_at = at;
+        }
+        if (dpy) XFlush(dpy);
+        struct epoll_event evs[16];
+        int n = epoll_wait(loop_ep, evs, 16, dpy && XQLength(dpy) ? 0 : -1);
+        if (n < 0) {
+            if (errno != EINTR) die("epoll_wait failed");
+            n = 0;
         }
-        if (FD_ISSET(pty_master_fd, &fds)) {
-            int count = read(pty_master_fd, buf, sizeof(buf));
-            if (count > 0) {
-                for (int i = 0; i < count; i++) {
-                    term_handle_char(buf[i]);
+        wakeups++;
+        for (int i = 0; i < n; i++) {
+            int fd = evs[i].data.fd;
+            uint64_t expired;
+            struct signalfd_siginfo si;
+            if (fd == frame_timer && read(frame_timer, &expired, sizeof(expired)) > 0) {
+                timer_wakeups++;
+                timer_at = 0;
+            } else if (fd == sig_fd && read(sig_fd, &si, sizeof(si)) > 0) {
+                print_stats();
+            } else {
+                for (int k = 0; k < nwatches; k++) {
+                    if (watches[k].fd == fd && watches[k].fn) {
+                        watches[k].fn(fd);
+                        break;
+                    }
                 }
-            } else if (count <= 0 && errno != EAGAIN) {
-                running = 0;
             }
         }
-        term_draw();
     }
+    // Windows still open when told to quit are closed here.
+    while (nwins) win_close(nwins - 1);
+    loop_unwatch(io_wake_fd());
+}
+
+static int usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [--scrollback <lines>] [--scrollback-spill <MB>] [--renderer=gl33|legacy|shm]\n"
+                    "       [--verbose] [--latency-log <file|->] [--latency-finish] [--startup-trace]\n"
+                    "       [--bench-render <file>] [font_size]\n"
+                    "       %s --daemon [options] [font_size]   (windows are opened with xstc)\n"
+                    "       %s --bench <file> | --bench-sgr\n", argv0, argv0, argv0);
+    return 1;
+}
+
+// Options for the process rather than for a window.
+static int main_option(int argc, char *argv[], int *argi) {
+    const char *arg = argv[*argi];
+    if (strcmp(arg, "--bench-render") == 0 && *argi + 1 < argc) {
+        bench_render = argv[++*argi];
+    } else if (strcmp(arg, "--verbose") == 0) {
+        verbose = 1;
+    } else if (strcmp(arg, "--latency-log") == 0 && *argi + 1 < argc) {
+        latency_log = argv[++*argi];
+    } else if (strcmp(arg, "--latency-finish") == 0) {
+        latency_finish = 1;
+    } else if (strcmp(arg, "--startup-trace") == 0) {
+        startup_trace = 1;
+    } else {
+        return 0;
+    }
+    return 1;
 }
 
 int main(int argc, char *argv[]) {
+    startup_t0 = now_ns();
+    int argi = 1, daemon = 0;
+    WinOptions opts;
+    window_defaults(&opts);
+    for (; argi < argc && strncmp(argv[argi], "--", 2) == 0; argi++) {
+        if (strcmp(argv[argi], "--bench") == 0 && argi + 1 < argc) {
+            return bench_run(argv[argi + 1]);
+        } else if (strcmp(argv[argi], "--bench-sgr") == 0) {
+            return bench_sgr();
+        } else if (strcmp(argv[argi], "--daemon") == 0) {
+            daemon = 1;
+        } else if (!window_option(&opts, argc, argv, &argi) && !main_option(argc, argv, &argi)) {
+            return usage(argv[0]);
+        }
+    }
+
     int font_size = 16;
-    if (argc > 1) {
-        font_size = atoi(argv[1]);
+    if (argi < argc) {
+        font_size = atoi(argv[argi]);
     } else {
         char config_path[PATH_MAX];
         char *home = getenv("HOME");
@@ -660,20 +1188,50 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    x11_init();
-    gl_init();
-    font_init(font_path, font_size);
-    pty_init();
-    term_resize(win_width, win_height);
-    main_loop();
+    // SIGUSR1 prints the wakeup and frame counters. It is blocked before
+    // any thread exists, so that every thread leaves it to the signalfd.
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+    sig_fd = signalfd(-1, &usr1, SFD_NONBLOCK | SFD_CLOEXEC);
 
-    free(grid);
-    glXMakeCurrent(dpy, None, NULL);
-    glXDestroyContext(dpy, ctx);
-    XDestroyWindow(dpy, win);
-    XCloseDisplay(dpy);
-    FT_Done_Face(ft_face);
-    FT_Done_FreeType(ft_lib);
-    close(pty_master_fd);
-    return 0;
+    int status = 0;
+    if (daemon) {
+        status = daemon_run(&opts, font_path, font_size);
+    } else {
+        FontJob job = { font_path, font_size, 0, 0, 0 };
+        if (pthread_create(&job.thread, NULL, font_main, &job) != 0) die("pthread_create failed");
+        font_job = &job;
+        char err[256];
+        char *cat[] = { "cat", (char *)bench_render, NULL };
+        if (!display_open(NULL, err, sizeof(err)) ||
+            !window_open(&opts, bench_render ? cat : NULL, NULL, NULL, err, sizeof(err))) {
+            fprintf(stderr, "xst: %s\n", err);
+            if (font_job) pthread_join(job.thread, NULL);
+            font_job = NULL;
+            status = 1;
+        } else {
+            loop_run(0);
+        }
+    }
+    io_shutdown();
+
+    if (latency_log) {
+        FILE *f = strcmp(latency_log, "-") == 0 ? stderr : fopen(latency_log, "w");
+        if (f) {
+            stats_dump(f);
+            if (f != stderr) fclose(f);
+        } else {
+            perror(latency_log);
+        }
+    }
+    if (verbose) print_stats();
+    if (dpy) {
+        if (gl_visual) XFree(gl_visual);
+        XCloseDisplay(dpy);
+    }
+    font_free();
+    if (sig_fd >= 0) close(sig_fd);
+    return status;
 }
@@ -0,0 +1,158 @@
+// xst.h - Front-end state shared between xst.c and the renderers.
+
+#ifndef XST_H
+#define XST_H
+
+#include <X11/Xlib.h>
+
+#include "term.h"
+#include "graphics.h"
+
+typedef struct {
+    float r, g, b;
+} Color;
+
+// Glyph cache (font.c). Codepoints are rasterized with FreeType on first
+// use and packed into a coverage atlas that grows up to ATLAS_MAX_H rows;
+// after that the least recently used shelf is evicted. Renderers address
+// glyphs by slot; slot 0 is always blank.
+#define GLYPH_SLOTS  4096
+#define ATLAS_W      1024
+#define ATLAS_MAX_H  4096
+
+// Glyphs are saved in the on-disk cache as they are; a change here needs
+// a new CACHE_MAGIC in font.c.
+typedef struct {
+    uint32_t cp;            // Codepoint, 0 if the slot is free
+    short bw, bh;           // Bitmap size
+    short bl, bt;           // Left and top bearing
+    short ox, oy;           // Position in the atlas
+    short shelf;            // -1 if the bitmap is empty
+    int next;               // Hash chain
+    unsigned last_used;     // Frame stamp, for LRU eviction
+} Glyph;
+
+// Atlas changes not yet seen by the renderer, collected over a frame and
+// uploaded in one batch.
+typedef struct {
+    int resized;            // Atlas was reallocated: upload all of it
+    int y0, y1;             // Atlas rows written, [y0, y1)
+    int slot0, slot1;       // Glyph slots (re)assigned, [slot0, slot1)
+} AtlasDamage;
+
+// A rendering backend. term_draw owns damage tracking and only hands the
+// backend rows that changed; the backend owns all of its GPU state. Every
+// window has its own state, made by init and passed back as `r`. The GL
+// renderers' contexts are created in one share group per renderer, so
+// their programs, glyph atlas and image textures are made by the first
+// window and freed by the last.
+typedef struct {
+    const char *name;
+    int software;                               // Draws with Xlib, no GL context
+    void *(*init)(Window w);                    // With w's context current; NULL if unusable
+    void (*sync_atlas)(const AtlasDamage *d);   // Upload atlas/glyph changes, for every window
+    void (*sync_styles)(void *r, const Style *s, int n); // Style table changed; rows follow
+    void (*viewport)(void *r, int w, int h);
+    void (*grid_resize)(void *r, int rows, int cols);   // Every row follows as dirty
+    void (*update_row)(void *r, int y, const Cell *line);
+    // Optional: rows top..bot now show what the row n below showed (above
+    // if n < 0), on the GPU too. Rows with nothing to take follow as dirty.
+    void (*scroll)(void *r, int top, int bot, int n);
+    // Optional: image placements for the next draw, lowest z first. The
+    // rows they cover, and those they covered, follow as dirty.
+    void (*images)(void *r, const GfxView *v, int n);
+    void (*draw)(void *r, int cursor_x, int cursor_y); // cursor_y < 0: hidden
+    void (*cleanup)(void *r);
+    // Bytes the window's own state takes, in memory and (estimated) on the GPU
+    void (*memory)(void *r, size_t *cpu, size_t *gpu);
+} Renderer;
+
+extern const Renderer render_legacy;
+extern const Renderer render_gl33;
+extern const Renderer render_shm;
+
+extern Display *dpy;
+
+extern Glyph glyphs[GLYPH_SLOTS];
+extern unsigned char *font_atlas;       // font_atlas_w x font_atlas_h coverage
+extern int font_atlas_w, font_atlas_h;
+extern float char_w, char_h;
+
+// Set when glyph slots were evicted or the atlas was reallocated, i.e.
+// every on-screen row has to be resolved against the cache again.
+extern int glyphs_moved;
+
+void font_init(const char *font_path, int font_size);
+void font_open(void);                   // Open the face now rather than on the first cache miss
+void font_free(void);
+int glyph_lookup(uint32_t cp);
+void glyph_frame(void);
+int glyph_damage(AtlasDamage *d);
+
+// Inline image textures (images.c), for the GL renderers, one cache per
+// share group. Uploads are spread over frames, IMAGE_UPLOAD_MAX bytes per
+// frame; textures beyond IMAGE_TEX_MAX go least recently drawn first.
+#define IMAGE_UPLOAD_MAX    (8 << 20)
+#define IMAGE_TEX_MAX       (256 << 20)
+
+typedef struct {
+    struct ImageTex *texs;
+    int ntexs, texs_cap;
+    size_t tex_bytes, upload_left;
+    unsigned frame;
+    int max_size;
+} ImageCache;
+
+extern int image_uploads_pending;       // An image drawn this frame isn't all uploaded yet
+void image_frame(ImageCache *c);        // Before drawing: a new upload budget
+unsigned image_texture(ImageCache *c, const GfxView *v);   // Binds its texture; 0 until complete
+void image_textures_free(ImageCache *c);
+
+extern const Color color_palette[258];
+extern const Color search_colors[3];    // Text, match and selected match background
+extern const Color overlay_colors[2];   // Stats overlay text and background
+int style_colors(const Style *s, Color *fg, Color *bg);
+extern int verbose;                     // --verbose: startup diagnostics on stderr
+
+// Windows (xst.c). Each has its own terminal, pty and renderer state; all
+// of them share the X connection, the font and the IO thread, and are
+// driven by one event loop.
+typedef struct Win Win;
+
+typedef struct {
+    int scrollback;                     // Lines
+    int spill_mb;
+    const Renderer *renderer;
+    int renderer_forced;                // Chosen with --renderer: no automatic switch to shm
+} WinOptions;
+
+void window_defaults(WinOptions *o);
+int window_option(WinOptions *o, int argc, char *argv[], int *argi);
+// Opens a window running cmd (NULL: the shell) with environment env (NULL:
+// ours) in directory cwd (NULL: ours). Returns NULL, with the reason in
+// err, if it couldn't be opened.
+Win *window_open(const WinOptions *o, char *const *cmd, char *const *env, const char *cwd, char *err, size_t n);
+unsigned long window_id(const Win *w);  // The X window
+
+// What a window takes, in bytes; see daemon.c.
+typedef struct {
+    unsigned long xid;                  // The X window
+    TermMemory term;
+    size_t snapshots, render_cpu, render_gpu;
+    const char *renderer;
+} WinMemory;
+int window_count(void);
+void window_memory(int i, WinMemory *m);
+
+// The event loop (xst.c) sleeps in epoll on the X connection, the IO
+// thread's wakes and the fds watched here, and runs until loop_quit, or,
+// unless `keep` is set, until the last window closes.
+void loop_watch(int fd, void (*fn)(int fd));
+void loop_unwatch(int fd);
+void loop_quit(void);
+void loop_run(int keep);
+int display_open(const char *name, char *err, size_t n);   // Once, before the first window
+
+int daemon_run(const WinOptions *defaults, const char *font_path, int font_size);   // Serves xstc until SIGTERM/SIGINT
+
+#endif
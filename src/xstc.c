@@ -0,0 +1,81 @@
+// xstc.c - Opens a window in a running xst --daemon.
+//
+// ./xstc [xst options]   new window, in this directory and environment
+// ./xstc --list          the daemon's windows and their memory
+
+#define _GNU_SOURCE             // struct ucred
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "daemon.h"
+
+extern char **environ;
+
+static int send_str(int fd, const char *s) {
+    size_t n = strlen(s) + 1;
+    while (n > 0) {
+        ssize_t w = write(fd, s, n);
+        if (w <= 0) return 0;
+        s += w;
+        n -= w;
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (!daemon_socket_path(addr.sun_path, sizeof(addr.sun_path))) {
+        fprintf(stderr, "xstc: %s\n", addr.sun_path);
+        return 1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "xstc: no daemon on %s (start one with 'xst --daemon')\n", addr.sun_path);
+        return 1;
+    }
+    // The environment goes only to a daemon of this user's.
+    if (!daemon_peer_ok(fd)) {
+        fprintf(stderr, "xstc: %s belongs to another user\n", addr.sun_path);
+        return 1;
+    }
+
+    int list = argc == 2 && strcmp(argv[1], "--list") == 0, ok;
+    if (list) {
+        ok = send_str(fd, "list");
+    } else {
+        char cwd[PATH_MAX];
+        if (!getcwd(cwd, sizeof(cwd))) snprintf(cwd, sizeof(cwd), "/");
+        ok = send_str(fd, "new") && send_str(fd, cwd);
+        for (char **e = environ; ok && *e; e++) {
+            if (**e) ok = send_str(fd, *e);
+        }
+        ok = ok && send_str(fd, "");
+        for (int i = 1; ok && i < argc; i++) ok = send_str(fd, argv[i]);
+    }
+    if (!ok) {
+        perror("xstc");
+        return 1;
+    }
+    shutdown(fd, SHUT_WR);
+
+    // The list goes to stdout as it comes; a new window only says
+    // whether it opened.
+    char buf[4096];
+    size_t len = 0;
+    ssize_t r;
+    while ((r = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0) {
+        if (list) fwrite(buf, 1, r, stdout);
+        else if ((len += r) == sizeof(buf) - 1) break;
+    }
+    close(fd);
+    if (list) return 0;
+    buf[len] = '\0';
+    if (strncmp(buf, "ok ", 3) == 0) return 0;
+    fprintf(stderr, "xstc: %s", len ? buf : "no answer from the daemon\n");
+    return 1;
+}